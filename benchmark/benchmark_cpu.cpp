@@ -0,0 +1,421 @@
+#include "catch.hpp"
+#include "control.hpp"
+#include "cpu.hpp"
+#include "graphics.hpp"
+#include "input.hpp"
+#include "rom.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <cstddef>
+#include <exception>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace
+{
+
+constexpr std::size_t steps = 10000;
+
+constexpr std::pair<const char*, CPU::Engine> engines[] = {
+    {"switch", CPU::Engine::Switch},
+    {"predecoded", CPU::Engine::Predecoded},
+#ifdef THREADED_ENGINE
+    {"threaded", CPU::Engine::Threaded},
+#endif
+#ifdef JIT_ENGINE
+    {"jit", CPU::Engine::Jit},
+#endif
+};
+
+std::vector<std::filesystem::path> list_roms()
+{
+    std::vector<std::filesystem::path> roms;
+
+    for (const auto& entry : std::filesystem::directory_iterator(ROM_DIRECTORY))
+        if (entry.path().extension() == ".ch8")
+            roms.push_back(entry.path());
+
+    std::sort(roms.begin(), roms.end());
+    return roms;
+}
+
+std::size_t run(CPU& cpu, std::size_t limit)
+{
+    try
+    {
+        return cpu.step(limit);
+    }
+    catch (const std::exception&)
+    {
+        // Some ROMs fault when they can't read any input; just stop early
+        return 0;
+    }
+}
+
+} // namespace
+
+TEST_CASE("Construction", "[cpu]")
+{
+    /*
+    * Multi-instance runs construct many CPUs, so both their size and the
+    * time it takes to construct them matter.
+    */
+
+    std::cout << "sizeof(CPU) = " << sizeof(CPU) << " bytes, of which the random number generator takes "
+              << sizeof(CPU_RANDOM_GENERATOR) << std::endl;
+
+    Frame frame;
+    const auto rom = LoadFile(std::string{ROM_DIRECTORY} + "/test_opcode.ch8");
+
+    BENCHMARK_ADVANCED("Constructing a CPU")(Catch::Benchmark::Chronometer meter)
+    {
+        std::vector<Catch::Benchmark::storage_for<CPU>> storage(meter.runs());
+        meter.measure([&](int i) { storage[i].construct(rom, Profile::Legacy, &frame); });
+    };
+}
+
+TEST_CASE("Execution engines", "[cpu]")
+{
+    Frame frame;
+
+    for (const auto& path : list_roms())
+    {
+        const auto rom = LoadFile(path.string());
+
+        for (const auto& [name, engine] : engines)
+        {
+            BENCHMARK_ADVANCED(path.filename().string() + " (" + name + ")")
+            (Catch::Benchmark::Chronometer meter)
+            {
+                std::vector<std::unique_ptr<CPU>> cpus;
+
+                for (int i = 0; i < meter.runs(); ++i)
+                {
+                    cpus.push_back(std::make_unique<CPU>(rom, Profile::Legacy, &frame));
+                    cpus.back()->use_engine(engine);
+                }
+
+                meter.measure([&](int i) { return run(*cpus[i], steps); });
+            };
+        }
+    }
+}
+
+TEST_CASE("Instructions per second", "[cpu]")
+{
+    /*
+    * Runs every ROM for a fixed number of instructions, restarting it
+    * whenever it halts or faults, and reports the throughput of each engine.
+    */
+
+    using clock_type = std::chrono::steady_clock;
+
+    constexpr std::size_t total = 2000000;
+
+    Frame frame;
+
+    std::cout << std::left << std::setw(24) << "ROM";
+    for (const auto& [name, engine] : engines)
+        std::cout << std::right << std::setw(16) << name;
+    std::cout << "   (MIPS)\n";
+
+    for (const auto& path : list_roms())
+    {
+        const auto rom = LoadFile(path.string());
+
+        std::cout << std::left << std::setw(24) << path.filename().string();
+
+        for (const auto& [name, engine] : engines)
+        {
+            std::size_t executed = 0;
+            clock_type::duration elapsed{0};
+
+            while (executed < total)
+            {
+                CPU cpu{rom, Profile::Legacy, &frame};
+                cpu.use_engine(engine);
+
+                const auto start = clock_type::now();
+                const std::size_t n = run(cpu, total - executed);
+                elapsed += clock_type::now() - start;
+
+                // Count the halting instruction so that we always make progress
+                executed += n + 1;
+            }
+
+            const double seconds = std::chrono::duration<double>(elapsed).count();
+
+            std::cout << std::right << std::setw(16) << std::fixed << std::setprecision(2)
+                      << executed / seconds / 1e6;
+        }
+
+        std::cout << std::endl;
+    }
+}
+
+TEST_CASE("Fusion coverage", "[cpu]")
+{
+    /*
+    * Runs every ROM on the predecoded engine and reports the share of
+    * instructions that were executed as part of a superinstruction.
+    */
+
+    constexpr std::size_t total = 2000000;
+
+    Frame frame;
+
+    std::cout << std::left << std::setw(24) << "ROM"
+              << std::right << std::setw(12) << "fused (%)"
+              << std::setw(12) << "drw" << std::setw(12) << "loop" << std::setw(12) << "wait_dt" << '\n';
+
+    for (const auto& path : list_roms())
+    {
+        const auto rom = LoadFile(path.string());
+
+        CPU::Statistics statistics;
+
+        while (statistics.instructions < total)
+        {
+            CPU cpu{rom, Profile::Legacy, &frame};
+            cpu.use_engine(CPU::Engine::Predecoded);
+
+            run(cpu, total - statistics.instructions);
+
+            const CPU::Statistics& s = cpu.read_statistics();
+            // Count the halting instruction so that we always make progress
+            statistics.instructions += s.instructions + 1;
+            statistics.fused += s.fused;
+            statistics.fused_drw += s.fused_drw;
+            statistics.fused_loop += s.fused_loop;
+            statistics.fused_wait_dt += s.fused_wait_dt;
+        }
+
+        std::cout << std::left << std::setw(24) << path.filename().string()
+                  << std::right << std::setw(12) << std::fixed << std::setprecision(2)
+                  << 100.0 * statistics.fused / statistics.instructions
+                  << std::setw(12) << statistics.fused_drw
+                  << std::setw(12) << statistics.fused_loop
+                  << std::setw(12) << statistics.fused_wait_dt << std::endl;
+    }
+}
+
+TEST_CASE("Idle CPU utilization", "[cpu]")
+{
+    /*
+    * Runs ROMs that spend all their time in idle loops for half a second,
+    * and reports the CPU time the thread took with and without parking.
+    */
+
+    using clock_type = std::chrono::steady_clock;
+
+    const std::pair<const char*, std::vector<std::uint8_t>> roms[] = {
+        {"waiting for DT", {
+            0x60, 0x1E, // ld_kk (load 0x1E to V0)
+            0xF0, 0x15, // set_dt (load V0 to DT)
+            0xF1, 0x07, // ld_dt (load DT to V1)
+            0x31, 0x00, // se_x_kk (exit the loop when V1 is 0x00)
+            0x12, 0x04, // jp (jump back to ld_dt)
+            0x12, 0x00, // jp (start over)
+        }},
+        {"waiting for a key", {
+            0xE0, 0x9E, // skp (skip the next instruction if key V0 is pressed)
+            0x12, 0x00, // jp (jump back to skp)
+        }},
+    };
+
+    std::cout << std::left << std::setw(20) << "ROM" << std::setw(12) << "scheduler"
+              << std::right << std::setw(12) << "frequency" << std::setw(16) << "busy (%)"
+              << std::setw(16) << "parked (%)" << '\n';
+
+    for (const auto& [name, rom] : roms)
+    {
+        for (const bool frame_locked : {false, true})
+        {
+            for (const std::size_t frequency : {600, 1000000})
+            {
+                std::cout << std::left << std::setw(20) << name << std::setw(12)
+                          << (frame_locked ? "run_frames" : "run_at") << std::right << std::setw(12) << frequency;
+
+                for (const bool parking : {false, true})
+                {
+                    CPU cpu{rom};
+                    cpu.set_parking(parking);
+
+                    CommandQueue commands;
+                    const std::clock_t cpu_start = std::clock();
+                    const auto start = clock_type::now();
+
+                    std::thread thread{[&cpu, &commands, frame_locked, frequency] {
+                        if (frame_locked)
+                            cpu.run_frames(commands, frequency);
+                        else
+                            cpu.run_at(commands, frequency);
+                    }};
+
+                    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+                    commands.send(CommandQueue::Command::Stop);
+                    thread.join();
+
+                    const double busy = static_cast<double>(std::clock() - cpu_start) / CLOCKS_PER_SEC;
+                    const double elapsed = std::chrono::duration<double>(clock_type::now() - start).count();
+
+                    std::cout << std::setw(16) << std::fixed << std::setprecision(2) << 100 * busy / elapsed;
+                }
+
+                std::cout << std::endl;
+            }
+        }
+    }
+}
+
+TEST_CASE("Key wake-up latency", "[cpu]")
+{
+    /*
+    * Presses a key while a ROM waits in Fx0A, and reports how long it took
+    * until the CPU thread ran the instruction after it (and halted).
+    */
+
+    using clock_type = std::chrono::steady_clock;
+
+    constexpr std::size_t trials = 10;
+
+    const std::vector<std::uint8_t> rom{
+        0xF0, 0x0A, // ld_key (wait for a key, load it to V0)
+        0x12, 0x02, // jp (jump to self)
+    };
+
+    sf::Event::KeyEvent event{};
+    event.code = sf::Keyboard::Numpad5;
+
+    std::cout << std::left << std::setw(12) << "scheduler" << std::setw(12) << "parking"
+              << std::right << std::setw(12) << "mean (ms)" << std::setw(12) << "max (ms)" << '\n';
+
+    for (const bool frame_locked : {false, true})
+    {
+        for (const bool parking : {false, true})
+        {
+            double total = 0;
+            double worst = 0;
+
+            for (std::size_t trial = 0; trial < trials; ++trial)
+            {
+                Keyboard keyboard;
+                CPU cpu{rom, Profile::Legacy, nullptr, &keyboard};
+                cpu.set_parking(parking);
+
+                CommandQueue commands;
+                std::thread thread{[&cpu, &commands, frame_locked] {
+                    if (frame_locked)
+                        cpu.run_frames(commands, 600);
+                    else
+                        cpu.run_at(commands, 600);
+                }};
+
+                // Keys don't arrive in step with the batches or the ticks
+                std::this_thread::sleep_for(std::chrono::milliseconds(100 + 7 * trial));
+
+                const auto pressed = clock_type::now();
+                keyboard.register_keypress(event, true);
+                thread.join();
+
+                const double latency = std::chrono::duration<double, std::milli>(clock_type::now() - pressed).count();
+                total += latency;
+                worst = std::max(worst, latency);
+            }
+
+            std::cout << std::left << std::setw(12) << (frame_locked ? "run_frames" : "run_at")
+                      << std::setw(12) << (parking ? "on" : "off") << std::right << std::setw(12)
+                      << std::fixed << std::setprecision(2) << total / trials << std::setw(12) << worst << std::endl;
+        }
+    }
+}
+
+TEST_CASE("Command latency", "[cpu]")
+{
+    /*
+    * Sends Pause, then Stop, to a running CPU thread, and reports how long
+    * it took to receive the first and to return after the second.
+    */
+
+    using clock_type = std::chrono::steady_clock;
+
+    constexpr std::size_t trials = 10;
+
+    const std::pair<const char*, std::vector<std::uint8_t>> roms[] = {
+        {"busy", {
+            0x70, 0x01, // add_kk (add 0x01 to V0)
+            0x12, 0x00, // jp (jump back to add_kk)
+        }},
+        {"waiting for a key", {
+            0xE0, 0x9E, // skp (skip the next instruction if key V0 is pressed)
+            0x12, 0x00, // jp (jump back to skp)
+        }},
+    };
+
+    std::cout << std::left << std::setw(20) << "ROM" << std::setw(12) << "scheduler" << std::right
+              << std::setw(16) << "pause (ms)" << std::setw(16) << "max (ms)"
+              << std::setw(16) << "stop (ms)" << std::setw(16) << "max (ms)" << '\n';
+
+    for (const auto& [name, rom] : roms)
+    {
+        for (const bool frame_locked : {false, true})
+        {
+            double pause_total = 0;
+            double pause_worst = 0;
+            double stop_total = 0;
+            double stop_worst = 0;
+
+            for (std::size_t trial = 0; trial < trials; ++trial)
+            {
+                Keyboard keyboard;
+                CPU cpu{rom, Profile::Legacy, nullptr, &keyboard};
+                CommandQueue commands;
+
+                std::thread thread{[&cpu, &commands, frame_locked] {
+                    if (frame_locked)
+                        cpu.run_frames(commands, 600);
+                    else
+                        cpu.run_at(commands, 600);
+                }};
+
+                // Commands don't arrive in step with the batches or the ticks
+                std::this_thread::sleep_for(std::chrono::milliseconds(100 + 7 * trial));
+
+                auto sent = clock_type::now();
+                commands.send(CommandQueue::Command::Pause);
+
+                while (commands.pending() != 0)
+                    std::this_thread::yield();
+
+                const double pause = std::chrono::duration<double, std::milli>(clock_type::now() - sent).count();
+                pause_total += pause;
+                pause_worst = std::max(pause_worst, pause);
+
+                commands.send(CommandQueue::Command::Resume);
+                std::this_thread::sleep_for(std::chrono::milliseconds(100 + 7 * trial));
+
+                sent = clock_type::now();
+                commands.send(CommandQueue::Command::Stop);
+                thread.join();
+
+                const double stop = std::chrono::duration<double, std::milli>(clock_type::now() - sent).count();
+                stop_total += stop;
+                stop_worst = std::max(stop_worst, stop);
+            }
+
+            std::cout << std::left << std::setw(20) << name << std::setw(12) << (frame_locked ? "run_frames" : "run_at")
+                      << std::right << std::fixed << std::setprecision(2) << std::setw(16) << pause_total / trials
+                      << std::setw(16) << pause_worst << std::setw(16) << stop_total / trials
+                      << std::setw(16) << stop_worst << std::endl;
+        }
+    }
+}
@@ -0,0 +1,122 @@
+#include "catch.hpp"
+#include "graphics.hpp"
+
+#include <SFML/Graphics.hpp>
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace
+{
+
+// What Frame::render() used to do, one rectangle per lit pixel
+void render_rectangles(sf::RenderTarget& target, const std::array<std::uint64_t, Frame::Lines>& lines)
+{
+    sf::RectangleShape pixel({1.f, 1.f});
+    pixel.setFillColor(sf::Color::White);
+
+    target.clear(sf::Color::Black);
+
+    for (std::size_t i = 0; i < Frame::Lines; ++i)
+    {
+        for (std::size_t j = 0; j < Frame::Columns; ++j)
+        {
+            if (lines[i] & (1ull << j))
+            {
+                pixel.setPosition({static_cast<float>(63 - j), static_cast<float>(i)});
+                target.draw(pixel);
+            }
+        }
+    }
+}
+
+} // namespace
+
+TEST_CASE("Rendering", "[graphics]")
+{
+    /*
+    * Renders a frame the CPU has just presented into an off-screen target
+    * the size of the default window. The sparse screen is a few digits of
+    * a score, about 2% of the pixels on 5 lines; the full screen has all of
+    * them lit. The texture is redrawn on every frame, which only uploads
+    * the lines the sprites cover.
+    */
+
+    const std::vector<std::uint8_t> digit{0xF0, 0x90, 0x90, 0x90, 0xF0};
+    const std::vector<std::uint8_t> block(Frame::Lines, 0xFF);
+
+    const std::pair<const char*, std::vector<std::pair<std::size_t, std::size_t>>> screens[] = {
+        {"sparse", {{24, 2}, {29, 2}, {34, 2}, {39, 2}}},
+        {"full", {{0, 0}, {8, 0}, {16, 0}, {24, 0}, {32, 0}, {40, 0}, {48, 0}, {56, 0}}},
+    };
+
+    sf::RenderTexture target;
+    target.create(Frame::Columns * 10, Frame::Lines * 10);
+    Frame::prepareTarget(target);
+
+    for (const auto& screen : screens)
+    {
+        const std::string name = screen.first;
+        const auto& positions = screen.second; // Lambdas can't capture structured bindings
+        const std::vector<std::uint8_t>& sprite = name == "full" ? block : digit;
+
+        // Column 0 is the most significant bit
+        std::array<std::uint64_t, Frame::Lines> lines = {};
+
+        for (const auto& [x, y] : positions)
+            for (std::size_t i = 0; i < sprite.size() && y + i < Frame::Lines; ++i)
+                lines[y + i] ^= std::uint64_t{sprite[i]} << (Frame::Columns - 8 - x);
+
+        BENCHMARK("rectangles (" + name + ")")
+        {
+            render_rectangles(target, lines);
+            target.display();
+        };
+
+        Frame frame;
+        frame.render(target, true);
+
+        BENCHMARK("texture (" + name + ")")
+        {
+            // Every other frame is blank, which costs the same
+            for (const auto& [x, y] : positions)
+                static_cast<void>(frame.drawSprite<true>(sprite, x, y));
+
+            frame.present();
+            frame.render(target, false);
+            target.display();
+        };
+    }
+}
+
+TEST_CASE("Publishing frames", "[graphics]")
+{
+    /*
+    * What drawing costs the CPU thread: a drw on its own, and a frame of
+    * a typical game, a dozen sprites followed by present().
+    */
+
+    const std::vector<std::uint8_t> digit{0xF0, 0x90, 0x90, 0x90, 0xF0};
+
+    Frame frame;
+
+    BENCHMARK("drw")
+    {
+        return frame.drawSprite<true>(digit, 12, 7);
+    };
+
+    BENCHMARK("12 drw, then present()")
+    {
+        bool collision = false;
+
+        for (std::size_t i = 0; i < 12; ++i)
+            collision |= frame.drawSprite<true>(digit, 5 * i, 2 * i);
+
+        frame.present();
+        return collision;
+    };
+}
@@ -0,0 +1,41 @@
+#include "catch.hpp"
+#include "pacing.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <ratio>
+#include <utility>
+
+TEST_CASE("Tick jitter", "[pacing]")
+{
+    /*
+    * Waits for 2 seconds worth of 60 Hz ticks with each strategy, and
+    * reports how late it woke up. run_frames() sleeps, then spins for 1 ms.
+    */
+
+    using clock_type = std::chrono::steady_clock;
+    using Period = std::chrono::duration<std::int64_t, std::ratio<1, 60>>;
+    using namespace std::chrono_literals;
+
+    constexpr std::pair<const char*, clock_type::duration> strategies[] = {
+        {"sleep", 0ms},
+        {"sleep, then spin for 100 us", 100us},
+        {"sleep, then spin for 1 ms", 1ms},
+    };
+
+    for (const auto& [name, spin] : strategies)
+    {
+        JitterHistogram histogram;
+        const auto start = clock_type::now();
+
+        for (std::int64_t tick = 1; tick <= 120; ++tick)
+        {
+            const auto deadline = start + std::chrono::duration_cast<clock_type::duration>(Period{tick});
+            histogram.record(wait_until<clock_type>(deadline, spin) - deadline);
+        }
+
+        std::cout << name << ":\n";
+        histogram.print(std::cout);
+    }
+}
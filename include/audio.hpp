@@ -0,0 +1,76 @@
+#pragma once
+
+#include "ring.hpp"
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <string>
+
+class Speaker
+{
+    /*
+    * Beeper driven by the sound timer. The CPU thread generates a square
+    * wave in blocks and pushes them into a lock-free ring, from which an
+    * audio sink pulls them on its own thread. Neither side ever waits for
+    * the other: samples that don't fit in the ring are dropped, and a sink
+    * that finds it short plays silence instead and counts an underrun.
+    */
+
+public:
+    static constexpr std::uint32_t SampleRate = 44100;
+    static constexpr std::uint32_t Pitch = 441;        // Hz, so that a period is a whole number of samples
+    static constexpr std::int16_t Amplitude = 0x2000;
+
+    // CPU side, generates seconds of audio, with the tone on for the first tone seconds of it
+    void advance(double seconds, double tone) noexcept;
+    // Set while the CPU is parked and generates nothing, the sink running dry then is no underrun
+    void rest(bool resting) noexcept;
+
+    // Sink side, read() takes as many samples as are buffered, fill() pads them with silence
+    std::size_t read(std::int16_t* samples, std::size_t count) noexcept;
+    void fill(std::int16_t* samples, std::size_t count) noexcept;
+
+    [[nodiscard]] std::size_t buffered() const noexcept;
+    [[nodiscard]] std::uint64_t underruns() const noexcept;
+    [[nodiscard]] std::uint64_t dropped() const noexcept;
+
+private:
+    static constexpr std::size_t BlockSize = 256;
+    static constexpr std::uint32_t Period = SampleRate / Pitch;
+
+    SpscRing<std::int16_t, 8192> ring; // About 186 ms
+
+    // Only touched by the CPU
+    double position = 0;       // Audio generated so far in samples, including a fraction not emitted yet
+    std::uint64_t emitted = 0; // Samples pushed into the ring (or dropped)
+    std::uint32_t phase = 0;   // Samples into the current period of the wave
+
+    std::atomic_bool resting = false;
+    std::atomic_uint64_t underrun_count = 0;
+    std::atomic_uint64_t dropped_count = 0;
+};
+
+class WavSink
+{
+    /*
+    * Writes everything a Speaker generates to a 16-bit mono WAV file, so
+    * that sound can be recorded (and tested) without an audio device. The
+    * header is completed when the sink is destroyed.
+    */
+
+    std::ofstream file;
+    std::uint32_t samples = 0;
+
+public:
+    explicit WavSink(const std::string& path);
+    ~WavSink();
+
+    WavSink(const WavSink&) = delete;
+    WavSink& operator=(const WavSink&) = delete;
+
+    void drain(Speaker& speaker);
+    void write(const std::int16_t* data, std::size_t count);
+};
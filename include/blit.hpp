@@ -0,0 +1,115 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/*
+* XORs the rows of a sprite into consecutive 64-pixel lines, with column 0
+* in the most significant bit, and returns whether it turned a lit pixel
+* off. X is below 64. Columns past the right edge are either clipped or
+* wrapped around to the left edge.
+*
+* BlitScalar() does one row at a time. BlitVector() builds the masks of
+* several rows at once, 4 with AVX2 and 2 with SSE2, as all of them are
+* shifted by the same amount, and ORs together what each row collides
+* with so that there is a single test at the end. Without either, it is
+* BlitScalar().
+*/
+
+[[nodiscard]] constexpr std::uint64_t rotr(std::uint64_t x, std::size_t s) noexcept
+{
+    constexpr auto digits = std::numeric_limits<std::uint64_t>::digits;
+
+    const std::size_t n = s % digits;
+    return (x >> n) | (x << ((digits - n) % digits));
+}
+
+template <bool Clip>
+[[nodiscard]] inline bool BlitScalar(std::uint64_t* Lines, const std::uint8_t* Sprite, std::size_t Rows, std::size_t X) noexcept
+{
+    bool collision = false;
+
+    for (std::size_t i = 0; i < Rows; ++i)
+    {
+        std::uint64_t mask;
+
+        if constexpr (Clip)
+            mask = X <= 56 ? std::uint64_t{Sprite[i]} << (56 - X) : Sprite[i] >> (X - 56);
+        else
+            mask = rotr(Sprite[i], X + 8);
+
+        if (!collision && ((Lines[i] ^ mask) != (Lines[i] | mask)))
+            collision = true;
+
+        Lines[i] ^= mask;
+    }
+
+    return collision;
+}
+
+template <bool Clip>
+[[nodiscard]] inline bool BlitVector(std::uint64_t* Lines, const std::uint8_t* Sprite, std::size_t Rows, std::size_t X) noexcept
+{
+#if defined(__AVX2__) || defined(__SSE2__)
+    // Clipping shifts left then right, wrapping ORs a shift each way; shifts by 64 give 0
+    const std::size_t n = (X + 8) % 64;
+    const __m128i left = _mm_cvtsi32_si128(static_cast<int>(Clip ? (X <= 56 ? 56 - X : 0) : 64 - n));
+    const __m128i right = _mm_cvtsi32_si128(static_cast<int>(Clip ? (X <= 56 ? 0 : X - 56) : n));
+
+    std::size_t i = 0;
+    bool collision;
+
+#if defined(__AVX2__)
+    __m256i collided = _mm256_setzero_si256();
+
+    for (; i + 4 <= Rows; i += 4)
+    {
+        std::uint32_t bytes;
+        std::memcpy(&bytes, Sprite + i, sizeof(bytes));
+
+        const __m256i rows = _mm256_cvtepu8_epi64(_mm_cvtsi32_si128(static_cast<int>(bytes)));
+        const __m256i mask = Clip ? _mm256_srl_epi64(_mm256_sll_epi64(rows, left), right)
+                                  : _mm256_or_si256(_mm256_sll_epi64(rows, left), _mm256_srl_epi64(rows, right));
+
+        auto* const line = reinterpret_cast<__m256i*>(Lines + i);
+        const __m256i pixels = _mm256_loadu_si256(line);
+
+        collided = _mm256_or_si256(collided, _mm256_and_si256(pixels, mask));
+        _mm256_storeu_si256(line, _mm256_xor_si256(pixels, mask));
+    }
+
+    collision = !_mm256_testz_si256(collided, collided);
+#else
+    __m128i collided = _mm_setzero_si128();
+
+    for (; i + 2 <= Rows; i += 2)
+    {
+        const __m128i rows = _mm_set_epi64x(Sprite[i + 1], Sprite[i]);
+        const __m128i mask = Clip ? _mm_srl_epi64(_mm_sll_epi64(rows, left), right)
+                                  : _mm_or_si128(_mm_sll_epi64(rows, left), _mm_srl_epi64(rows, right));
+
+        auto* const line = reinterpret_cast<__m128i*>(Lines + i);
+        const __m128i pixels = _mm_loadu_si128(line);
+
+        collided = _mm_or_si128(collided, _mm_and_si128(pixels, mask));
+        _mm_storeu_si128(line, _mm_xor_si128(pixels, mask));
+    }
+
+    // No ptest before SSE4.1
+    collision = _mm_movemask_epi8(_mm_cmpeq_epi8(collided, _mm_setzero_si128())) != 0xFFFF;
+#endif
+
+    // The last rows that don't fill a register
+    return BlitScalar<Clip>(Lines + i, Sprite + i, Rows - i, X) || collision;
+#else
+    return BlitScalar<Clip>(Lines, Sprite, Rows, X);
+#endif
+}
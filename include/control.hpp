@@ -0,0 +1,90 @@
+#pragma once
+
+#include "ring.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <optional>
+
+class CommandQueue
+{
+    /*
+    * Commands from the UI thread to the CPU thread, which picks them up
+    * between batches. Sending and receiving go through a lock-free ring, so
+    * the running CPU thread never takes a lock to look for commands. Only a
+    * CPU thread that sleeps waits on the condition variable, and send()
+    * takes the mutex just long enough not to lose that wake-up.
+    */
+
+public:
+    enum class Command
+    {
+        Stop,         // run_at() and run_frames() return
+        Pause,        // Stops running instructions, until Resume
+        Resume,
+        Step,         // Runs a single instruction while paused
+        SetFrequency, // To value, with Timing::Uniform
+    };
+
+    struct Request
+    {
+        Command command;
+        std::size_t value;
+    };
+
+    // UI side, false if the queue is full
+    bool send(Command command, std::size_t value = 0)
+    {
+        const Request request{command, value};
+
+        if (requests.push(&request, 1) == 0)
+            return false;
+
+        // A CPU thread about to sleep either sees the request, or is already waiting for this
+        {
+            const std::lock_guard<std::mutex> lock{mutex};
+        }
+
+        sent.notify_all();
+        return true;
+    }
+
+    // Either side, the CPU thread has received everything sent once it is 0
+    [[nodiscard]] std::size_t pending() const noexcept
+    {
+        return requests.size();
+    }
+
+    // CPU side
+    std::optional<Request> receive() noexcept
+    {
+        Request request;
+
+        if (requests.pop(&request, 1) == 0)
+            return std::nullopt;
+
+        return request;
+    }
+
+    // CPU side, sleeps until a request arrives
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock{mutex};
+        sent.wait(lock, [this] { return requests.size() != 0; });
+    }
+
+    // CPU side, true if a request arrived before the deadline
+    bool wait_until(std::chrono::steady_clock::time_point deadline)
+    {
+        std::unique_lock<std::mutex> lock{mutex};
+        return sent.wait_until(lock, deadline, [this] { return requests.size() != 0; });
+    }
+
+private:
+    SpscRing<Request, 64> requests;
+
+    std::mutex mutex;
+    std::condition_variable sent;
+};
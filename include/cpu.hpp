@@ -1,17 +1,32 @@
 #pragma once
 
+#include "control.hpp"
 #include "instruction.hpp"
-#include "timer.hpp"
+#include "jit.hpp"
+#include "machine_state.hpp"
+#include "pacing.hpp"
+#include "quirks.hpp"
 #include "utility.hpp"
 
 #include <array>
+#include <atomic>
+#include <bitset>
+#include <chrono>
 #include <cstddef>
 #include <cstdint>
-#include <future>
-#include <random>
+#include <memory>
+#include <optional>
+#include <string>
 
 class Frame;
 class Keyboard;
+class Speaker;
+struct Recompiled;
+
+// Engine used by newly constructed CPUs, e.g. to run the tests under the JIT
+#ifndef CPU_DEFAULT_ENGINE
+#define CPU_DEFAULT_ENGINE Switch
+#endif
 
 /*
 http://devernay.free.fr/hacks/chip8/C8TECH10.HTM#memmap
@@ -42,86 +57,388 @@ http://devernay.free.fr/hacks/chip8/C8TECH10.HTM#memmap
 
 class CPU
 {
-    bool Modern;
+public:
+    enum class Engine
+    {
+        Switch,    // Decode every instruction before executing it
+        Predecoded, // Cache decoded instructions, invalidated on writes to memory
+#ifdef THREADED_ENGINE
+        Threaded, // Predecoded, dispatched with computed gotos (GCC/Clang only)
+#endif
+#ifdef JIT_ENGINE
+        Jit, // Translate basic blocks to x86-64 machine code
+#endif
+        Recompiled, // Run a ROM translated ahead of time by chip8_recompiler
+    };
+
+    // What a cycle is, i.e. how fast emulated time passes (see MachineState::Cycles)
+    enum class Timing
+    {
+        Uniform,   // Every instruction takes one cycle, at the frequency set by set_frequency()
+        CosmacVIP, // Machine cycles of the VIP, run one instruction at a time (see VipTiming)
+    };
+
+    struct Statistics
+    {
+        std::size_t instructions = 0;  // Instructions executed by step()
+        std::size_t fused = 0;         // Instructions executed as part of a superinstruction
+        std::size_t fused_drw = 0;     // Superinstructions executed, by kind
+        std::size_t fused_loop = 0;
+        std::size_t fused_wait_dt = 0;
+        std::size_t draws = 0;   // Instructions that changed the display (cls, drw)
+        std::size_t skipped = 0; // Instructions of idle loops skipped over while parked
+    };
+
+    // Measured by run_at() and run_frames() once per batch (or tick)
+    struct Pacing
+    {
+        double frequency = 0;                         // Cycles per second, averaged over about a second
+        double instructions = 0;                      // Instructions per second, likewise
+        double speedup = 0;                           // Emulated time over wall time
+        std::chrono::nanoseconds instruction_cost{0}; // Time budgeted for each cycle (see Timing)
+    };
+
+    enum class FaultKind
+    {
+        IllegalInstruction,
+        StackOverflow,
+        StackUnderflow,
+        InvalidAddress,      // PC would be out of range
+        InvalidMemoryAccess, // I (plus the size of the access) is out of range
+    };
 
-    std::array<std::uint8_t, 0x1000> Memory = {}; // 4096 bytes of RAM
-    std::uint16_t VI = 0;                         // 16-bit address register
+    struct Fault
+    {
+        FaultKind kind;
+        std::uint16_t pc;     // Address of the faulting instruction
+        std::uint16_t opcode; // Raw faulting instruction
 
-    std::array<std::uint_fast16_t, 12> Stack; // Stack, up to 12 16-bit addresses
-    std::size_t SP = 0;                       // Stack Pointer
+        // Only formatted on demand, as faults are cheap to record
+        std::string message() const;
+    };
 
-    std::array<std::uint8_t, 16> V = {}; // 16 8-bit data registers (V0, V1, ..., VF)
-    std::uint8_t& VF = V.back();         // Flag register (equivalent to V[0xF])
+    enum class StopReason
+    {
+        BudgetExhausted, // Executed max_instructions
+        Halted,          // Jumped to itself
+        WaitingForKey,   // Fx0A with no key pressed, will be executed again
+        Fault,           // An instruction faulted, see RunResult::fault
+        Reached,         // The run_until() predicate returned true
+    };
 
-    std::uint16_t PC = 0x200; // Program Counter
-    Instruction IP;           // Instruction Pointer
+    struct RunResult
+    {
+        StopReason reason;
+        std::size_t executed;       // Instructions executed
+        std::uint16_t address;      // PC after stopping, i.e. the faulting instruction
+        std::optional<Fault> fault; // Set on StopReason::Fault
+    };
 
-    Timer DT; // Delay Timer
+private:
+    friend struct ::Recompiled;
+
+    MachineState State; // Everything the handlers operate on
+
+    const Profile ActiveProfile;
+
+    Instruction IP;        // Instruction Pointer (the instruction at PC)
+    DecodedInstruction Op; // Instruction being executed
+
+    Engine ActiveEngine = Engine::Switch;
+    Timing ActiveTiming = Timing::Uniform;
+    std::array<DecodedInstruction, 0x1000 / Instruction::width> DecodeCache = {};
 
     Frame* const Display;
     Keyboard* const Input;
+    Speaker* const Sound;
+
+    std::size_t Retired = 1; // Instructions executed by the last call to Execute()
+
+    std::size_t Frequency = 600; // Instructions per second of emulated time, with Timing::Uniform
+    std::uint64_t BatchEnd = 0;  // State.Cycles once the running batch has used up its budget
+
+    Statistics Stats;
+
+    // Written by run_at() and run_frames(), and read from other threads, see read_pacing()
+    std::atomic<double> MeasuredFrequency{0};
+    std::atomic<double> MeasuredInstructions{0};
+    std::atomic<double> MeasuredSpeedup{0};
+    std::atomic<std::int64_t> InstructionCost{0};
+
+    JitterHistogram Jitter;        // Lateness of the ticks of run_frames()
+    PercentileHistogram Deviation; // Of the time between ticks from the period, or of the sleeps of run_at()
+
+    /*
+    * Handlers record faults instead of throwing, so that the engines can
+    * stop cleanly without unwinding. step() turns them into exceptions.
+    */
+    std::optional<Fault> LastFault;
+
+    /*
+    * Everything that depends on the profile is instantiated once for each
+    * of them, and picked by Instantiate() when the CPU is constructed.
+    */
+    struct Instantiation
+    {
+        std::size_t (CPU::*dispatch)(std::size_t Count);
+#ifdef JIT_ENGINE
+        Jit::Helper jit_call;
+#endif
+    };
+
+    const Instantiation Instance;
+
+    static Instantiation Instantiate(Profile Quirks) noexcept;
+    template <Profile P>
+    static constexpr Instantiation Instantiate() noexcept;
+
+    std::size_t Run(std::size_t Count);
+    template <Profile P>
+    std::size_t Dispatch(std::size_t Count);
+    template <Profile P>
+    bool Interpret(std::size_t Budget = 1);
+    template <Profile P>
+    std::uint16_t Execute(std::size_t Budget);
+    bool Advance(std::uint16_t Next);
+    void Fetch(std::uint16_t Address) noexcept;
+    std::uint16_t Raise(FaultKind Kind);
+    [[noreturn]] static void Throw(const Fault& Fault);
+
+    DecodedInstruction Predecoded(std::size_t Budget) noexcept;
+    void InvalidateCache(std::size_t Address, std::size_t Size) noexcept;
+
+#ifdef THREADED_ENGINE
+    template <Profile P>
+    std::size_t Threaded(std::size_t Count);
+#endif
+
+#ifdef JIT_ENGINE
+    std::unique_ptr<Jit> Translator;
 
-    std::mt19937 Generator;
+    template <Profile P>
+    std::size_t RunJit(std::size_t Count);
+    template <Profile P>
+    static std::uint32_t JitCall(void* Context, std::uint32_t Raw, std::uint64_t Budget) noexcept;
+#endif
 
-    bool UpdatePC = true;
+    const Recompiled* Program = nullptr;
+    std::bitset<0x1000> StaleBlocks; // Recompiled blocks that have been overwritten
 
-    bool Execute();
-    void SkipInstructions(int Instructions);
-    void SetPC(std::uint16_t Address);
+    template <Profile P>
+    std::size_t RunRecompiled(std::size_t Count);
 
-    // Instruction set
-    bool jp();
-    bool jp_v0();
-    void call();
-    void ret();
+    template <Profile P>
+    std::size_t RunTimed(std::size_t Count);
+    void Charge(std::uint64_t Cycles) noexcept;
+    RunResult RunCycles(std::uint64_t Cycles);
 
-    void se_x_kk();
-    void se_x_y();
-    void sne_x_kk();
-    void sne_x_y();
+    /*
+    * Every handler returns the address of the next instruction to execute,
+    * which is only fetched by the engine. PC must stay below Limit, so a
+    * single comparison rules out faults, stops and successors past the end
+    * of memory (see Advance).
+    */
+    static constexpr std::uint16_t Limit = 0x1000 - 1;
+    static constexpr std::uint16_t Stop = 0xFFFE;    // Jumped to itself, or waiting for a key
+    static constexpr std::uint16_t Faulted = 0xFFFF; // The handler recorded a fault
 
-    void ld_kk() noexcept;
-    void ld_y() noexcept;
-    void ld_addr() noexcept;
+    std::uint16_t Successor(int Instructions = 1) const noexcept;
 
-    void add_kk() noexcept;
-    void shr() noexcept;
-    void shl() noexcept;
+    /*
+    * Time at the start of the current instruction, Budget being the number
+    * of instructions left in the batch including it. Only emulated time needs
+    * Budget, the engines pass it to the handlers that read the time.
+    */
+    using TimePoint = decltype(MachineState::DT)::time_point;
+    TimePoint Now(std::size_t Budget) const noexcept;
+    TimePoint Now() const noexcept; // Between batches
+    template <typename Clock = TimePoint::clock>
+    TimePoint TimeAt(std::uint64_t Cycles) const noexcept;
+    std::size_t CyclesPerSecond() const noexcept;
+    void PlaySound(TimePoint Until) noexcept;
 
-    void or_y() noexcept;
-    void and_y() noexcept;
-    void xor_y() noexcept;
-    void add_y() noexcept;
-    void sub_y() noexcept;
-    void subn_y() noexcept;
+    TimePoint SoundCursor{}; // Where the audio generated so far ends
 
-    void add_i() noexcept;
+    /*
+    * Turbo mode runs as fast as the host allows. Requests from other threads
+    * take effect between batches, see PollTurbo(). With a wall clock the
+    * timers then count emulated time from TurboEpoch instead, and afterwards
+    * the wall clock shifted by ClockSkew, so that time never jumps. They
+    * always count emulated time with Timing::CosmacVIP.
+    */
+    std::atomic_bool TurboRequested = false;
+    bool Turbo = false;
+    std::uint64_t TurboCycles = 0; // State.Cycles when turbo mode started
+    TimePoint TurboEpoch{};
+    TimePoint::duration ClockSkew{0};
 
-    void rnd();
-    void drw(); // TODO: test
-    void cls(); // TODO: test
+    template <typename Clock = TimePoint::clock>
+    bool PollTurbo() noexcept;
+    void Publish(const RateEstimator& Cycles, const RateEstimator& Instructions) noexcept;
 
-    void str_vx();   // TODO: test
-    void ld_vx();    // TODO: test
-    void str_bcd();  // TODO: test
-    void ld_digit(); // TODO: test
+    /*
+    * Idle loops only read DT or the keys, so they keep doing the same thing
+    * until the one they read changes. run_at() and run_frames() park the
+    * thread instead of running them, see FindIdleLoop().
+    */
+    struct IdleLoop
+    {
+        std::uint16_t first;  // Address of the first instruction
+        std::uint16_t last;   // Address of the jump back to it
+        bool timer;           // Waits for DT to reach a value, otherwise for a key event
+        TimePoint until;      // When DT reaches it
+        std::bitset<16> keys; // Keys pressed when it was found
+        std::uint64_t events; // Key events seen by then
+    };
 
-    void ld_dt() noexcept;  // TODO: test
-    void set_dt() noexcept; // TODO: test
+    bool Parking = true;
+    bool Parked = false; // Until the audio skips over the time spent parked
 
-    void skp_key() noexcept;  // TODO: test
-    void sknp_key() noexcept; // TODO: test
-    void ld_key() noexcept;   // TODO: test
+    std::optional<IdleLoop> FindIdleLoop() const;
+    std::uint16_t IdleStep(std::uint16_t PC, std::array<std::uint8_t, 16>& V, std::uint8_t DT, const std::bitset<16>& Keys) const noexcept;
+    bool LeavesLoop(const IdleLoop& Loop, std::uint16_t PC, std::array<std::uint8_t, 16> V, std::uint8_t DT) const noexcept;
+    RunResult SkipIdle(const IdleLoop& Loop, std::uint64_t Cycles) noexcept;
+    void Park(const IdleLoop& Loop, CommandQueue& Commands, std::chrono::steady_clock::time_point Deadline);
+
+    /*
+    * Commands sent to run_at() and run_frames() are applied between batches
+    * by Obey(). Restart tells them to start pacing over, as time stood still
+    * or the frequency changed.
+    */
+    enum class Interrupt
+    {
+        None,
+        Restart,
+        Stop,
+    };
+
+    bool Paused = false;
+    std::size_t Steps = 0; // Instructions to run while paused
+
+    template <typename Clock = TimePoint::clock>
+    Interrupt Obey(CommandQueue& Commands);
+    RunResult RunPaused(CommandQueue& Commands);
+    void Retime(std::size_t Target);
+
+    // Instruction set, templated on the profile if its behaviour depends on it
+    std::uint16_t jp() noexcept;
+    template <Profile P>
+    std::uint16_t jp_v0() noexcept;
+    std::uint16_t call();
+    std::uint16_t ret();
+
+    std::uint16_t se_x_kk() noexcept;
+    std::uint16_t se_x_y() noexcept;
+    std::uint16_t sne_x_kk() noexcept;
+    std::uint16_t sne_x_y() noexcept;
+
+    std::uint16_t ld_kk() noexcept;
+    std::uint16_t ld_y() noexcept;
+    std::uint16_t ld_addr() noexcept;
+
+    std::uint16_t add_kk() noexcept;
+    template <Profile P>
+    std::uint16_t shr() noexcept;
+    template <Profile P>
+    std::uint16_t shl() noexcept;
+
+    template <Profile P>
+    std::uint16_t or_y() noexcept;
+    template <Profile P>
+    std::uint16_t and_y() noexcept;
+    template <Profile P>
+    std::uint16_t xor_y() noexcept;
+    std::uint16_t add_y() noexcept;
+    std::uint16_t sub_y() noexcept;
+    std::uint16_t subn_y() noexcept;
+
+    std::uint16_t add_i() noexcept;
+
+    std::uint16_t rnd();
+    template <Profile P>
+    std::uint16_t drw(); // TODO: test
+    std::uint16_t cls(); // TODO: test
+
+    template <Profile P>
+    std::uint16_t str_vx();   // TODO: test
+    template <Profile P>
+    std::uint16_t ld_vx();    // TODO: test
+    std::uint16_t str_bcd();  // TODO: test
+    std::uint16_t ld_digit(); // TODO: test
+
+    std::uint16_t ld_dt(std::size_t Budget) noexcept;
+    std::uint16_t set_dt(std::size_t Budget) noexcept;
+    std::uint16_t set_st(std::size_t Budget) noexcept;
+
+    std::uint16_t skp_key() noexcept;  // TODO: test
+    std::uint16_t sknp_key() noexcept; // TODO: test
+    std::uint16_t ld_key() noexcept;   // TODO: test
+
+    // Superinstructions, also set Retired to the number of instructions executed
+    template <Profile P>
+    std::uint16_t fused_drw();
+    std::uint16_t fused_loop();
+    std::uint16_t fused_wait_dt(std::size_t Budget);
 
 public:
     CPU() = delete;
-    CPU(byte_view ROM, bool ModernBehaviour = false, Frame* Display = nullptr, Keyboard* Input = nullptr);
+    CPU(byte_view ROM, Profile Quirks = Profile::Legacy, Frame* Display = nullptr, Keyboard* Input = nullptr,
+        Speaker* Sound = nullptr);
+    void use_engine(Engine engine);
+    void use_timing(Timing timing);
+    void use_program(const Recompiled& program);
+    void seed(std::uint64_t value, std::size_t stream = 0);
+    void set_frequency(std::size_t frequency);
+    void set_turbo(bool enabled) noexcept;
+    void set_parking(bool enabled) noexcept;
+    void load_state(const MachineState& state);
     bool step();
-    void run_at(const std::future<void>& stop_token, std::size_t target_frequency);
+    std::size_t step(std::size_t count);
+    RunResult run(std::size_t max_instructions);
+    template <typename Predicate>
+    RunResult run_until(Predicate predicate, std::size_t max_instructions);
+    RunResult run_until_frame(std::size_t max_instructions);
+    std::optional<Fault> run_at(CommandQueue& commands, std::size_t target_frequency);
+    std::optional<Fault> run_frames(CommandQueue& commands, std::size_t target_frequency);
 
     byte_view read_memory() const noexcept;
     byte_view read_registers() const noexcept;
     data_view<std::uint_fast16_t> read_stack() const noexcept;
     std::uint16_t read_vi() const noexcept;
     std::uint16_t read_pc() const noexcept;
+    const Statistics& read_statistics() const noexcept;
+    Pacing read_pacing() const noexcept;
+    const JitterHistogram& read_jitter() const noexcept;
+    const PercentileHistogram& read_deviation() const noexcept;
+    Profile read_profile() const noexcept;
+    const MachineState& read_state() const noexcept;
 };
+
+template <typename Predicate>
+CPU::RunResult CPU::run_until(Predicate predicate, std::size_t max_instructions)
+{
+    /*
+    * Executes instructions one at a time until predicate(*this) returns
+    * true. Checking after every instruction stops superinstructions and
+    * translated blocks from running past it, so prefer run() when the
+    * exact instruction doesn't matter.
+    */
+
+    std::size_t executed = 0;
+
+    while (executed < max_instructions)
+    {
+        RunResult result = run(1);
+        result.executed += executed;
+
+        if (result.reason != StopReason::BudgetExhausted)
+            return result;
+
+        executed = result.executed;
+
+        if (predicate(static_cast<const CPU&>(*this)))
+            return {StopReason::Reached, executed, State.PC, std::nullopt};
+    }
+
+    return {StopReason::BudgetExhausted, executed, State.PC, std::nullopt};
+}
@@ -6,6 +6,7 @@
 #include <atomic>
 #include <cstddef>
 #include <cstdint>
+#include <memory>
 
 namespace sf
 {
@@ -14,18 +15,61 @@ class RenderTarget;
 
 class Frame
 {
+    struct Canvas;
+
 public:
     static constexpr std::size_t Lines = 0x20;
     static constexpr std::size_t Columns = 0x40;
 
-    // Draws a sprite, with each byte on a separate line
+    // Bit i stands for line i, wide enough for every line
+    using RowMask = std::uint32_t;
+    static_assert(Lines <= 8 * sizeof(RowMask));
+
+    // Draws a sprite, with each byte on a separate line. Columns past the
+    // right edge are either clipped or wrapped around to the left edge
+    template <bool Clip>
     [[nodiscard]] bool drawSprite(byte_view sprite, std::size_t x, std::size_t y);
     void clear();
+
+    // Hands what has been drawn so far to render(), which may run on another thread.
+    // Only call it where the frame is complete, render() never sees what's in between
+    void present();
     void render(sf::RenderTarget& target, bool force);
 
+    // Takes the latest frame like render() does, and returns its lines. Only call it where nothing calls render()
+    std::array<std::uint64_t, Lines> read_presented();
+
     static void prepareTarget(sf::RenderTarget& target);
 
+    Frame();
+    ~Frame();
+
 private:
-    std::array<std::atomic_uint64_t, Lines> buffer = {};
-    std::atomic_bool updated = true;
+    /*
+    * Triple buffering: the CPU draws into buffer with plain stores, and
+    * present() copies it into the back frame and swaps that with the
+    * latest one. render() swaps its front frame with the latest one if it
+    * is new, and reads it with plain loads while the CPU keeps going. The
+    * two threads never touch the same frame, so render() can't see half of
+    * one and half of the next. The latest frame's index comes along with
+    * whether render() has taken it yet, and the lines that changed since
+    * the frame render() took before it.
+    */
+
+    static constexpr std::uint64_t Index = 0x3;
+    static constexpr std::uint64_t Fresh = 0x4;
+    static constexpr std::size_t ChangedShift = 32;
+    static_assert(8 * sizeof(RowMask) <= 64 - ChangedShift);
+
+    std::array<std::uint64_t, Lines> buffer = {}; // Only touched by the CPU
+    RowMask dirty = 0;                            // Lines drawn since the last present(), only touched by the CPU
+    std::size_t back = 0;                         // Only touched by the CPU
+
+    alignas(64) std::array<std::array<std::uint64_t, Lines>, 3> frames = {};
+    alignas(64) std::atomic_uint64_t latest = std::uint64_t{~RowMask{0}} << ChangedShift | Fresh | 2;
+    alignas(64) std::size_t front = 1; // Only touched by render()
+
+    std::unique_ptr<Canvas> canvas; // Only touched by render()
+
+    RowMask take(); // Swaps the latest frame in as the front one, if it is new
 };
@@ -2,17 +2,35 @@
 
 #include <array>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
 #include <optional>
 
 class Keyboard
 {
     std::array<std::atomic_bool, 16> keys = {};
 
+    // Counts key presses and releases, so that other threads can wait for them
+    std::uint64_t events = 0;
+    mutable std::size_t waiters = 0;
+    mutable std::mutex mutex;
+    mutable std::condition_variable changed;
+
 public:
-    Keyboard() = delete;
-    Keyboard(sf::Window& window);
+    // Without a window, keys only come from register_keypress()
+    Keyboard() = default;
+    explicit Keyboard(sf::Window& window);
 
-    void register_keypress(sf::Event::KeyEvent event, bool state) noexcept;
+    void register_keypress(sf::Event::KeyEvent event, bool state);
     bool query_key(int key) const noexcept;
     std::optional<int> query_any() const noexcept;
+
+    std::uint64_t count_events() const;
+    // True if there was an event since count_events() returned seen, false if it timed out
+    bool wait_for_event(std::uint64_t seen, std::chrono::steady_clock::time_point deadline) const;
+    // Threads in wait_for_event(), e.g. a CPU parked in a loop waiting for a key
+    std::size_t count_waiters() const;
 };
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cassert>
+#include <cstddef>
 #include <cstdint>
 
 struct Instruction
@@ -78,3 +79,253 @@ struct Instruction
         return raw & 0x0FFF;
     }
 };
+
+enum class Opcode : std::uint8_t
+{
+    undecoded, // Cache slot that has not been decoded yet (or was invalidated)
+    illegal,
+
+    cls,
+    ret,
+    jp,
+    call,
+    se_x_kk,
+    sne_x_kk,
+    se_x_y,
+    ld_kk,
+    add_kk,
+    ld_y,
+    or_y,
+    and_y,
+    xor_y,
+    add_y,
+    sub_y,
+    shr,
+    subn_y,
+    shl,
+    sne_x_y,
+    ld_addr,
+    jp_v0,
+    rnd,
+    drw,
+    skp_key,
+    sknp_key,
+    ld_dt,
+    ld_key,
+    set_dt,
+    set_st,
+    add_i,
+    ld_digit,
+    str_bcd,
+    str_vx,
+    ld_vx,
+
+    // Superinstructions, each replacing a sequence of 3 instructions
+    fused_drw,    // 6xkk, Annn, Dxyn (sprite setup)
+    fused_loop,   // 7xkk, 3ykk, 1nnn (counted loop)
+    fused_wait_dt // Fx07, 3ykk, 1nnn (delay timer wait)
+};
+
+struct DecodedInstruction
+{
+    /*
+    * An instruction with its handler resolved and its operands already
+    * extracted, so that it can be cached and executed without decoding
+    * the raw opcode again. Fits in 8 bytes.
+    *
+    * Superinstructions pack the operands of all 3 instructions:
+    * fused_drw:     z, kk => 6xkk; nnn => Annn; x, y, n => Dxyn
+    * fused_loop:    x, kk => 7xkk; y, z => 3ykk; nnn => 1nnn
+    * fused_wait_dt: x => Fx07; y, z => 3ykk; nnn => 1nnn
+    */
+
+    Opcode opcode = Opcode::undecoded;
+    std::uint8_t x = 0;
+    std::uint8_t y = 0;
+    std::uint8_t n = 0;
+    std::uint8_t kk = 0;
+    std::uint8_t z = 0; // Extra operand of superinstructions
+    std::uint16_t nnn = 0;
+
+    constexpr DecodedInstruction() noexcept = default;
+
+    constexpr DecodedInstruction(Opcode opcode, Instruction instruction) noexcept
+        : opcode(opcode),
+          x(instruction.x()),
+          y(instruction.y()),
+          n(instruction.n()),
+          kk(instruction.kk()),
+          nnn(instruction.nnn())
+    {
+    }
+};
+
+[[nodiscard]] constexpr Opcode decode_opcode(Instruction instruction) noexcept
+{
+    switch (instruction.group())
+    {
+    case 0x0:
+        switch (instruction.raw)
+        {
+        case 0x00E0:
+            return Opcode::cls;
+        case 0x00EE:
+            return Opcode::ret;
+        }
+        break;
+    case 0x1:
+        return Opcode::jp;
+    case 0x2:
+        return Opcode::call;
+    case 0x3:
+        return Opcode::se_x_kk;
+    case 0x4:
+        return Opcode::sne_x_kk;
+    case 0x5:
+        return Opcode::se_x_y;
+    case 0x6:
+        return Opcode::ld_kk;
+    case 0x7:
+        return Opcode::add_kk;
+    case 0x8:
+        switch (instruction.n())
+        {
+        case 0x0:
+            return Opcode::ld_y;
+        case 0x1:
+            return Opcode::or_y;
+        case 0x2:
+            return Opcode::and_y;
+        case 0x3:
+            return Opcode::xor_y;
+        case 0x4:
+            return Opcode::add_y;
+        case 0x5:
+            return Opcode::sub_y;
+        case 0x6:
+            return Opcode::shr;
+        case 0x7:
+            return Opcode::subn_y;
+        case 0xE:
+            return Opcode::shl;
+        }
+        break;
+    case 0x9:
+        return Opcode::sne_x_y;
+    case 0xA:
+        return Opcode::ld_addr;
+    case 0xB:
+        return Opcode::jp_v0;
+    case 0xC:
+        return Opcode::rnd;
+    case 0xD:
+        return Opcode::drw;
+    case 0xE:
+        switch (instruction.kk())
+        {
+        case 0x9E:
+            return Opcode::skp_key;
+        case 0xA1:
+            return Opcode::sknp_key;
+        }
+        break;
+    case 0xF:
+        switch (instruction.kk())
+        {
+        case 0x07:
+            return Opcode::ld_dt;
+        case 0x0A:
+            return Opcode::ld_key;
+        case 0x15:
+            return Opcode::set_dt;
+        case 0x18:
+            return Opcode::set_st;
+        case 0x1E:
+            return Opcode::add_i;
+        case 0x29:
+            return Opcode::ld_digit;
+        case 0x33:
+            return Opcode::str_bcd;
+        case 0x55:
+            return Opcode::str_vx;
+        case 0x65:
+            return Opcode::ld_vx;
+        }
+        break;
+    }
+
+    return Opcode::illegal;
+}
+
+[[nodiscard]] constexpr DecodedInstruction decode(Instruction instruction) noexcept
+{
+    return {decode_opcode(instruction), instruction};
+}
+
+[[nodiscard]] constexpr std::size_t length(Opcode opcode) noexcept
+{
+    // Maximum number of instructions executed by a single (super)instruction
+    switch (opcode)
+    {
+    case Opcode::fused_drw:
+    case Opcode::fused_loop:
+    case Opcode::fused_wait_dt:
+        return 3;
+    default:
+        return 1;
+    }
+}
+
+[[nodiscard]] constexpr DecodedInstruction fuse(DecodedInstruction first, DecodedInstruction second, DecodedInstruction third, std::uint16_t address) noexcept
+{
+    /*
+    * Returns the superinstruction equivalent to the 3 instructions starting
+    * at address, or first if there isn't one. Sequences that would halt or
+    * fault part way through are not fused, so that a superinstruction never
+    * has to stop in the middle.
+    */
+
+    // Addresses past 0xFFE can't be jumped to (see CPU::Limit)
+    constexpr std::uint16_t limit = 0x1000 - 1;
+    const std::uint16_t next = address + 3 * Instruction::width;
+
+    if (next >= limit)
+        return first;
+
+    DecodedInstruction fused = first;
+    fused.nnn = third.nnn;
+
+    if (first.opcode == Opcode::ld_kk && second.opcode == Opcode::ld_addr && third.opcode == Opcode::drw)
+    {
+        // Out of range sprites throw
+        if (second.nnn + third.n >= 0x1000)
+            return first;
+
+        fused.opcode = Opcode::fused_drw;
+        fused.z = first.x;
+        fused.x = third.x;
+        fused.y = third.y;
+        fused.n = third.n;
+        fused.nnn = second.nnn;
+        return fused;
+    }
+
+    if (second.opcode != Opcode::se_x_kk || third.opcode != Opcode::jp)
+        return first;
+
+    // Jumping to itself halts, addresses past 0xFFE fault
+    if (third.nnn == address + 2 * Instruction::width || third.nnn >= limit)
+        return first;
+
+    fused.y = second.x;
+    fused.z = second.kk;
+
+    if (first.opcode == Opcode::add_kk)
+        fused.opcode = Opcode::fused_loop;
+    else if (first.opcode == Opcode::ld_dt)
+        fused.opcode = Opcode::fused_wait_dt;
+    else
+        return first;
+
+    return fused;
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#ifdef JIT_ENGINE
+
+#include "instruction.hpp"
+#include "quirks.hpp"
+
+#include <array>
+#include <bitset>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/*
+* Translates straight-line CHIP-8 basic blocks into x86-64 machine code.
+*
+* A block starts at any address and ends at the first instruction that
+* changes control flow (jp, call, ret, the skip instructions, jp_v0 and
+* ld_key). Within a block, the most used V registers live in host
+* registers, I lives in r13 and the PC is a constant known at translation
+* time. Instructions that touch the display, the timers, the keyboard or
+* memory are executed by calling back into the interpreter through
+* Target::helper. Anything the translator can't (or won't) handle, including
+* every statically known fault, makes the block exit with Status::Interpret
+* so that the interpreter executes that single instruction and records the
+* usual faults.
+*/
+class Jit
+{
+public:
+    enum class Status : std::uint64_t
+    {
+        Continue,  // PC has been updated, keep going
+        Interpret, // Interpret the instruction at PC, then keep going
+        Fault      // A helper faulted; the interpreter holds the fault
+    };
+
+    // Flags returned by Target::helper
+    static constexpr std::uint32_t Taken = 1;       // Skip condition is true
+    static constexpr std::uint32_t Invalidated = 2; // Translated code was overwritten
+    static constexpr std::uint32_t Failed = 4;      // The instruction faulted
+
+    // budget is what translated code has left, after charging the instruction
+    using Helper = std::uint32_t (*)(void* context, std::uint32_t instruction, std::uint64_t budget) noexcept;
+
+    struct Target
+    {
+        const std::uint8_t* memory; // Guest memory (for decoding only)
+        std::uint8_t* registers;    // V0-VF; every other offset is relative to this
+        std::ptrdiff_t vi;          // std::uint16_t
+        std::ptrdiff_t pc;          // std::uint16_t
+        std::ptrdiff_t sp;          // std::size_t
+        std::ptrdiff_t stack;       // std::uint_fast16_t[StackSize]
+        std::size_t stack_size;
+        Quirks quirks;              // Behaviour of the active profile
+        void* context;              // First argument to helper
+        Helper helper;
+    };
+
+    struct Result
+    {
+        std::uint64_t budget; // Unused budget
+        Status status;
+    };
+
+    explicit Jit(const Target& target);
+    ~Jit();
+
+    Jit(const Jit&) = delete;
+    Jit& operator=(const Jit&) = delete;
+
+    // Executes the block at address, translating it first if needed
+    Result run(std::uint16_t address, std::uint64_t budget);
+
+    // Must be called after every write to guest memory
+    void invalidate(std::size_t address, std::size_t size) noexcept;
+    bool take_invalidated() noexcept;
+
+private:
+    using Block = Result (*)(std::uint8_t* registers, std::uint64_t budget);
+
+    struct Range
+    {
+        std::uint16_t begin;
+        std::uint16_t end;
+    };
+
+    static constexpr std::size_t BufferSize = 4 << 20;
+    static constexpr std::size_t MaxBlockSize = 64; // Instructions
+    static constexpr std::size_t MaxCodeSize = MaxBlockSize * 512 + 4096;
+
+    Target target;
+
+    std::uint8_t* buffer = nullptr;
+    std::size_t used = 0;
+
+    std::array<Block, 0x1000> blocks = {};
+    std::vector<Range> ranges;
+    std::bitset<0x1000> translated;
+    bool invalidated = false;
+
+    Block compile(std::uint16_t address);
+    void flush() noexcept;
+};
+
+#endif
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "random.hpp"
+#include "timer.hpp"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+// Generator used by Cxkk, one of the classes in random.hpp
+#ifndef CPU_RANDOM_GENERATOR
+#define CPU_RANDOM_GENERATOR Xoshiro256
+#endif
+
+// Clock the delay and sound timers count down with, one of the clocks in timer.hpp
+#ifndef CPU_TIMER_CLOCK
+#define CPU_TIMER_CLOCK WallClock
+#endif
+
+struct alignas(64) MachineState
+{
+    /*
+    * Architectural state of a CPU, kept apart from everything that only
+    * speeds up execution (caches, translated code) or connects it to the
+    * outside world (display, keyboard). It can be copied with memcpy, e.g.
+    * to snapshot or clone a VM (see CPU::read_state and CPU::load_state).
+    *
+    * The registers and the stack come first so that they share the first
+    * cache lines, Memory starts on a cache line of its own.
+    */
+
+    std::array<std::uint8_t, 16> V = {}; // 16 8-bit data registers (V0, V1, ..., VF)
+    std::uint16_t PC = 0x200;            // Program Counter
+    std::uint16_t VI = 0;                // 16-bit address register
+    std::size_t SP = 0;                  // Stack Pointer
+    std::uint64_t Cycles = 0;            // Instructions (or VIP machine cycles) executed or waited out, the time base of CycleClock
+
+    std::array<std::uint_fast16_t, 12> Stack = {}; // Stack, up to 12 16-bit addresses
+
+    BasicTimer<CPU_TIMER_CLOCK> DT; // Delay Timer
+    BasicTimer<CPU_TIMER_CLOCK> ST; // Sound Timer, the tone sounds while it is non-zero
+    CPU_RANDOM_GENERATOR Generator;
+
+    alignas(64) std::array<std::uint8_t, 0x1000> Memory = {}; // 4096 bytes of RAM
+
+    // Flag register (equivalent to V[0xF])
+    constexpr std::uint8_t& VF() noexcept
+    {
+        return V.back();
+    }
+};
+
+static_assert(std::is_trivially_copyable_v<MachineState>);
+static_assert(std::is_standard_layout_v<MachineState>);
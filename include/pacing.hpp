@@ -0,0 +1,252 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <iomanip>
+#include <ostream>
+#include <string>
+#include <thread>
+
+class RateEstimator
+{
+    /*
+    * Exponentially weighted moving average of a rate, e.g. instructions per
+    * second. It is updated once per batch, and each batch is weighted by the
+    * time it covers, so the average doesn't depend on how long the batches
+    * are. Samples older than a few time constants are effectively forgotten.
+    */
+
+    double time_constant; // Seconds
+    double average = 0;
+    bool primed = false;
+
+public:
+    explicit RateEstimator(double time_constant) noexcept : time_constant(time_constant) {}
+
+    void update(double events, double seconds) noexcept
+    {
+        if (seconds <= 0)
+            return;
+
+        const double rate = events / seconds;
+
+        if (!primed)
+        {
+            average = rate;
+            primed = true;
+            return;
+        }
+
+        average += (1 - std::exp(-seconds / time_constant)) * (rate - average);
+    }
+
+    [[nodiscard]] double value() const noexcept
+    {
+        return average;
+    }
+};
+
+class PiController
+{
+    /*
+    * Proportional-integral controller with a bounded output. While the
+    * output is saturated the integral is held at the value that just
+    * reaches the bound, otherwise it would keep growing and overshoot once
+    * the error changes sign.
+    */
+
+    double proportional;
+    double integral_gain;
+    double minimum;
+    double maximum;
+    double integral = 0;
+
+public:
+    PiController(double proportional, double integral, double minimum, double maximum) noexcept
+        : proportional(proportional), integral_gain(integral), minimum(minimum), maximum(maximum)
+    {
+    }
+
+    double update(double error, double seconds) noexcept
+    {
+        integral += error * seconds;
+
+        const double output = std::clamp(proportional * error + integral_gain * integral, minimum, maximum);
+        integral = (output - proportional * error) / integral_gain;
+
+        return output;
+    }
+};
+
+template <typename Clock>
+typename Clock::time_point wait_until(typename Clock::time_point deadline, typename Clock::duration spin)
+{
+    /*
+    * Sleeps until spin before the deadline, then busy-waits for the rest.
+    * Sleeping alone can overshoot by up to a scheduler quantum, spinning
+    * alone keeps a core busy all the time. Returns when it actually woke up.
+    */
+
+    if (Clock::now() < deadline - spin)
+        std::this_thread::sleep_until(deadline - spin);
+
+    typename Clock::time_point now;
+    while ((now = Clock::now()) < deadline)
+        ;
+
+    return now;
+}
+
+class JitterHistogram
+{
+    /*
+    * How late periodic wake-ups were. Bucket 0 counts wake-ups less than
+    * 1 us late, bucket i those less than 2^i us late, and the last bucket
+    * everything later than that.
+    */
+
+    std::array<std::uint64_t, 16> buckets = {};
+    std::chrono::nanoseconds worst{0};
+    std::uint64_t total = 0;
+
+public:
+    void record(std::chrono::nanoseconds lateness) noexcept
+    {
+        const auto us = static_cast<std::uint64_t>(std::max<std::int64_t>(lateness.count() / 1000, 0));
+
+        std::size_t bucket = 0;
+        while (bucket < buckets.size() - 1 && us >= (std::uint64_t{1} << bucket))
+            ++bucket;
+
+        ++buckets[bucket];
+        worst = std::max(worst, lateness);
+        ++total;
+    }
+
+    [[nodiscard]] std::uint64_t count(std::size_t bucket) const noexcept
+    {
+        return buckets[bucket];
+    }
+
+    [[nodiscard]] std::uint64_t samples() const noexcept
+    {
+        return total;
+    }
+
+    [[nodiscard]] std::chrono::nanoseconds maximum() const noexcept
+    {
+        return worst;
+    }
+
+    void print(std::ostream& out) const
+    {
+        // One line per non-empty bucket, with a bar scaled to the largest one
+        const std::uint64_t largest = *std::max_element(buckets.cbegin(), buckets.cend());
+
+        for (std::size_t i = 0; i < buckets.size(); ++i)
+        {
+            if (buckets[i] == 0)
+                continue;
+
+            if (i == buckets.size() - 1)
+                out << "    >= " << std::setw(6) << (std::uint64_t{1} << (i - 1)) << " us ";
+            else
+                out << "    <  " << std::setw(6) << (std::uint64_t{1} << i) << " us ";
+
+            out << std::setw(8) << buckets[i] << ' ' << std::string(40 * buckets[i] / largest, '#') << '\n';
+        }
+
+        out << "    worst " << std::chrono::duration<double, std::micro>(worst).count() << " us over "
+            << total << " wake-ups\n";
+    }
+};
+
+class PercentileHistogram
+{
+    /*
+    * Durations in log-linear buckets, for percentiles without keeping every
+    * sample: each power of two microseconds is split into 8 buckets, so a
+    * percentile is at most 12.5% above the true value. Durations under
+    * 8 us get a bucket per microsecond.
+    */
+
+    static constexpr std::size_t Steps = 8;
+
+    std::array<std::uint64_t, 30 * Steps> buckets = {};
+    std::chrono::nanoseconds worst{0};
+    std::uint64_t total = 0;
+
+    static std::size_t index(std::uint64_t us) noexcept
+    {
+        if (us < Steps)
+            return static_cast<std::size_t>(us);
+
+        // The highest bit picks the power of two, the 3 bits below it the step
+        std::size_t shift = 0;
+        while ((us >> shift) >= 2 * Steps)
+            ++shift;
+
+        return std::min<std::size_t>(Steps * (shift + 1) + (us >> shift) - Steps, 30 * Steps - 1);
+    }
+
+    static std::uint64_t upper_bound(std::size_t bucket) noexcept
+    {
+        if (bucket < Steps)
+            return bucket + 1;
+
+        const std::size_t shift = bucket / Steps - 1;
+        return (bucket % Steps + Steps + 1) << shift;
+    }
+
+public:
+    void record(std::chrono::nanoseconds value) noexcept
+    {
+        const auto us = static_cast<std::uint64_t>(std::max<std::int64_t>(value.count() / 1000, 0));
+
+        ++buckets[index(us)];
+        worst = std::max(worst, value);
+        ++total;
+    }
+
+    // Upper bound of the bucket holding the given fraction of the samples, and never above the maximum
+    [[nodiscard]] std::chrono::nanoseconds percentile(double fraction) const noexcept
+    {
+        const auto rank = static_cast<std::uint64_t>(std::ceil(fraction * total));
+        std::uint64_t seen = 0;
+
+        for (std::size_t i = 0; i < buckets.size(); ++i)
+        {
+            seen += buckets[i];
+
+            if (seen >= rank && seen != 0)
+                return std::min<std::chrono::nanoseconds>(std::chrono::microseconds(upper_bound(i)), worst);
+        }
+
+        return worst;
+    }
+
+    [[nodiscard]] std::uint64_t samples() const noexcept
+    {
+        return total;
+    }
+
+    [[nodiscard]] std::chrono::nanoseconds maximum() const noexcept
+    {
+        return worst;
+    }
+
+    void print(std::ostream& out) const
+    {
+        const auto us = [](std::chrono::nanoseconds value) {
+            return std::chrono::duration<double, std::micro>(value).count();
+        };
+
+        out << "    p50 " << us(percentile(0.5)) << " us, p90 "
+            << us(percentile(0.9)) << " us, p99 " << us(percentile(0.99)) << " us, p99.9 "
+            << us(percentile(0.999)) << " us, worst " << us(worst) << " us over " << total << " samples\n";
+    }
+};
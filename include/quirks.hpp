@@ -0,0 +1,66 @@
+#pragma once
+
+/*
+* CHIP-8 was reimplemented many times after the COSMAC VIP, and programs
+* written for later interpreters rely on their differences. A profile
+* selects the behaviour of the CPU as a whole:
+*
+* CosmacVIP:    the original interpreter
+* Chip48:       CHIP-48 on the HP-48 calculators
+* SuperChip:    SUPER-CHIP 1.1, which was based on CHIP-48
+* Modern:       what most programs written for recent interpreters assume
+* Legacy:       what this emulator did before profiles existed, the default: VIP
+*               shifts and loads/stores, but without the VF reset or clipping
+* LegacyModern: what the old -m,--modern flag did, Legacy with Vx shifted in place
+*
+* The CPU is instantiated once per profile (see CPU::Instantiate), so none of these
+* are checked at runtime while executing instructions.
+*/
+enum class Profile
+{
+    CosmacVIP,
+    Chip48,
+    SuperChip,
+    Modern,
+    Legacy,
+    LegacyModern,
+};
+
+struct Quirks
+{
+    enum class Increment
+    {
+        None,    // I is left unchanged
+        X,       // I += x
+        XPlusOne // I += x + 1
+    };
+
+    bool shift_vy;        // 8xy6 & 8xyE shift Vy into Vx, instead of shifting Vx in place
+    Increment load_store; // Amount that Fx55 & Fx65 add to I
+    bool jump_vx;         // Bnnn jumps to xnn + Vx, instead of nnn + V0
+    bool reset_vf;        // 8xy1, 8xy2 & 8xy3 set VF to 0
+    bool clip_sprites;    // Sprites are clipped at the right edge of the screen, instead of wrapping around
+};
+
+[[nodiscard]] constexpr Quirks quirks(Profile profile) noexcept
+{
+    using Increment = Quirks::Increment;
+
+    switch (profile)
+    {
+    case Profile::CosmacVIP:
+        return {true, Increment::XPlusOne, false, true, true};
+    case Profile::Chip48:
+        return {false, Increment::X, true, false, true};
+    case Profile::SuperChip:
+        return {false, Increment::None, true, false, true};
+    case Profile::Legacy:
+        return {true, Increment::XPlusOne, false, false, false};
+    case Profile::LegacyModern:
+        return {false, Increment::XPlusOne, false, false, false};
+    case Profile::Modern:
+        break;
+    }
+
+    return {false, Increment::None, false, false, false};
+}
@@ -0,0 +1,252 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <random>
+
+/*
+* Random number generators for Cxkk. They all have the same interface, so
+* that the CPU can be built with any of them (see CPU_RANDOM_GENERATOR):
+*
+* seed(value): restarts the generator from a 64-bit seed
+* jump():      skips ahead to the start of the next independent stream, so
+*              that CPUs sharing a seed can be given non-overlapping
+*              sequences by jumping a different number of times
+*
+* Each satisfies UniformRandomBitGenerator and returns at least 32 bits.
+*/
+
+[[nodiscard]] constexpr std::uint64_t splitmix64(std::uint64_t& state) noexcept
+{
+    // Expands a single seed into well mixed state words
+    std::uint64_t z = (state += 0x9E3779B97F4A7C15);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+    return z ^ (z >> 31);
+}
+
+class Xoshiro256
+{
+    /*
+    * xoshiro256** 1.0 by David Blackman and Sebastiano Vigna
+    * https://prng.di.unimi.it/xoshiro256starstar.c
+    *
+    * 32 bytes of state, period 2^256 - 1. jump() advances by 2^128 steps.
+    */
+
+    std::uint64_t s[4];
+
+    [[nodiscard]] static constexpr std::uint64_t rotl(std::uint64_t x, int k) noexcept
+    {
+        return (x << k) | (x >> (64 - k));
+    }
+
+public:
+    using result_type = std::uint64_t;
+
+    constexpr explicit Xoshiro256(std::uint64_t value = 0) noexcept : s{}
+    {
+        seed(value);
+    }
+
+    constexpr Xoshiro256(std::uint64_t s0, std::uint64_t s1, std::uint64_t s2, std::uint64_t s3) noexcept
+        : s{s0, s1, s2, s3}
+    {
+    }
+
+    constexpr void seed(std::uint64_t value) noexcept
+    {
+        // Never all zero, as splitmix64 is a bijection of distinct inputs
+        for (auto& word : s)
+            word = splitmix64(value);
+    }
+
+    constexpr result_type operator()() noexcept
+    {
+        const std::uint64_t result = rotl(s[1] * 5, 7) * 9;
+        const std::uint64_t t = s[1] << 17;
+
+        s[2] ^= s[0];
+        s[3] ^= s[1];
+        s[1] ^= s[2];
+        s[0] ^= s[3];
+
+        s[2] ^= t;
+        s[3] = rotl(s[3], 45);
+
+        return result;
+    }
+
+    constexpr void jump() noexcept
+    {
+        constexpr std::uint64_t polynomial[] = {0x180EC6D33CFD0ABA, 0xD5A61266F0C9392C,
+                                                0xA9582618E03FC9AA, 0x39ABDC4529B1661C};
+
+        std::uint64_t t[4] = {};
+
+        for (const std::uint64_t word : polynomial)
+        {
+            for (int b = 0; b < 64; ++b)
+            {
+                if (word & std::uint64_t{1} << b)
+                {
+                    for (int i = 0; i < 4; ++i)
+                        t[i] ^= s[i];
+                }
+
+                operator()();
+            }
+        }
+
+        for (int i = 0; i < 4; ++i)
+            s[i] = t[i];
+    }
+
+    static constexpr result_type min() noexcept
+    {
+        return std::numeric_limits<result_type>::min();
+    }
+
+    static constexpr result_type max() noexcept
+    {
+        return std::numeric_limits<result_type>::max();
+    }
+};
+
+class Pcg32
+{
+    /*
+    * PCG32 (XSH RR 64/32) by Melissa O'Neill
+    * https://www.pcg-random.org/download.html
+    *
+    * 16 bytes of state, period 2^64 for each of 2^63 sequences. jump()
+    * advances by 2^48 steps in O(log n) time.
+    */
+
+    static constexpr std::uint64_t Multiplier = 0x5851F42D4C957F2D;
+
+    std::uint64_t state = 0;
+    std::uint64_t increment = 0;
+
+public:
+    using result_type = std::uint32_t;
+
+    constexpr explicit Pcg32(std::uint64_t value = 0, std::uint64_t sequence = 0xDA3E39CB94B95BDB) noexcept
+    {
+        seed(value, sequence);
+    }
+
+    constexpr void seed(std::uint64_t value, std::uint64_t sequence = 0xDA3E39CB94B95BDB) noexcept
+    {
+        state = 0;
+        increment = sequence << 1 | 1;
+        operator()();
+        state += value;
+        operator()();
+    }
+
+    constexpr result_type operator()() noexcept
+    {
+        const std::uint64_t old = state;
+        state = old * Multiplier + increment;
+
+        const auto xorshifted = static_cast<std::uint32_t>(((old >> 18) ^ old) >> 27);
+        const auto rotation = static_cast<std::uint32_t>(old >> 59);
+        return (xorshifted >> rotation) | (xorshifted << ((-rotation) & 31));
+    }
+
+    constexpr void advance(std::uint64_t delta) noexcept
+    {
+        // Brown, "Random Number Generation with Arbitrary Strides" (1994)
+        std::uint64_t multiplier = Multiplier;
+        std::uint64_t plus = increment;
+        std::uint64_t accumulated_multiplier = 1;
+        std::uint64_t accumulated_plus = 0;
+
+        for (; delta > 0; delta >>= 1)
+        {
+            if (delta & 1)
+            {
+                accumulated_multiplier *= multiplier;
+                accumulated_plus = accumulated_plus * multiplier + plus;
+            }
+
+            plus = (multiplier + 1) * plus;
+            multiplier *= multiplier;
+        }
+
+        state = accumulated_multiplier * state + accumulated_plus;
+    }
+
+    constexpr void jump() noexcept
+    {
+        advance(std::uint64_t{1} << 48);
+    }
+
+    static constexpr result_type min() noexcept
+    {
+        return std::numeric_limits<result_type>::min();
+    }
+
+    static constexpr result_type max() noexcept
+    {
+        return std::numeric_limits<result_type>::max();
+    }
+};
+
+class MersenneTwister
+{
+    /*
+    * std::mt19937, about 5 KB of state. It has no cheap jump-ahead, so
+    * jump() reseeds from the original seed and the stream number through
+    * std::seed_seq instead, which is the usual way of deriving independent
+    * streams from it.
+    */
+
+    std::mt19937 generator;
+    std::uint64_t initial = 0;
+    std::uint64_t stream = 0;
+
+    void reseed()
+    {
+        std::seed_seq sequence{static_cast<std::uint32_t>(initial), static_cast<std::uint32_t>(initial >> 32),
+                               static_cast<std::uint32_t>(stream), static_cast<std::uint32_t>(stream >> 32)};
+        generator.seed(sequence);
+    }
+
+public:
+    using result_type = std::mt19937::result_type;
+
+    explicit MersenneTwister(std::uint64_t value = 0)
+    {
+        seed(value);
+    }
+
+    void seed(std::uint64_t value)
+    {
+        initial = value;
+        stream = 0;
+        reseed();
+    }
+
+    result_type operator()()
+    {
+        return generator();
+    }
+
+    void jump()
+    {
+        ++stream;
+        reseed();
+    }
+
+    static constexpr result_type min() noexcept
+    {
+        return std::mt19937::min();
+    }
+
+    static constexpr result_type max() noexcept
+    {
+        return std::mt19937::max();
+    }
+};
@@ -0,0 +1,94 @@
+#pragma once
+
+#include "cpu.hpp"
+#include "instruction.hpp"
+#include "utility.hpp"
+
+#include <cstddef>
+#include <cstdint>
+
+struct Recompiled
+{
+    /*
+    * A ROM translated to C++ ahead of time by chip8_recompiler. Every
+    * statically reachable basic block is a label inside a single function,
+    * which the CPU enters instead of the interpreter whenever PC points to
+    * the start of a block. Anything that couldn't be resolved at translation
+    * time (Bnnn targets, overwritten code, faults) is left to the interpreter.
+    */
+
+    // Runs translated code starting at PC, returns the unused budget
+    using Entry = std::size_t (*)(CPU& cpu, std::size_t budget);
+
+    struct Block
+    {
+        std::uint16_t begin; // Address of the first instruction
+        std::uint16_t end;   // Address past the last instruction
+    };
+
+    byte_view rom;
+    Profile profile; // The CPU must use the same profile
+    Entry entry;
+    data_view<Block> blocks;
+
+    /*
+    * Translated code keeps the registers in local variables and only uses
+    * these to synchronise with the CPU.
+    */
+
+    static std::uint8_t* registers(CPU& cpu) noexcept
+    {
+        return cpu.State.V.data();
+    }
+
+    static std::uint16_t& vi(CPU& cpu) noexcept
+    {
+        return cpu.State.VI;
+    }
+
+    static std::uint16_t pc(const CPU& cpu) noexcept
+    {
+        return cpu.State.PC;
+    }
+
+    static bool stale(const CPU& cpu, std::uint16_t address) noexcept
+    {
+        return cpu.StaleBlocks[address];
+    }
+
+    static void leave(CPU& cpu, std::uint16_t address)
+    {
+        cpu.Fetch(address);
+    }
+
+    template <Profile P>
+    static bool execute(CPU& cpu, std::uint16_t address, std::size_t budget)
+    {
+        // Instructions with side effects are run by the interpreter, budget includes this one
+        cpu.Fetch(address);
+        cpu.Interpret<P>(budget);
+
+        // False if the instruction faulted, PC is left pointing to it
+        return !cpu.LastFault;
+    }
+
+    static bool call(CPU& cpu, std::uint16_t address) noexcept
+    {
+        // Overflows are left to the interpreter, which will record the fault
+        if (cpu.State.SP == cpu.State.Stack.size())
+            return false;
+
+        cpu.State.Stack[cpu.State.SP++] = address;
+        return true;
+    }
+
+    static bool ret(CPU& cpu, std::uint16_t& address) noexcept
+    {
+        // Underflows and invalid return addresses are left to the interpreter
+        if (cpu.State.SP == 0 || cpu.State.Stack[cpu.State.SP - 1] + Instruction::width >= cpu.State.Memory.size() - 1)
+            return false;
+
+        address = cpu.State.Stack[--cpu.State.SP] + Instruction::width;
+        return true;
+    }
+};
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "quirks.hpp"
+#include "utility.hpp"
+
+#include <cstddef>
+#include <string>
+
+struct Translation
+{
+    std::string source;             // C++ translation unit defining the program
+    std::size_t blocks = 0;         // Basic blocks translated
+    std::size_t instructions = 0;   // Instructions translated (counted once per block)
+};
+
+/*
+* Translates ROM into C++ that defines `const Recompiled Symbol`, to be
+* compiled and linked with a CPU using the same profile (see recompiled.hpp).
+*/
+Translation RecompileROM(byte_view ROM, const std::string& Symbol, Profile Behaviour);
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+
+template <typename T, std::size_t Capacity>
+class SpscRing
+{
+    /*
+    * Lock-free ring buffer for one producer thread and one consumer thread.
+    * Each side only writes its own index, and publishes it with a release
+    * store after the elements it covers, so neither side ever waits for the
+    * other: push() and pop() just move fewer elements if the ring is full
+    * or empty. The indices live on separate cache lines so that the two
+    * threads don't keep stealing the same line from each other.
+    */
+
+    static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of 2");
+
+    std::array<T, Capacity> slots = {};
+
+    alignas(64) std::atomic_size_t head = 0; // Next slot to read, only written by the consumer
+    alignas(64) std::atomic_size_t tail = 0; // Next slot to write, only written by the producer
+
+public:
+    // Producer side, returns how many elements fit
+    std::size_t push(const T* data, std::size_t count) noexcept
+    {
+        const std::size_t end = tail.load(std::memory_order_relaxed);
+        const std::size_t start = head.load(std::memory_order_acquire);
+
+        count = std::min(count, Capacity - (end - start));
+
+        for (std::size_t i = 0; i < count; ++i)
+            slots[(end + i) % Capacity] = data[i];
+
+        tail.store(end + count, std::memory_order_release);
+        return count;
+    }
+
+    // Consumer side, returns how many elements were available
+    std::size_t pop(T* data, std::size_t count) noexcept
+    {
+        const std::size_t start = head.load(std::memory_order_relaxed);
+        const std::size_t end = tail.load(std::memory_order_acquire);
+
+        count = std::min(count, end - start);
+
+        for (std::size_t i = 0; i < count; ++i)
+            data[i] = slots[(start + i) % Capacity];
+
+        head.store(start + count, std::memory_order_release);
+        return count;
+    }
+
+    // Either side, only a snapshot as the other side keeps going
+    [[nodiscard]] std::size_t size() const noexcept
+    {
+        // The head never passes the tail, so it has to be read first
+        const std::size_t start = head.load(std::memory_order_acquire);
+        return tail.load(std::memory_order_acquire) - start;
+    }
+
+    [[nodiscard]] static constexpr std::size_t capacity() noexcept
+    {
+        return Capacity;
+    }
+};
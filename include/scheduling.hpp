@@ -0,0 +1,19 @@
+#pragma once
+
+#include <optional>
+#include <string>
+
+struct ThreadPolicy
+{
+    /*
+    * How a thread asks to be scheduled. Both are only requests: pinning
+    * fails on a core the process may not run on, and SCHED_FIFO needs
+    * CAP_SYS_NICE or an RLIMIT_RTPRIO, without which the thread raises its
+    * nice priority instead, if even that is permitted.
+    */
+    std::optional<unsigned> core;
+    bool realtime = false;
+};
+
+// Applies Policy to the calling thread and describes what it got. Only Linux is supported
+std::string ApplyPolicy(const ThreadPolicy& Policy);
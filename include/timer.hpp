@@ -2,22 +2,54 @@
 
 #include <chrono>
 #include <cstdint>
+#include <ratio>
 #include <type_traits>
 
-class Timer
+/*
+* Clocks a Timer can count down with:
+*
+* WallClock:  host time, so timers run in real time whatever the CPU does
+* CycleClock: emulated time, worked out from the instructions executed by
+*             the CPU (see CPU::Now), so timers only advance as fast as the
+*             program does and runs are reproducible
+*/
+
+using WallClock = std::conditional<
+    std::chrono::high_resolution_clock::is_steady,
+    std::chrono::high_resolution_clock,
+    std::chrono::steady_clock>::type;
+
+struct CycleClock
 {
-    typedef std::conditional<
-        std::chrono::high_resolution_clock::is_steady,
-        std::chrono::high_resolution_clock,
-        std::chrono::steady_clock>::type clock_t;
+    // Counts 60 Hz ticks, it has no now() as there's no global emulated time
+    using rep = std::int64_t;
+    using period = std::ratio<1, 60>;
+    using duration = std::chrono::duration<rep, period>;
+    using time_point = std::chrono::time_point<CycleClock>;
 
-    clock_t::time_point epoch;
+    static constexpr bool is_steady = true;
+};
+
+template <typename Clock>
+class BasicTimer
+{
+    // Decremented at a rate of 60 Hz until it reaches 0
+    using Tick = std::chrono::duration<std::int64_t, std::ratio<1, 60>>;
+
+public:
+    using clock = Clock;
+    using time_point = typename Clock::time_point;
+
+private:
+    time_point epoch{};
     std::uint8_t value = 0;
 
 public:
-    Timer();
-    ~Timer() = default;
+    void set(std::uint8_t x, time_point now = Clock::now()) noexcept;
+    std::uint8_t read(time_point now = Clock::now()) const noexcept;
 
-    void set(std::uint8_t x) noexcept;
-    std::uint8_t read() const noexcept;
+    // Time left until it reaches 0
+    typename Clock::duration remaining(time_point now = Clock::now()) const noexcept;
 };
+
+using Timer = BasicTimer<WallClock>;
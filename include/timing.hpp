@@ -0,0 +1,114 @@
+#pragma once
+
+#include "instruction.hpp"
+
+#include <cstdint>
+
+struct VipTiming
+{
+    /*
+    * Execution time of CHIP-8 instructions on the COSMAC VIP, counted in
+    * machine cycles of its CDP1802 (8 clock cycles each, at 1.7609 MHz).
+    *
+    * The CDP1861 display raises an interrupt at the start of every 60 Hz
+    * frame, after which it steals one machine cycle for each byte it reads
+    * by DMA. The interpreter's interrupt routine also decrements the timers.
+    * The program gets none of that time, so every frame starts with a fixed
+    * number of stolen cycles. Dxyn waits for that interrupt before
+    * drawing, so at most one sprite is drawn per frame.
+    *
+    * Instruction costs follow the structure of the VIP interpreter: a fixed
+    * fetch and decode overhead, plus the handler, whose loops make some of
+    * them depend on the operands.
+    */
+
+    static constexpr std::uint32_t CyclesPerFrame = 3668; // 1760900 / 8 / 60
+    static constexpr std::uint32_t CyclesPerSecond = CyclesPerFrame * 60;
+    static constexpr std::uint32_t DisplayCycles = 128 * 8; // 8 bytes for each of the 128 lines shown
+    static constexpr std::uint32_t InterruptCycles = 29;    // Interrupt routine, including the timers
+    static constexpr std::uint32_t StolenCycles = DisplayCycles + InterruptCycles;
+
+    static constexpr std::uint32_t FetchCycles = 40;
+
+    // Cost of executing op, given the value of Vx and whether a skip was taken
+    [[nodiscard]] static constexpr std::uint32_t cycles(const DecodedInstruction& op, std::uint8_t vx, bool skipped) noexcept
+    {
+        const std::uint32_t skip = skipped ? 4 : 0;
+
+        switch (op.opcode)
+        {
+        case Opcode::cls:
+            // Clears the 256 bytes of display memory one at a time
+            return FetchCycles + 24 + 3054;
+        case Opcode::ret:
+            return FetchCycles + 10;
+        case Opcode::jp:
+            return FetchCycles + 12;
+        case Opcode::call:
+            return FetchCycles + 26;
+        case Opcode::se_x_kk:
+        case Opcode::sne_x_kk:
+            return FetchCycles + 10 + skip;
+        case Opcode::se_x_y:
+        case Opcode::sne_x_y:
+        case Opcode::skp_key:
+        case Opcode::sknp_key:
+            return FetchCycles + 14 + skip;
+        case Opcode::ld_kk:
+            return FetchCycles + 6;
+        case Opcode::add_kk:
+            return FetchCycles + 10;
+        case Opcode::ld_y:
+        case Opcode::or_y:
+        case Opcode::and_y:
+        case Opcode::xor_y:
+        case Opcode::add_y:
+        case Opcode::sub_y:
+        case Opcode::shr:
+        case Opcode::subn_y:
+        case Opcode::shl:
+            // Executed as a short routine built on the stack
+            return FetchCycles + 44;
+        case Opcode::ld_addr:
+            return FetchCycles + 12;
+        case Opcode::jp_v0:
+            return FetchCycles + 22;
+        case Opcode::rnd:
+            return FetchCycles + 36;
+        case Opcode::drw:
+            return FetchCycles + sprite(op.n, vx % 8);
+        case Opcode::ld_dt:
+        case Opcode::ld_key:
+        case Opcode::set_dt:
+        case Opcode::set_st:
+            return FetchCycles + 10;
+        case Opcode::add_i:
+        case Opcode::ld_digit:
+            return FetchCycles + 16;
+        case Opcode::str_bcd:
+            // Each digit is found by repeated subtraction
+            return FetchCycles + 84 + 16 * (vx / 100 + vx / 10 % 10 + vx % 10);
+        case Opcode::str_vx:
+        case Opcode::ld_vx:
+            return FetchCycles + 14 + 14 * (op.x + 1);
+        case Opcode::undecoded:
+        case Opcode::illegal:
+        case Opcode::fused_drw:
+        case Opcode::fused_loop:
+        case Opcode::fused_wait_dt:
+            break;
+        }
+
+        // Faults, or never decoded one at a time
+        return FetchCycles;
+    }
+
+    // Drawing a sprite of rows bytes, each shifted right shift times
+    [[nodiscard]] static constexpr std::uint32_t sprite(std::uint32_t rows, std::uint32_t shift) noexcept
+    {
+        // Unaligned rows are split over two bytes of display memory
+        const std::uint32_t bytes = shift == 0 ? 1 : 2;
+
+        return 26 + rows * (20 + 8 * bytes + 4 * shift);
+    }
+};
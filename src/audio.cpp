@@ -0,0 +1,133 @@
+#include "audio.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+
+void Speaker::advance(double seconds, double tone) noexcept
+{
+    const double start = position;
+    position += seconds * SampleRate;
+
+    const auto end = static_cast<std::uint64_t>(position);
+    const auto tone_end = static_cast<std::uint64_t>(start + std::max(tone, 0.0) * SampleRate);
+
+    std::array<std::int16_t, BlockSize> block;
+
+    while (emitted < end)
+    {
+        const auto count = static_cast<std::size_t>(std::min<std::uint64_t>(BlockSize, end - emitted));
+
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            if (emitted + i < tone_end)
+            {
+                block[i] = phase < Period / 2 ? Amplitude : -Amplitude;
+                phase = (phase + 1) % Period;
+            }
+            else
+            {
+                // Every beep starts the same way
+                block[i] = 0;
+                phase = 0;
+            }
+        }
+
+        const std::size_t pushed = ring.push(block.data(), count);
+        dropped_count.fetch_add(count - pushed, std::memory_order_relaxed);
+
+        emitted += count;
+    }
+}
+
+void Speaker::rest(bool value) noexcept
+{
+    resting.store(value, std::memory_order_relaxed);
+}
+
+std::size_t Speaker::read(std::int16_t* samples, std::size_t count) noexcept
+{
+    return ring.pop(samples, count);
+}
+
+void Speaker::fill(std::int16_t* samples, std::size_t count) noexcept
+{
+    const std::size_t available = ring.pop(samples, count);
+
+    if (available < count)
+    {
+        std::fill(samples + available, samples + count, 0);
+
+        if (!resting.load(std::memory_order_relaxed))
+            underrun_count.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+std::size_t Speaker::buffered() const noexcept
+{
+    return ring.size();
+}
+
+std::uint64_t Speaker::underruns() const noexcept
+{
+    return underrun_count.load(std::memory_order_relaxed);
+}
+
+std::uint64_t Speaker::dropped() const noexcept
+{
+    return dropped_count.load(std::memory_order_relaxed);
+}
+
+static void WriteLittleEndian(std::ofstream& File, std::uint32_t Value, std::size_t Bytes)
+{
+    for (std::size_t i = 0; i < Bytes; ++i)
+        File.put(static_cast<char>(Value >> (8 * i) & 0xFF));
+}
+
+WavSink::WavSink(const std::string& path) : file(path, std::ios::out | std::ios::binary)
+{
+    if (!file)
+        throw std::runtime_error("Unable to open " + path);
+
+    // The sizes are filled in by the destructor
+    file.write("RIFF", 4);
+    WriteLittleEndian(file, 0, 4);
+    file.write("WAVE", 4);
+
+    file.write("fmt ", 4);
+    WriteLittleEndian(file, 16, 4);                      // Size of this chunk
+    WriteLittleEndian(file, 1, 2);                       // PCM
+    WriteLittleEndian(file, 1, 2);                       // Mono
+    WriteLittleEndian(file, Speaker::SampleRate, 4);     // Samples per second
+    WriteLittleEndian(file, Speaker::SampleRate * 2, 4); // Bytes per second
+    WriteLittleEndian(file, 2, 2);                       // Bytes per sample
+    WriteLittleEndian(file, 16, 2);                      // Bits per sample
+
+    file.write("data", 4);
+    WriteLittleEndian(file, 0, 4);
+}
+
+WavSink::~WavSink()
+{
+    const std::uint32_t size = samples * 2;
+
+    file.seekp(4);
+    WriteLittleEndian(file, 36 + size, 4);
+    file.seekp(40);
+    WriteLittleEndian(file, size, 4);
+}
+
+void WavSink::drain(Speaker& speaker)
+{
+    std::array<std::int16_t, 1024> block;
+
+    for (std::size_t count; (count = speaker.read(block.data(), block.size())) != 0;)
+        write(block.data(), count);
+}
+
+void WavSink::write(const std::int16_t* data, std::size_t count)
+{
+    for (std::size_t i = 0; i < count; ++i)
+        WriteLittleEndian(file, static_cast<std::uint16_t>(data[i]), 2);
+
+    samples += static_cast<std::uint32_t>(count);
+}
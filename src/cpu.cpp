@@ -1,14 +1,22 @@
 #include "cpu.hpp"
+#include "audio.hpp"
 #include "graphics.hpp"
 #include "input.hpp"
+#include "pacing.hpp"
+#include "recompiled.hpp"
+#include "timing.hpp"
 
 #include <algorithm>
+#include <atomic>
+#include <cassert>
 #include <chrono>
-#include <cmath>
-#include <deque>
+#include <exception>
 #include <iomanip>
 #include <iterator>
+#include <limits>
+#include <memory>
 #include <optional>
+#include <random>
 #include <ratio>
 #include <sstream>
 #include <stdexcept>
@@ -35,280 +43,1610 @@ constexpr std::array<std::uint8_t, 80> Font = {
     0xf0, 0x80, 0xf0, 0x80, 0x80  // F
 };
 
-CPU::CPU(byte_view ROM, bool ModernBehaviour, Frame* Display, Keyboard* Input)
-    : Modern(ModernBehaviour), Display(Display), Input(Input)
+#ifndef FUZZING
+static std::uint64_t EntropySeed()
+{
+    /*
+    * Opening std::random_device is much slower than constructing the rest
+    * of the CPU, so it is only read once. Every CPU then gets a different
+    * seed, which the generators mix before use.
+    */
+    static const std::uint64_t base = [] {
+        std::random_device rd;
+        return std::uint64_t{rd()} << 32 | rd();
+    }();
+    static std::atomic_uint64_t counter{0};
+
+    return base + counter.fetch_add(1, std::memory_order_relaxed);
+}
+#endif
+
+CPU::CPU(byte_view ROM, Profile Quirks, Frame* Display, Keyboard* Input, Speaker* Sound)
+    : ActiveProfile(Quirks), Display(Display), Input(Input), Sound(Sound), Instance(Instantiate(Quirks))
+{
+    constexpr std::size_t max_size = 0x1000 - 0x200;
+
+    const std::size_t size = std::min(ROM.size(), max_size);
+    const auto start_address = std::next(State.Memory.begin(), 0x200);
+
+    std::copy(Font.cbegin(), Font.cend(), State.Memory.begin());
+    std::copy_n(ROM.data(), size, start_address);
+
+    IP.read(start_address);
+
+    // Fuzzing must be deterministic
+#ifdef FUZZING
+    seed(0);
+#else
+    seed(EntropySeed());
+#endif
+
+    use_engine(Engine::CPU_DEFAULT_ENGINE);
+
+    SoundCursor = Now();
+}
+
+bool CPU::step()
+{
+    return step(1) == 1;
+}
+
+std::size_t CPU::step(std::size_t count)
+{
+    const std::size_t executed = Run(count);
+
+    if (LastFault)
+        Throw(*std::exchange(LastFault, std::nullopt));
+
+    return executed;
+}
+
+CPU::RunResult CPU::run(std::size_t max_instructions)
+{
+    /*
+    * Executes up to max_instructions in a single batch, so that the engines
+    * keep running their own loops (and superinstructions and translated
+    * blocks can be used), then works out why they stopped. Unlike step(),
+    * faults are returned rather than thrown.
+    */
+
+    const std::size_t executed = Run(max_instructions);
+
+    if (LastFault)
+        return {StopReason::Fault, executed, State.PC, std::exchange(LastFault, std::nullopt)};
+
+    if (executed == max_instructions)
+        return {StopReason::BudgetExhausted, executed, State.PC, std::nullopt};
+
+    // The engines only stop early on self-jumps and on Fx0A
+    const StopReason reason = decode_opcode(IP) == Opcode::ld_key ? StopReason::WaitingForKey : StopReason::Halted;
+    return {reason, executed, State.PC, std::nullopt};
+}
+
+CPU::RunResult CPU::run_until_frame(std::size_t max_instructions)
+{
+    // Stops right after the next instruction that changes the display
+    const std::size_t draws = Stats.draws;
+
+    return run_until([draws](const CPU& cpu) { return cpu.Stats.draws != draws; }, max_instructions);
+}
+
+template <Profile P>
+constexpr CPU::Instantiation CPU::Instantiate() noexcept
+{
+#ifdef JIT_ENGINE
+    return {&CPU::Dispatch<P>, &CPU::JitCall<P>};
+#else
+    return {&CPU::Dispatch<P>};
+#endif
+}
+
+CPU::Instantiation CPU::Instantiate(Profile Quirks) noexcept
+{
+    // The only place where the profile is checked at runtime
+    switch (Quirks)
+    {
+    case Profile::CosmacVIP:
+        return Instantiate<Profile::CosmacVIP>();
+    case Profile::Chip48:
+        return Instantiate<Profile::Chip48>();
+    case Profile::SuperChip:
+        return Instantiate<Profile::SuperChip>();
+    case Profile::Legacy:
+        return Instantiate<Profile::Legacy>();
+    case Profile::LegacyModern:
+        return Instantiate<Profile::LegacyModern>();
+    case Profile::Modern:
+        break;
+    }
+
+    return Instantiate<Profile::Modern>();
+}
+
+std::size_t CPU::Run(std::size_t Count)
+{
+    return (this->*Instance.dispatch)(Count);
+}
+
+template <Profile P>
+std::size_t CPU::Dispatch(std::size_t Count)
+{
+    std::size_t executed = 0;
+
+    if (ActiveTiming == Timing::CosmacVIP)
+    {
+        // Charges every instruction with its own cost instead
+        executed = RunTimed<P>(Count);
+        Stats.instructions += executed;
+        return executed;
+    }
+
+    BatchEnd = State.Cycles + Count;
+
+    switch (ActiveEngine)
+    {
+    case Engine::Switch:
+    case Engine::Predecoded:
+        // Superinstructions execute several instructions at once
+        while (executed < Count && Interpret<P>(Count - executed))
+            executed += Retired;
+        break;
+#ifdef THREADED_ENGINE
+    case Engine::Threaded:
+        executed = Threaded<P>(Count);
+        break;
+#endif
+#ifdef JIT_ENGINE
+    case Engine::Jit:
+        executed = RunJit<P>(Count);
+        break;
+#endif
+    case Engine::Recompiled:
+        executed = RunRecompiled<P>(Count);
+        break;
+    }
+
+    State.Cycles += executed;
+    Stats.instructions += executed;
+    return executed;
+}
+
+template <Profile P>
+bool CPU::Interpret(std::size_t Budget)
+{
+    return Advance(Execute<P>(Budget));
+}
+
+bool CPU::Advance(std::uint16_t Next)
+{
+    // Moves on to the instruction returned by a handler, returns false if the CPU has to stop
+    if (Next >= Limit)
+    {
+        // PC still points to the instruction, unless it ran past the end of memory
+        if (Next != Stop && Next != Faulted)
+            Raise(FaultKind::InvalidAddress);
+
+        return false;
+    }
+
+    Fetch(Next);
+    return true;
+}
+
+void CPU::Fetch(std::uint16_t Address) noexcept
+{
+    assert(Address < Limit);
+
+    State.PC = Address;
+    IP.read(std::next(State.Memory.data(), State.PC));
+}
+
+std::uint16_t CPU::Raise(FaultKind Kind)
+{
+    LastFault = Fault{Kind, State.PC, static_cast<std::uint16_t>(IP.raw)};
+    return Faulted;
+}
+
+void CPU::Throw(const Fault& Fault)
+{
+    if (Fault.kind == FaultKind::IllegalInstruction)
+        throw std::logic_error(Fault.message());
+
+    throw std::out_of_range(Fault.message());
+}
+
+std::string CPU::Fault::message() const
+{
+    std::stringstream message;
+
+    switch (kind)
+    {
+    case FaultKind::IllegalInstruction:
+        message << "Encountered illegal opcode";
+        break;
+    case FaultKind::StackOverflow:
+        message << "Stack overflow caused by opcode";
+        break;
+    case FaultKind::StackUnderflow:
+        message << "Stack underflow caused by opcode";
+        break;
+    case FaultKind::InvalidAddress:
+        message << "Program counter out of range after opcode";
+        break;
+    case FaultKind::InvalidMemoryAccess:
+        message << "Memory access out of range by opcode";
+        break;
+    }
+
+    message << " 0x" << std::setfill('0') << std::hex << std::setw(Instruction::width * 2) << opcode
+            << " at address 0x" << std::setw(3) << pc;
+    return message.str();
+}
+
+namespace
+{
+// Presents the frame on the way out of run_at() and run_frames(), so that
+// whatever the last batch drew is shown however they return
+struct PresentOnExit
+{
+    Frame* Display;
+
+    ~PresentOnExit()
+    {
+        if (Display)
+            Display->present();
+    }
+};
+} // namespace
+
+std::optional<CPU::Fault> CPU::run_at(CommandQueue& commands, std::size_t target_frequency)
+{
+    // Runs until it halts, faults or gets Command::Stop
+
+    const PresentOnExit present{Display};
+
+    using namespace std::chrono;
+    using namespace std::chrono_literals;
+
+    using clock_type = std::conditional<
+        high_resolution_clock::is_steady,
+        high_resolution_clock,
+        steady_clock>::type;
+
+    // The VIP runs at its own speed
+    if (ActiveTiming == Timing::Uniform)
+        set_frequency(target_frequency);
+
+    // Budgets are counted in cycles, i.e. instructions unless the timing is CosmacVIP
+    std::size_t frequency = CyclesPerSecond();
+    auto instruction_cost = duration_cast<clock_type::duration>(1s) / frequency;
+
+    clock_type::time_point start = clock_type::now();
+    clock_type::duration budget = 0s;
+    Deviation = {};
+
+    // Nothing was heard while the CPU wasn't running
+    SoundCursor = Now();
+
+    /*
+    * The measured frequency is averaged over about a second, and a PI
+    * controller scales the instruction cost to bring it to the target, e.g.
+    * if run() can't keep up. Its output is the relative speed-up, bounded so
+    * that a stalled CPU can't make the next batches arbitrarily long.
+    */
+    RateEstimator estimator{1.0};
+    RateEstimator retired{1.0};
+    PiController controller{0.2, 0.5, -0.5, 1.0};
+
+    bool turbo = false;
+    bool woke = false;
+
+    while (true)
+    {
+        /*
+        * The CPU gets a budget equal to the amount of time slept, which is
+        * spent on as many instructions as it can afford in a single batch.
+        * Any budget surplus is carried over to the next cycle. Turbo mode
+        * doesn't sleep, and runs an emulated second at a time.
+        */
+
+        const Interrupt interrupt = Obey(commands);
+
+        if (interrupt == Interrupt::Stop)
+            return std::nullopt;
+
+        if (Paused)
+        {
+            if (const RunResult result = RunPaused(commands); result.reason == StopReason::Halted)
+                return std::nullopt;
+            else if (result.reason == StopReason::Fault)
+                return result.fault;
+
+            continue;
+        }
+
+        if (PollTurbo() != turbo || interrupt == Interrupt::Restart)
+        {
+            // Measurements of the other mode (or from before a pause) would only throw the controller off
+            turbo = Turbo;
+            frequency = CyclesPerSecond();
+            instruction_cost = duration_cast<clock_type::duration>(1s) / frequency;
+            estimator = RateEstimator{1.0};
+            retired = RateEstimator{1.0};
+            controller = PiController{0.2, 0.5, -0.5, 1.0};
+            start = clock_type::now();
+            budget = 0s;
+        }
+
+        const std::optional<IdleLoop> idle = turbo || !Parking ? std::nullopt : FindIdleLoop();
+
+        if (idle)
+        {
+            // Until DT reaches the value the loop waits for, or a key event
+            auto deadline = steady_clock::time_point::max();
+            if (idle->timer)
+                deadline = steady_clock::now() + std::max<steady_clock::duration>(duration_cast<steady_clock::duration>(idle->until - Now()), 50ms);
+
+            Park(*idle, commands, deadline);
+        }
+
+        // A command cuts the sleep short, it is obeyed after the batch for the time slept so far
+        if (!(turbo || idle || woke))
+        {
+            const clock_type::time_point slept = clock_type::now();
+
+            if (!commands.wait_until(steady_clock::now() + 50ms))
+                Deviation.record(duration_cast<nanoseconds>(abs(clock_type::now() - slept - 50ms)));
+        }
+
+        clock_type::time_point end = clock_type::now();
+        const duration<double> elapsed = end - start;
+
+        budget += (end - start);
+        start = std::move(end);
+
+        std::size_t count = frequency;
+
+        if (turbo)
+        {
+            budget = 0s;
+        }
+        else
+        {
+            count = budget / instruction_cost;
+
+            // Right after a key event a frame's worth runs at once on borrowed time, so that the answer to it shows
+            if (woke)
+                count = std::max<std::size_t>(count, std::max<std::size_t>(frequency / 60, 1));
+
+            budget -= count * instruction_cost;
+        }
+
+        woke = idle && !idle->timer;
+
+        const std::uint64_t before = State.Cycles;
+        const std::uint64_t instructions = Stats.instructions;
+        // A loop waiting for a key went on the same way until the key event
+        const RunResult result = idle && !idle->timer ? SkipIdle(*idle, count) : RunCycles(count);
+
+        switch (result.reason)
+        {
+        case StopReason::Halted:
+            PlaySound(Now());
+            return std::nullopt;
+        case StopReason::Fault:
+            return result.fault;
+        case StopReason::WaitingForKey:
+            // Waiting still takes up the rest of the budget
+            State.Cycles = std::max<std::uint64_t>(State.Cycles, before + count);
+            break;
+        default:
+            break;
+        }
+
+        PlaySound(Now());
+
+        estimator.update(State.Cycles - before, elapsed.count());
+        retired.update(Stats.instructions - instructions, elapsed.count());
+        Publish(estimator, retired);
+
+        const double error = 1 - estimator.value() / frequency;
+        const double speedup = controller.update(error, elapsed.count());
+
+        const duration<double> cost{1.0 / (frequency * (1 + speedup))};
+        instruction_cost = duration_cast<clock_type::duration>(cost);
+
+        InstructionCost.store(duration_cast<nanoseconds>(instruction_cost).count(), std::memory_order_relaxed);
+
+        if (Display)
+            Display->present();
+    }
+}
+
+std::optional<CPU::Fault> CPU::run_frames(CommandQueue& commands, std::size_t target_frequency)
+{
+    /*
+    * Runs in lockstep with the 60 Hz tick of the display and the timers:
+    * every tick gets target_frequency / 60 instructions (some get one more
+    * if it doesn't divide evenly), or a frame's worth of machine cycles with
+    * Timing::CosmacVIP, after which the frame is presented and the thread
+    * waits for the next tick. Emulated time then ends exactly on a timer
+    * tick (see CycleClock), so DT is decremented between frames. Turbo mode
+    * doesn't wait, and runs 60 ticks at a time. Like run_at(), it returns
+    * when the program halts or faults, or on Command::Stop.
+    */
+
+    const PresentOnExit present{Display};
+
+    using namespace std::chrono;
+    using namespace std::chrono_literals;
+
+    using clock_type = std::conditional<
+        high_resolution_clock::is_steady,
+        high_resolution_clock,
+        steady_clock>::type;
+
+    using Period = duration<std::int64_t, std::ratio<1, 60>>;
+
+    // Waking up this early and spinning is enough to absorb the usual sleep overshoot
+    constexpr auto spin = duration_cast<clock_type::duration>(1ms);
+
+    if (ActiveTiming == Timing::Uniform)
+        set_frequency(target_frequency);
+
+    std::size_t frequency = CyclesPerSecond();
+    Jitter = {};
+    Deviation = {};
+
+    clock_type::time_point start = clock_type::now();
+    clock_type::time_point last = start;
+    std::uint64_t tick = State.Cycles * 60 / frequency;
+
+    // The previous wake-up, only ticks right after it count towards Deviation
+    clock_type::time_point woke = start;
+    std::int64_t woke_frame = 0;
+
+    RateEstimator estimator{1.0};
+    RateEstimator retired{1.0};
+
+    // Nothing was heard while the CPU wasn't running
+    SoundCursor = Now();
+
+    for (std::int64_t frame = 1;; ++frame)
+    {
+        const Interrupt interrupt = Obey(commands);
+
+        if (interrupt == Interrupt::Stop)
+            return std::nullopt;
+
+        if (Paused)
+        {
+            if (const RunResult result = RunPaused(commands); result.reason == StopReason::Halted)
+                return std::nullopt;
+            else if (result.reason == StopReason::Fault)
+                return result.fault;
+
+            continue;
+        }
+
+        if (interrupt == Interrupt::Restart)
+        {
+            // Steps may have left it in the middle of a tick, which is finished first
+            frequency = CyclesPerSecond();
+            tick = State.Cycles * 60 / frequency;
+            start = clock_type::now();
+            last = start;
+            frame = 1;
+            woke = start;
+            woke_frame = 0;
+        }
+
+        const bool turbo = PollTurbo();
+        const std::optional<IdleLoop> idle = turbo || !Parking ? std::nullopt : FindIdleLoop();
+
+        std::uint64_t ticks = turbo ? 60 : 1;
+
+        // A loop waiting for DT runs ahead to the tick it may leave in, then sleeps through the others
+        if (idle && idle->timer)
+            ticks = std::max<std::int64_t>(duration_cast<Period>(idle->until - Now()).count(), 1);
+
+        // The first cycle of the tick after them, rounding up
+        const std::uint64_t end = ((tick + ticks) * frequency + 59) / 60;
+
+        const std::uint64_t before = State.Cycles;
+        const std::uint64_t instructions = Stats.instructions;
+
+        if (end > State.Cycles)
+        {
+            const RunResult result = RunCycles(end - State.Cycles);
+
+            switch (result.reason)
+            {
+            case StopReason::Halted:
+                PlaySound(Now());
+                return std::nullopt;
+            case StopReason::Fault:
+                return result.fault;
+            default:
+                break;
+            }
+
+            // Waiting for a key still uses up the rest of the tick, the last instruction may overrun it
+            State.Cycles = std::max(State.Cycles, end);
+        }
+
+        tick += ticks;
+        frame += ticks - 1;
+
+        // The ticks run ahead are silent, and are heard while the thread sleeps through them
+        Parked |= idle && ticks > 1;
+        PlaySound(Now());
+
+        if (Display)
+            Display->present();
+
+        const clock_type::time_point ran = clock_type::now();
+        const duration<double> elapsed = ran - last;
+        last = ran;
+
+        estimator.update(State.Cycles - before, elapsed.count());
+        retired.update(Stats.instructions - instructions, elapsed.count());
+        Publish(estimator, retired);
+
+        if (Turbo)
+        {
+            // The next tick is due a period from now if turbo mode ends
+            start = ran - duration_cast<clock_type::duration>(Period{frame});
+            continue;
+        }
+
+        // A loop waiting for a key goes on the same way until the key event, as if the ticks due by then had run
+        if (const std::optional<IdleLoop> waiting = Parking ? FindIdleLoop() : std::nullopt; waiting && !waiting->timer)
+        {
+            Park(*waiting, commands, steady_clock::time_point::max());
+
+            const std::int64_t due = duration_cast<Period>(clock_type::now() - start).count() + 1 - frame;
+
+            if (due > 0)
+            {
+                SkipIdle(*waiting, ((tick + due) * frequency + 59) / 60 - State.Cycles);
+                tick += due;
+                frame += due;
+            }
+        }
+
+        const clock_type::time_point deadline = start + duration_cast<clock_type::duration>(Period{frame});
+
+        if (idle && ticks > 1)
+            Park(*idle, commands, steady_clock::now() + duration_cast<steady_clock::duration>(deadline - spin - clock_type::now()));
+
+        const clock_type::time_point now = wait_until<clock_type>(deadline, spin);
+
+        Jitter.record(duration_cast<nanoseconds>(now - deadline));
+
+        if (woke_frame == frame - 1)
+            Deviation.record(duration_cast<nanoseconds>(abs(now - woke - Period{1})));
+
+        woke = now;
+        woke_frame = frame;
+
+        // Start over after a stall instead of running several ticks back to back
+        if (now - deadline > Period{1})
+        {
+            start = now;
+            frame = 0;
+            woke_frame = 0;
+        }
+    }
+}
+
+std::optional<CPU::IdleLoop> CPU::FindIdleLoop() const
+{
+    /*
+    * An idle loop is a short backward jump over instructions that compare
+    * registers, and either read DT into one of them once (e.g. Fx07, 3x00,
+    * 1nnn) or read the keys (e.g. ExA1, 1nnn). Nothing else changes while it
+    * runs, so it does the same thing over and over until DT or the keys do.
+    * Fx0A waiting for a key press is treated as a loop of one instruction.
+    * Only uniform timing is supported, so that every iteration takes the
+    * same number of cycles.
+    */
+
+    constexpr std::size_t MaxLength = 8;
+
+    if (ActiveTiming != Timing::Uniform)
+        return std::nullopt;
+
+    const auto idle = [](Opcode opcode) {
+        switch (opcode)
+        {
+        case Opcode::ld_dt:
+        case Opcode::se_x_kk:
+        case Opcode::sne_x_kk:
+        case Opcode::se_x_y:
+        case Opcode::sne_x_y:
+        case Opcode::skp_key:
+        case Opcode::sknp_key:
+            return true;
+        default:
+            return false;
+        }
+    };
+
+    const auto at = [this](std::size_t Address) {
+        return decode(Instruction{std::next(State.Memory.data(), Address)});
+    };
+
+    // Fx0A is a loop of its own, see IdleStep()
+    std::optional<IdleLoop> loop;
+
+    if (Input && at(State.PC).opcode == Opcode::ld_key)
+        loop = IdleLoop{State.PC, State.PC, false, {}, {}, 0};
+
+    // Otherwise find the jump back at or after PC
+    for (std::size_t i = 0, address = State.PC; !loop && i < MaxLength && address < Limit; ++i, address += Instruction::width)
+    {
+        const DecodedInstruction op = at(address);
+
+        if (op.opcode == Opcode::jp)
+        {
+            // A jump to itself is a halt, which run() has to see
+            if (op.nnn <= State.PC && op.nnn != address && (State.PC - op.nnn) % Instruction::width == 0 &&
+                address - op.nnn < MaxLength * Instruction::width)
+                loop = IdleLoop{op.nnn, static_cast<std::uint16_t>(address), false, {}, {}, 0};
+
+            break;
+        }
+
+        if (!idle(op.opcode))
+            return std::nullopt;
+    }
+
+    if (!loop)
+        return std::nullopt;
+
+    std::size_t timer_reads = 0;
+    std::size_t key_reads = 0;
+    std::uint8_t timer_register = 0;
+
+    for (std::size_t address = loop->first; address < loop->last; address += Instruction::width)
+    {
+        const DecodedInstruction op = at(address);
+
+        if (!idle(op.opcode))
+            return std::nullopt;
+
+        if (op.opcode == Opcode::ld_dt)
+        {
+            ++timer_reads;
+            timer_register = op.x;
+        }
+        else if (op.opcode == Opcode::skp_key || op.opcode == Opcode::sknp_key)
+        {
+            ++key_reads;
+        }
+    }
+
+    // With both, it could leave as soon as either changes
+    if (timer_reads > 1 || (timer_reads != 0 && key_reads != 0))
+        return std::nullopt;
+
+    // With neither, nothing can get it out of the loop, so there is nothing to wait for
+    if (timer_reads == 0 && key_reads == 0 && at(loop->first).opcode != Opcode::ld_key)
+        return std::nullopt;
+
+    for (std::size_t key = 0; key < loop->keys.size(); ++key)
+        loop->keys[key] = Input && Input->query_key(key);
+
+    loop->events = Input ? Input->count_events() : 0;
+
+    const TimePoint now = Now();
+    const std::uint8_t dt = State.DT.read(now);
+
+    if (LeavesLoop(*loop, State.PC, State.V, dt))
+        return std::nullopt;
+
+    // The audio is generated as the CPU runs, it has to keep up while the tone sounds
+    if (Sound && State.ST.read(now) != 0)
+        return std::nullopt;
+
+    if (timer_reads != 0 && dt != 0)
+    {
+        // The first value of DT it leaves the loop with, the register still holds the one before it
+        for (int value = dt - 1; value >= 0; --value)
+        {
+            std::array<std::uint8_t, 16> V = State.V;
+            V[timer_register] = value + 1;
+
+            if (LeavesLoop(*loop, loop->first, V, value))
+            {
+                using Tick = std::chrono::duration<std::int64_t, std::ratio<1, 60>>;
+
+                loop->timer = true;
+                loop->until = now + State.DT.remaining(now) - std::chrono::duration_cast<TimePoint::duration>(Tick{value});
+                return loop;
+            }
+        }
+
+        // It goes on writing DT to a register until DT reaches 0
+        return std::nullopt;
+    }
+
+    // Only a key can get it out of the loop
+    return loop;
+}
+
+std::uint16_t CPU::IdleStep(std::uint16_t PC, std::array<std::uint8_t, 16>& V, std::uint8_t DT, const std::bitset<16>& Keys) const noexcept
+{
+    // Executes an instruction of an idle loop on a copy of the registers, see FindIdleLoop()
+    const DecodedInstruction op = decode(Instruction{std::next(State.Memory.data(), PC)});
+    const std::uint16_t next = PC + Instruction::width;
+
+    switch (op.opcode)
+    {
+    case Opcode::ld_dt:
+        V[op.x] = DT;
+        return next;
+    case Opcode::se_x_kk:
+        return V[op.x] == op.kk ? next + Instruction::width : next;
+    case Opcode::sne_x_kk:
+        return V[op.x] != op.kk ? next + Instruction::width : next;
+    case Opcode::se_x_y:
+        return V[op.x] == V[op.y] ? next + Instruction::width : next;
+    case Opcode::sne_x_y:
+        return V[op.x] != V[op.y] ? next + Instruction::width : next;
+    case Opcode::skp_key:
+        return V[op.x] < Keys.size() && Keys[V[op.x]] ? next + Instruction::width : next;
+    case Opcode::sknp_key:
+        return V[op.x] < Keys.size() && Keys[V[op.x]] ? next : next + Instruction::width;
+    case Opcode::ld_key:
+        // Executed again until a key is down, leaving the loop
+        return Keys.any() ? next : PC;
+    default:
+        return op.nnn;
+    }
+}
+
+bool CPU::LeavesLoop(const IdleLoop& Loop, std::uint16_t PC, std::array<std::uint8_t, 16> V, std::uint8_t DT) const noexcept
+{
+    // The rest of this iteration, then two more: the registers can only change in the first one
+    const std::size_t steps = 3 * ((Loop.last - Loop.first) / Instruction::width + 1);
+
+    for (std::size_t i = 0; i < steps; ++i)
+    {
+        PC = IdleStep(PC, V, DT, Loop.keys);
+
+        if (PC < Loop.first || PC > Loop.last)
+            return true;
+    }
+
+    return false;
+}
+
+CPU::RunResult CPU::SkipIdle(const IdleLoop& Loop, std::uint64_t Cycles) noexcept
+{
+    /*
+    * Fast-forwards a loop waiting for a key by Cycles instructions, with
+    * the keys it was found with. It doesn't write anything, so only PC
+    * moves: once it has gone round the loop it repeats with a fixed period.
+    */
+
+    const std::size_t length = (Loop.last - Loop.first) / Instruction::width + 1;
+
+    std::array<std::uint8_t, 16> V = State.V;
+    std::uint16_t pc = State.PC;
+    std::uint64_t steps = Cycles;
+
+    const auto step = [&]() {
+        pc = IdleStep(pc, V, 0, Loop.keys);
+    };
+
+    for (std::size_t i = 0; i < length && steps != 0; ++i, --steps)
+        step();
+
+    if (steps != 0)
+    {
+        std::uint64_t period = 0;
+        const std::uint16_t start = pc;
+
+        do
+        {
+            step();
+            ++period;
+        } while (pc != start);
+
+        for (steps %= period; steps != 0; --steps)
+            step();
+    }
+
+    // The loop may have read DT, if it had already reached 0
+    State.V = V;
+    Fetch(pc);
+    State.Cycles += Cycles;
+    Stats.skipped += Cycles;
+
+    return {StopReason::BudgetExhausted, 0, State.PC, std::nullopt};
+}
+
+void CPU::Park(const IdleLoop& Loop, CommandQueue& Commands, std::chrono::steady_clock::time_point Deadline)
+{
+    // Waits in slices, so that turbo requests are picked up as well
+    using namespace std::chrono_literals;
+    using clock_type = std::chrono::steady_clock;
+
+    if (Sound)
+        Sound->rest(true);
+
+    // Key events and commands can't be waited for together, so commands are looked for more often
+    const bool keys = !Loop.timer && Input;
+
+    while (!TurboRequested.load(std::memory_order_relaxed))
+    {
+        const clock_type::time_point now = clock_type::now();
+
+        if (now >= Deadline)
+            break;
+
+        const clock_type::time_point slice = std::min(Deadline, now + (keys ? 10ms : 100ms));
+
+        if (keys)
+        {
+            if (Input->wait_for_event(Loop.events, slice) || Commands.pending() != 0)
+                break;
+        }
+        else if (Commands.wait_until(slice))
+        {
+            break;
+        }
+    }
+
+    if (Sound)
+        Sound->rest(false);
+
+    Parked = true;
+}
+
+void CPU::Publish(const RateEstimator& Cycles, const RateEstimator& Instructions) noexcept
+{
+    // Read by read_pacing() on other threads
+    MeasuredFrequency.store(Cycles.value(), std::memory_order_relaxed);
+    MeasuredInstructions.store(Instructions.value(), std::memory_order_relaxed);
+    MeasuredSpeedup.store(Cycles.value() / CyclesPerSecond(), std::memory_order_relaxed);
+}
+
+void CPU::use_engine(Engine engine)
+{
+    if (engine == Engine::Recompiled && !Program)
+        throw std::logic_error("No recompiled program has been loaded");
+
+#ifdef JIT_ENGINE
+    if (engine == Engine::Jit && !Translator)
+    {
+        const auto offset = [this](const void* field) {
+            return static_cast<const std::uint8_t*>(field) - State.V.data();
+        };
+
+        Jit::Target target;
+        target.memory = State.Memory.data();
+        target.registers = State.V.data();
+        target.vi = offset(&State.VI);
+        target.pc = offset(&State.PC);
+        target.sp = offset(&State.SP);
+        target.stack = offset(State.Stack.data());
+        target.stack_size = State.Stack.size();
+        target.quirks = quirks(ActiveProfile);
+        target.context = this;
+        target.helper = Instance.jit_call;
+
+        Translator = std::make_unique<Jit>(target);
+    }
+#endif
+
+    ActiveEngine = engine;
+}
+
+void CPU::use_timing(Timing timing)
+{
+    // Time carries on from where the previous timing had reached, see TimeAt()
+    const TimePoint now = Now();
+
+    ActiveTiming = timing;
+    TurboEpoch = now;
+    TurboCycles = State.Cycles;
+    ClockSkew += now - Now();
+}
+
+void CPU::use_program(const Recompiled& program)
+{
+    // Translated code is only valid for the exact ROM and profile it was built for
+    if (program.profile != ActiveProfile)
+        throw std::invalid_argument("Recompiled program uses a different profile");
+
+    const auto start_address = std::next(State.Memory.cbegin(), 0x200);
+
+    if (program.rom.size() > State.Memory.size() - 0x200 ||
+        !std::equal(program.rom.cbegin(), program.rom.cend(), start_address))
+        throw std::invalid_argument("Recompiled program doesn't match the loaded ROM");
+
+    Program = &program;
+    StaleBlocks.reset();
+
+    use_engine(Engine::Recompiled);
+}
+
+void CPU::seed(std::uint64_t value, std::size_t stream)
+{
+    // CPUs with the same seed and different streams never share random numbers
+    State.Generator.seed(value);
+
+    for (std::size_t i = 0; i < stream; ++i)
+        State.Generator.jump();
+}
+
+void CPU::set_frequency(std::size_t frequency)
+{
+    // Only changes how fast emulated time passes, run_at() sets it as well
+    if (frequency == 0)
+        throw std::invalid_argument("Frequency must be greater than zero");
+
+    Frequency = frequency;
+}
+
+void CPU::set_turbo(bool enabled) noexcept
+{
+    // Safe to call from any thread, run_at() and run_frames() pick it up after their current batch
+    TurboRequested.store(enabled, std::memory_order_relaxed);
+}
+
+void CPU::set_parking(bool enabled) noexcept
+{
+    // Only run_at() and run_frames() park, and never in turbo mode
+    Parking = enabled;
+}
+
+void CPU::load_state(const MachineState& state)
+{
+    /*
+    * Only the bytes between the first and the last difference in memory
+    * are invalidated, so that restoring a snapshot of the same program keeps
+    * the decoded instructions and the translated code.
+    */
+    const auto& from = State.Memory;
+    const auto& to = state.Memory;
+
+    const std::size_t first = std::mismatch(from.cbegin(), from.cend(), to.cbegin()).first - from.cbegin();
+    const std::size_t last = from.crend() - std::mismatch(from.crbegin(), from.crend(), to.crbegin()).first;
+
+    State = state;
+
+    if (first < last)
+        InvalidateCache(first, last - first);
+
+    IP.read(std::next(State.Memory.data(), State.PC));
+    LastFault.reset();
+}
+
+byte_view CPU::read_memory() const noexcept
+{
+    return {State.Memory.data(), State.Memory.size()};
+}
+
+data_view<std::uint_fast16_t> CPU::read_stack() const noexcept
+{
+    return {State.Stack.data(), State.SP};
+}
+
+byte_view CPU::read_registers() const noexcept
+{
+    return {State.V.data(), State.V.size()};
+}
+
+std::uint16_t CPU::read_vi() const noexcept
+{
+    return State.VI;
+}
+
+std::uint16_t CPU::read_pc() const noexcept
+{
+    return State.PC;
+}
+
+Profile CPU::read_profile() const noexcept
+{
+    return ActiveProfile;
+}
+
+const MachineState& CPU::read_state() const noexcept
+{
+    return State;
+}
+
+const CPU::Statistics& CPU::read_statistics() const noexcept
+{
+    return Stats;
+}
+
+const JitterHistogram& CPU::read_jitter() const noexcept
+{
+    // Not safe to call while run_frames() is running
+    return Jitter;
+}
+
+const PercentileHistogram& CPU::read_deviation() const noexcept
+{
+    // Not safe to call while run_at() or run_frames() is running
+    return Deviation;
+}
+
+CPU::Pacing CPU::read_pacing() const noexcept
+{
+    // Safe to call while run_at() is running on another thread
+    return {MeasuredFrequency.load(std::memory_order_relaxed),
+            MeasuredInstructions.load(std::memory_order_relaxed),
+            MeasuredSpeedup.load(std::memory_order_relaxed),
+            std::chrono::nanoseconds{InstructionCost.load(std::memory_order_relaxed)}};
+}
+
+template <Profile P>
+std::uint16_t CPU::Execute(std::size_t Budget)
+{
+    if (ActiveEngine == Engine::Predecoded)
+        Op = Predecoded(Budget);
+    else
+        Op = decode(IP);
+
+    Retired = 1;
+
+    switch (Op.opcode)
+    {
+    case Opcode::cls:
+        return cls();
+    case Opcode::ret:
+        return ret();
+    case Opcode::jp:
+        return jp();
+    case Opcode::call:
+        return call();
+    case Opcode::se_x_kk:
+        return se_x_kk();
+    case Opcode::sne_x_kk:
+        return sne_x_kk();
+    case Opcode::se_x_y:
+        return se_x_y();
+    case Opcode::ld_kk:
+        return ld_kk();
+    case Opcode::add_kk:
+        return add_kk();
+    case Opcode::ld_y:
+        return ld_y();
+    case Opcode::or_y:
+        return or_y<P>();
+    case Opcode::and_y:
+        return and_y<P>();
+    case Opcode::xor_y:
+        return xor_y<P>();
+    case Opcode::add_y:
+        return add_y();
+    case Opcode::sub_y:
+        return sub_y();
+    case Opcode::shr:
+        return shr<P>();
+    case Opcode::subn_y:
+        return subn_y();
+    case Opcode::shl:
+        return shl<P>();
+    case Opcode::sne_x_y:
+        return sne_x_y();
+    case Opcode::ld_addr:
+        return ld_addr();
+    case Opcode::jp_v0:
+        return jp_v0<P>();
+    case Opcode::rnd:
+        return rnd();
+    case Opcode::drw:
+        return drw<P>();
+    case Opcode::skp_key:
+        return skp_key();
+    case Opcode::sknp_key:
+        return sknp_key();
+    case Opcode::ld_dt:
+        return ld_dt(Budget);
+    case Opcode::ld_key:
+        return ld_key();
+    case Opcode::set_dt:
+        return set_dt(Budget);
+    case Opcode::set_st:
+        return set_st(Budget);
+    case Opcode::add_i:
+        return add_i();
+    case Opcode::ld_digit:
+        return ld_digit();
+    case Opcode::str_bcd:
+        return str_bcd();
+    case Opcode::str_vx:
+        return str_vx<P>();
+    case Opcode::ld_vx:
+        return ld_vx<P>();
+    case Opcode::fused_drw:
+        return fused_drw<P>();
+    case Opcode::fused_loop:
+        return fused_loop();
+    case Opcode::fused_wait_dt:
+        return fused_wait_dt(Budget);
+    case Opcode::undecoded:
+    case Opcode::illegal:
+        break;
+    }
+
+    Raise(FaultKind::IllegalInstruction);
+    return Faulted;
+}
+
+DecodedInstruction CPU::Predecoded(std::size_t Budget) noexcept
+{
+    // Only aligned instructions are cached; jumping to an odd address is legal but rare
+    if (State.PC % Instruction::width != 0)
+        return decode(IP);
+
+    DecodedInstruction& entry = DecodeCache[State.PC / Instruction::width];
+
+    if (entry.opcode == Opcode::undecoded)
+    {
+        entry = decode(IP);
+
+        // Replace common sequences of 3 instructions with a superinstruction
+        if (State.PC + 3u * Instruction::width <= State.Memory.size())
+        {
+            const Instruction second{std::next(State.Memory.data(), State.PC + Instruction::width)};
+            const Instruction third{std::next(State.Memory.data(), State.PC + 2 * Instruction::width)};
+
+            entry = fuse(entry, decode(second), decode(third), State.PC);
+        }
+    }
+
+    // Superinstructions can't be split if there's not enough budget left
+    if (length(entry.opcode) > Budget)
+        return decode(IP);
+
+    return entry;
+}
+
+void CPU::InvalidateCache(std::size_t Address, std::size_t Size) noexcept
 {
-    constexpr std::size_t max_size = 0x1000 - 0x200;
+    /*
+    * Must be called after every write to Memory, otherwise the predecoded
+    * engine will keep executing the old instructions. Writing to byte i
+    * affects the cache slot of the aligned instruction covering it, and the
+    * superinstructions in the 2 slots before it.
+    */
 
-    const std::size_t size = std::min(ROM.size(), max_size);
-    const auto start_address = std::next(Memory.begin(), 0x200);
+    assert(Size > 0 && Address + Size <= State.Memory.size());
 
-    std::copy(Font.cbegin(), Font.cend(), Memory.begin());
-    std::copy_n(ROM.data(), size, start_address);
+    const std::size_t fused_width = 2 * Instruction::width;
+    const std::size_t start = Address > fused_width ? Address - fused_width : 0;
 
-    IP.read(start_address);
+    const auto first = std::next(DecodeCache.begin(), start / Instruction::width);
+    const auto last = std::next(DecodeCache.begin(), (Address + Size - 1) / Instruction::width + 1);
 
-#ifndef FUZZING
-    std::random_device rd;
-    Generator.seed(rd());
+    std::fill(first, last, DecodedInstruction{});
+
+#ifdef JIT_ENGINE
+    if (Translator)
+        Translator->invalidate(Address, Size);
 #endif
+
+    if (Program)
+    {
+        const auto overwritten = [&](const Recompiled::Block& block) {
+            return Address < block.end && block.begin < Address + Size;
+        };
+
+        for (auto block = Program->blocks.cbegin(); block != Program->blocks.cend(); ++block)
+            if (overwritten(*block))
+                StaleBlocks.set(block->begin);
+    }
 }
 
-bool CPU::step()
+template <Profile P>
+std::size_t CPU::RunRecompiled(std::size_t Count)
 {
-    const bool not_finished = Execute();
+    std::size_t executed = 0;
 
-    if (UpdatePC)
-        SkipInstructions(1);
-    else
-        UpdatePC = true;
+    while (executed < Count)
+    {
+        const std::size_t budget = Count - executed;
+        const std::size_t remaining = Program->entry(*this, budget);
+
+        executed += budget - remaining;
+
+        if (LastFault)
+            return executed;
+
+        if (remaining != budget)
+            continue;
 
-    return not_finished;
+        // PC isn't at the start of a block, or the block is longer than the budget
+        if (!Interpret<P>(Count - executed))
+            return executed;
+
+        ++executed;
+    }
+
+    return executed;
 }
 
-void CPU::run_at(const std::future<void>& stop_token, std::size_t target_frequency)
+template <Profile P>
+std::size_t CPU::RunTimed(std::size_t Count)
 {
-    // TODO: Propagate exceptions between threads
+    /*
+    * Executes one instruction at a time through the interpreter, whatever
+    * the engine, and charges each with its cost on the VIP. Nothing runs
+    * while the interrupt at the start of a frame does, and Dxyn waits for
+    * the next one.
+    */
 
-    using namespace std::chrono;
-    using namespace std::chrono_literals;
+    constexpr std::uint64_t Frame = VipTiming::CyclesPerFrame;
+    constexpr std::uint64_t Stolen = VipTiming::StolenCycles;
 
-    using clock_type = std::conditional<
-        high_resolution_clock::is_steady,
-        high_resolution_clock,
-        steady_clock>::type;
+    std::size_t executed = 0;
+
+    for (; executed < Count; ++executed)
+    {
+        const DecodedInstruction op = decode(IP);
+        const std::uint8_t vx = State.V[op.x];
+        const std::uint16_t pc = State.PC;
 
-    auto instruction_cost = duration_cast<clock_type::duration>(1s) / target_frequency;
+        if (op.opcode == Opcode::drw)
+            State.Cycles = (State.Cycles / Frame + 1) * Frame;
 
-    clock_type::time_point start = clock_type::now();
-    clock_type::duration budget = 0s;
+        if (State.Cycles % Frame < Stolen)
+            State.Cycles += Stolen - State.Cycles % Frame;
 
-    // Circular buffer used to calculate average clock speed
-    std::deque<clock_type::time_point> timepoints = {start};
+        // Now() reads State.Cycles
+        BatchEnd = State.Cycles + 1;
 
-    while (true)
+        if (!Interpret<P>(1))
+            break;
+
+        Charge(VipTiming::cycles(op, vx, State.PC == pc + 2 * Instruction::width));
+    }
+
+    return executed;
+}
+
+void CPU::Charge(std::uint64_t Cycles) noexcept
+{
+    // Instructions that run into the next frame are interrupted
+    std::uint64_t frame = State.Cycles / VipTiming::CyclesPerFrame;
+
+    State.Cycles += Cycles;
+
+    while (State.Cycles / VipTiming::CyclesPerFrame > frame)
     {
-        /*
-        * The CPU gets a budget equal to the amount of time slept.
-        * If the next instruction costs less than its budget, then the
-        * instruction cost is subtracted from the budget and the instruction
-        * is executed. Any budget surplus is carried over to the next cycle.
-        */
+        State.Cycles += VipTiming::StolenCycles;
+        ++frame;
+    }
+}
 
-        if (stop_token.wait_for(50ms) == std::future_status::ready)
-            return;
+CPU::RunResult CPU::RunCycles(std::uint64_t Cycles)
+{
+    // Runs for at least Cycles (unless it stops first), the last instruction may overrun
+    if (ActiveTiming == Timing::Uniform)
+        return run(Cycles);
 
-        clock_type::time_point end = clock_type::now();
+    const std::uint64_t end = State.Cycles + Cycles;
 
-        budget += (end - start);
-        start = std::move(end);
+    if (Cycles == 0)
+        return {StopReason::BudgetExhausted, 0, State.PC, std::nullopt};
 
-        while (budget >= instruction_cost)
-        {
-            budget -= instruction_cost;
+    RunResult result = run_until([end](const CPU& cpu) { return cpu.State.Cycles >= end; },
+                                 std::numeric_limits<std::size_t>::max());
 
-            if (!step())
-                return;
+    if (result.reason == StopReason::Reached)
+        result.reason = StopReason::BudgetExhausted;
 
-            timepoints.emplace_front(clock_type::now());
-            if (timepoints.size() > target_frequency * 4)
-                timepoints.pop_back();
-        }
+    return result;
+}
+
+#ifdef JIT_ENGINE
+template <Profile P>
+std::size_t CPU::RunJit(std::size_t Count)
+{
+    std::size_t executed = 0;
 
-        using period = clock_type::duration::period;
+    while (executed < Count)
+    {
+        const std::size_t budget = Count - executed;
+        const Jit::Result result = Translator->run(State.PC, budget);
 
-        const double ticks_elapsed = (timepoints.front() - timepoints.back()).count();
-        const double time_elapsed = ticks_elapsed * period::num / period::den;
-        const std::size_t average = std::round(timepoints.size() / time_elapsed);
+        executed += budget - result.budget;
 
-        // Naive instruction cost adjustment
-        if (average < target_frequency && instruction_cost > clock_type::duration::min() + 500ns)
-            instruction_cost -= 500ns;
-        else if (average > target_frequency && instruction_cost < clock_type::duration::max() - 500ns)
-            instruction_cost += 500ns;
+        // Translated code only updates PC
+        Fetch(State.PC);
 
-        // TODO: Print average clock speed and current instruction cost
-        if (Display)
+        switch (result.status)
         {
-            //Display->WriteString(0, 0, std::to_string(average) + " Hz");
-            //Display->WriteString(1, 0, std::to_string(instruction_cost.count()));
+        case Jit::Status::Continue:
+            break;
+        case Jit::Status::Interpret:
+            if (!Interpret<P>(Count - executed))
+                return executed;
+
+            ++executed;
+            break;
+        case Jit::Status::Fault:
+            // The helper didn't know the PC, and the faulting instruction was already charged
+            LastFault->pc = State.PC;
+            LastFault->opcode = IP.raw;
+            return executed - 1;
         }
     }
-}
 
-byte_view CPU::read_memory() const noexcept
-{
-    return {Memory.data(), Memory.size()};
+    return executed;
 }
 
-data_view<std::uint_fast16_t> CPU::read_stack() const noexcept
+template <Profile P>
+std::uint32_t CPU::JitCall(void* Context, std::uint32_t Raw, std::uint64_t Budget) noexcept
 {
-    return {Stack.data(), SP};
-}
+    /*
+    * Executes an instruction on behalf of translated code. Faults are
+    * recorded as usual and reported to the block, which returns to RunJit()
+    * with the PC of the faulting instruction. Budget already excludes it.
+    */
 
-byte_view CPU::read_registers() const noexcept
-{
-    return {V.data(), V.size()};
+    ++Budget;
+
+    CPU& cpu = *static_cast<CPU*>(Context);
+    cpu.Op = decode(Instruction{static_cast<std::uint16_t>(Raw)});
+
+    switch (cpu.Op.opcode)
+    {
+    case Opcode::skp_key:
+        return cpu.Input && cpu.Input->query_key(cpu.State.V[cpu.Op.x]) ? Jit::Taken : 0;
+    case Opcode::sknp_key:
+        return cpu.Input && !cpu.Input->query_key(cpu.State.V[cpu.Op.x]) ? Jit::Taken : 0;
+    case Opcode::cls:
+        cpu.cls();
+        break;
+    case Opcode::rnd:
+        cpu.rnd();
+        break;
+    case Opcode::drw:
+        cpu.drw<P>();
+        break;
+    case Opcode::ld_dt:
+        cpu.ld_dt(Budget);
+        break;
+    case Opcode::set_dt:
+        cpu.set_dt(Budget);
+        break;
+    case Opcode::set_st:
+        cpu.set_st(Budget);
+        break;
+    case Opcode::str_bcd:
+        cpu.str_bcd();
+        break;
+    case Opcode::str_vx:
+        cpu.str_vx<P>();
+        break;
+    case Opcode::ld_vx:
+        cpu.ld_vx<P>();
+        break;
+    default:
+        assert(false);
+        break;
+    }
+
+    if (cpu.LastFault)
+        return Jit::Failed;
+
+    return cpu.Translator->take_invalidated() ? Jit::Invalidated : 0;
 }
+#endif
 
-std::uint16_t CPU::read_vi() const noexcept
+std::uint16_t CPU::Successor(int Instructions) const noexcept
 {
-    return VI;
+    // Never past 0x1004, so Advance() can tell if it's out of range
+    return State.PC + Instructions * Instruction::width;
 }
 
-std::uint16_t CPU::read_pc() const noexcept
+CPU::TimePoint CPU::Now() const noexcept
 {
-    return PC;
+    return TimeAt(State.Cycles);
 }
 
-bool CPU::Execute()
+template <typename Clock>
+CPU::TimePoint CPU::TimeAt([[maybe_unused]] std::uint64_t Cycles) const noexcept
 {
-    switch (IP.group())
+    if constexpr (std::is_same_v<Clock, CycleClock>)
+    {
+        // Ticks fall on the same instructions wherever DT was set, like the VIP's 60 Hz interrupt
+        return TimePoint{typename Clock::duration(Cycles * 60 / CyclesPerSecond())};
+    }
+    else
     {
-    case 0x0:
-        switch (IP.raw)
+        if (ActiveTiming == Timing::CosmacVIP)
         {
-        case 0x00E0:
-            cls();
-            return true;
-        case 0x00EE:
-            ret();
-            return true;
+            // The VIP's timers tick with its 60 Hz interrupt, on frame boundaries, even with a wall clock.
+            // A frame is rounded up to a whole duration, so that the timers count exactly one tick per frame
+            using Tick = std::chrono::duration<std::int64_t, std::ratio<1, 60>>;
+            const auto frame = std::chrono::ceil<typename Clock::duration>(Tick{1});
+            const std::uint64_t frames = Cycles * 60 / CyclesPerSecond() - TurboCycles * 60 / CyclesPerSecond();
+            return TurboEpoch + static_cast<typename Clock::rep>(frames) * frame;
         }
-        break;
-    case 0x1:
-        return jp();
-    case 0x2:
-        call();
-        return true;
-    case 0x3:
-        se_x_kk();
-        return true;
-    case 0x4:
-        sne_x_kk();
-        return true;
-    case 0x5:
-        se_x_y();
-        return true;
-    case 0x6:
-        ld_kk();
-        return true;
-    case 0x7:
-        add_kk();
-        return true;
-    case 0x8:
-        switch (IP.n())
+
+        if (Turbo || Paused)
         {
-        case 0x0:
-            ld_y();
-            return true;
-        case 0x1:
-            or_y();
-            return true;
-        case 0x2:
-            and_y();
-            return true;
-        case 0x3:
-            xor_y();
-            return true;
-        case 0x4:
-            add_y();
-            return true;
-        case 0x5:
-            sub_y();
-            return true;
-        case 0x6:
-            shr();
-            return true;
-        case 0x7:
-            subn_y();
-            return true;
-        case 0xE:
-            shl();
-            return true;
+            const std::chrono::duration<double> elapsed{static_cast<double>(Cycles - TurboCycles) / CyclesPerSecond()};
+            return TurboEpoch + std::chrono::duration_cast<typename Clock::duration>(elapsed);
         }
-        break;
-    case 0x9:
-        sne_x_y();
-        return true;
-    case 0xA:
-        ld_addr();
-        return true;
-    case 0xB:
-        return jp_v0();
-    case 0xC:
-        rnd();
-        return true;
-    case 0xD:
-        drw();
-        return true;
-    case 0xE:
-        switch (IP.kk())
+
+        return Clock::now() + ClockSkew;
+    }
+}
+
+template <typename Clock>
+bool CPU::PollTurbo() noexcept
+{
+    const bool requested = TurboRequested.load(std::memory_order_relaxed);
+
+    if (requested != Turbo)
+    {
+        if constexpr (!std::is_same_v<Clock, CycleClock>)
         {
-        case 0x9E:
-            skp_key();
-            return true;
-        case 0xA1:
-            sknp_key();
-            return true;
+            // Carry on from the time the other mode had reached
+            if (requested)
+            {
+                TurboEpoch = Now();
+                TurboCycles = State.Cycles;
+            }
+            else
+            {
+                ClockSkew = Now() - Clock::now();
+            }
         }
-        break;
-    case 0xF:
-        switch (IP.kk())
+
+        Turbo = requested;
+    }
+
+    return Turbo;
+}
+
+template <typename Clock>
+CPU::Interrupt CPU::Obey(CommandQueue& Commands)
+{
+    /*
+    * Applies the commands sent since the last batch. While paused, time
+    * only moves with the instructions stepped through, the same way as in
+    * turbo mode.
+    */
+
+    Interrupt interrupt = Interrupt::None;
+
+    while (const std::optional<CommandQueue::Request> request = Commands.receive())
+    {
+        switch (request->command)
         {
-        case 0x07:
-            ld_dt();
-            return true;
-        case 0x0A:
-            ld_key();
-            return true;
-        case 0x15:
-            set_dt();
-            return true;
-        case 0x18:
-            // TODO: Implement sound
-            return true;
-        case 0x1E:
-            add_i();
-            return true;
-        case 0x29:
-            ld_digit();
-            return true;
-        case 0x33:
-            str_bcd();
-            return true;
-        case 0x55:
-            str_vx();
-            return true;
-        case 0x65:
-            ld_vx();
-            return true;
+        case CommandQueue::Command::Stop:
+            return Interrupt::Stop;
+        case CommandQueue::Command::Pause:
+            if (!Paused)
+            {
+                TurboEpoch = Now();
+                TurboCycles = State.Cycles;
+                Paused = true;
+
+                if (Sound)
+                    Sound->rest(true);
+            }
+            break;
+        case CommandQueue::Command::Resume:
+            if (Paused)
+            {
+                if constexpr (!std::is_same_v<Clock, CycleClock>)
+                {
+                    if (!Turbo)
+                        ClockSkew = Now() - Clock::now();
+                }
+
+                Paused = false;
+                Steps = 0;
+                interrupt = Interrupt::Restart;
+
+                if (Sound)
+                    Sound->rest(false);
+            }
+            break;
+        case CommandQueue::Command::Step:
+            // Later commands wait until it has run
+            if (Paused)
+            {
+                ++Steps;
+                return interrupt;
+            }
+            break;
+        case CommandQueue::Command::SetFrequency:
+            Retime(request->value);
+            interrupt = Interrupt::Restart;
+            break;
         }
-        break;
     }
 
-    std::stringstream error_message;
-    error_message << "Encountered illegal opcode 0x"
-                  << std::setfill('0') << std::hex << std::setw(Instruction::width * 2) << IP.raw
-                  << " at address 0x" << std::setw(3) << PC;
-    throw std::logic_error(error_message.str());
+    return interrupt;
+}
+
+CPU::RunResult CPU::RunPaused(CommandQueue& Commands)
+{
+    // Either sleeps until the next command, or runs the instruction stepped to
+    if (Steps == 0)
+    {
+        Commands.wait();
+        return {StopReason::BudgetExhausted, 0, State.PC, std::nullopt};
+    }
+
+    --Steps;
+
+    const RunResult result = RunCycles(1);
+    PlaySound(Now());
+
+    if (Display)
+        Display->present();
+
+    return result;
+}
+
+void CPU::Retime(std::size_t Target)
+{
+    /*
+    * Cycles count emulated time, so they are scaled to the new frequency
+    * for it to carry on from the same point. Rounding up, it never goes
+    * back. The frequency doesn't matter with Timing::CosmacVIP.
+    */
+
+    const std::size_t previous = CyclesPerSecond();
+    const TimePoint now = Now();
+
+    set_frequency(Target);
+
+    if (const std::size_t current = CyclesPerSecond(); current != previous)
+    {
+        State.Cycles = (State.Cycles * current + previous - 1) / previous;
+        TurboEpoch = now;
+        TurboCycles = State.Cycles;
+    }
 }
 
-void CPU::SkipInstructions(int Instructions)
+void CPU::PlaySound(TimePoint Until) noexcept
 {
-    SetPC(PC + Instructions * Instruction::width);
+    // After parking the span covers all the time spent asleep, which was silent. Only its end is kept, so
+    // that the audio doesn't lag behind
+    const auto longest = std::chrono::duration_cast<TimePoint::duration>(std::chrono::milliseconds(50));
+    if (std::exchange(Parked, false) && Until - SoundCursor > longest)
+        SoundCursor = Until - longest;
+
+    // Generates the audio up to Until, the tone sounds for as long as ST was non-zero. Turbo mode is silent
+    if (Sound && !Turbo && Until > SoundCursor)
+    {
+        using seconds = std::chrono::duration<double>;
+
+        Sound->advance(seconds(Until - SoundCursor).count(), seconds(State.ST.remaining(SoundCursor)).count());
+    }
+
+    // Restoring a snapshot may also move it back
+    SoundCursor = Until;
 }
 
-void CPU::SetPC(const std::uint16_t Address)
+std::size_t CPU::CyclesPerSecond() const noexcept
 {
-    if (Address >= Memory.size() - 1)
-        throw std::out_of_range(std::to_string(Address));
+    return ActiveTiming == Timing::CosmacVIP ? VipTiming::CyclesPerSecond : Frequency;
+}
 
-    PC = Address;
-    IP.read(std::next(Memory.data(), PC));
+CPU::TimePoint CPU::Now(std::size_t Budget) const noexcept
+{
+    return TimeAt(BatchEnd - Budget);
 }
 
-bool CPU::jp()
+std::uint16_t CPU::jp() noexcept
 {
     /*
     * 1nnn - JP addr
@@ -317,18 +1655,11 @@ bool CPU::jp()
     * The interpreter sets the program counter to nnn.
     */
 
-    UpdatePC = false;
-
     // Check if we are stuck in a loop
-    if (PC == IP.nnn())
-        return false;
-
-    SetPC(IP.nnn());
-
-    return true;
+    return State.PC == Op.nnn ? Stop : Op.nnn;
 }
 
-void CPU::call()
+std::uint16_t CPU::call()
 {
     /*
     * 2nnn - CALL addr
@@ -338,13 +1669,17 @@ void CPU::call()
     * on the top of the stack. The PC is then set to nnn.
     */
 
-    Stack.at(SP) = PC;
-    ++SP;
+    if (State.SP == State.Stack.size())
+        return Raise(FaultKind::StackOverflow);
+
+    State.Stack[State.SP] = State.PC;
+    ++State.SP;
 
-    jp();
+    // Calling itself isn't a loop, it overflows the stack instead
+    return Op.nnn;
 }
 
-void CPU::ret()
+std::uint16_t CPU::ret()
 {
     /*
     * 00EE - RET
@@ -354,12 +1689,14 @@ void CPU::ret()
     * of the stack, then subtracts 1 from the stack pointer.
     */
 
-    --SP;
-    SetPC(Stack.at(SP) + Instruction::width);
-    UpdatePC = false;
+    if (State.SP == 0)
+        return Raise(FaultKind::StackUnderflow);
+
+    --State.SP;
+    return State.Stack[State.SP] + Instruction::width;
 }
 
-void CPU::se_x_kk()
+std::uint16_t CPU::se_x_kk() noexcept
 {
     /*
     * 3xkk - SE Vx, byte
@@ -369,14 +1706,10 @@ void CPU::se_x_kk()
     * increments the program counter by 2.
     */
 
-    if (V[IP.x()] == IP.kk())
-    {
-        SkipInstructions(2);
-        UpdatePC = false;
-    }
+    return Successor(State.V[Op.x] == Op.kk ? 2 : 1);
 }
 
-void CPU::sne_x_kk()
+std::uint16_t CPU::sne_x_kk() noexcept
 {
     /*
     * 4xkk - SNE Vx, byte
@@ -386,14 +1719,10 @@ void CPU::sne_x_kk()
     * increments the program counter by 2.
     */
 
-    if (V[IP.x()] != IP.kk())
-    {
-        SkipInstructions(2);
-        UpdatePC = false;
-    }
+    return Successor(State.V[Op.x] != Op.kk ? 2 : 1);
 }
 
-void CPU::se_x_y()
+std::uint16_t CPU::se_x_y() noexcept
 {
     /*
     * 5xy0 - SE Vx, Vy
@@ -403,14 +1732,10 @@ void CPU::se_x_y()
     * equal, increments the program counter by 2.
     */
 
-    if (V[IP.x()] == V[IP.y()])
-    {
-        SkipInstructions(2);
-        UpdatePC = false;
-    }
+    return Successor(State.V[Op.x] == State.V[Op.y] ? 2 : 1);
 }
 
-void CPU::ld_kk() noexcept
+std::uint16_t CPU::ld_kk() noexcept
 {
     /*
     * 6xkk - LD Vx, byte
@@ -419,10 +1744,12 @@ void CPU::ld_kk() noexcept
     * The interpreter puts the value kk into register Vx.
     */
 
-    V[IP.x()] = IP.kk();
+    State.V[Op.x] = Op.kk;
+
+    return Successor();
 }
 
-void CPU::add_kk() noexcept
+std::uint16_t CPU::add_kk() noexcept
 {
     /*
     * 7xkk - ADD Vx, byte
@@ -431,10 +1758,12 @@ void CPU::add_kk() noexcept
     * Adds the value kk to the value of register Vx, then stores the result in Vx.
     */
 
-    V[IP.x()] += IP.kk();
+    State.V[Op.x] += Op.kk;
+
+    return Successor();
 }
 
-void CPU::ld_y() noexcept
+std::uint16_t CPU::ld_y() noexcept
 {
     /*
     * 8xy0 - LD Vx, Vy
@@ -443,10 +1772,13 @@ void CPU::ld_y() noexcept
     * Stores the value of register Vy in register Vx.
     */
 
-    V[IP.x()] = V[IP.y()];
+    State.V[Op.x] = State.V[Op.y];
+
+    return Successor();
 }
 
-void CPU::or_y() noexcept
+template <Profile P>
+std::uint16_t CPU::or_y() noexcept
 {
     /*
     * 8xy1 - OR Vx, Vy
@@ -456,10 +1788,17 @@ void CPU::or_y() noexcept
     * result in Vx.
     */
 
-    V[IP.x()] |= V[IP.y()];
+    State.V[Op.x] |= State.V[Op.y];
+
+    // The COSMAC VIP used VF as scratch space
+    if constexpr (quirks(P).reset_vf)
+        State.VF() = 0;
+
+    return Successor();
 }
 
-void CPU::and_y() noexcept
+template <Profile P>
+std::uint16_t CPU::and_y() noexcept
 {
     /*
     * 8xy2 - AND Vx, Vy
@@ -469,10 +1808,17 @@ void CPU::and_y() noexcept
     * result in Vx.
     */
 
-    V[IP.x()] &= V[IP.y()];
+    State.V[Op.x] &= State.V[Op.y];
+
+    // The COSMAC VIP used VF as scratch space
+    if constexpr (quirks(P).reset_vf)
+        State.VF() = 0;
+
+    return Successor();
 }
 
-void CPU::xor_y() noexcept
+template <Profile P>
+std::uint16_t CPU::xor_y() noexcept
 {
     /*
     * 8xy3 - XOR Vx, Vy
@@ -482,10 +1828,16 @@ void CPU::xor_y() noexcept
     * stores the result in Vx.
     */
 
-    V[IP.x()] ^= V[IP.y()];
+    State.V[Op.x] ^= State.V[Op.y];
+
+    // The COSMAC VIP used VF as scratch space
+    if constexpr (quirks(P).reset_vf)
+        State.VF() = 0;
+
+    return Successor();
 }
 
-void CPU::add_y() noexcept
+std::uint16_t CPU::add_y() noexcept
 {
     /*
     * 8xy4 - ADD Vx, Vy
@@ -496,13 +1848,15 @@ void CPU::add_y() noexcept
     * lowest 8 bits of the result are kept, and stored in Vx.
     */
 
-    const std::uint_fast16_t Result = V[IP.x()] + V[IP.y()];
+    const std::uint_fast16_t Result = State.V[Op.x] + State.V[Op.y];
 
-    VF = Result > 0xFF ? 1 : 0;
-    V[IP.x()] = Result & 0xFF;
+    State.VF() = Result > 0xFF ? 1 : 0;
+    State.V[Op.x] = Result & 0xFF;
+
+    return Successor();
 }
 
-void CPU::sub_y() noexcept
+std::uint16_t CPU::sub_y() noexcept
 {
     /*
     * 8xy5 - SUB Vx, Vy
@@ -513,13 +1867,16 @@ void CPU::sub_y() noexcept
     */
 
     // In case one of the operands is VF
-    const std::uint_fast16_t result = V[IP.x()] - V[IP.y()];
+    const std::uint_fast16_t result = State.V[Op.x] - State.V[Op.y];
+
+    State.VF() = result > 0xff ? 0 : 1;
+    State.V[Op.x] = result & 0xff;
 
-    VF = result > 0xff ? 0 : 1;
-    V[IP.x()] = result & 0xff;
+    return Successor();
 }
 
-void CPU::shr() noexcept
+template <Profile P>
+std::uint16_t CPU::shr() noexcept
 {
     /*
     * 8xy6 - SHR Vx, Vy
@@ -531,13 +1888,16 @@ void CPU::shr() noexcept
     */
 
     // Make a copy of the data in case it's stored in VF
-    const std::uint8_t data = Modern ? V[IP.x()] : V[IP.y()];
+    const std::uint8_t data = State.V[quirks(P).shift_vy ? Op.y : Op.x];
 
-    VF = data & 0x01;
-    V[IP.x()] = data >> 1;
+    State.VF() = data & 0x01;
+    State.V[Op.x] = data >> 1;
+
+    return Successor();
 }
 
-void CPU::shl() noexcept
+template <Profile P>
+std::uint16_t CPU::shl() noexcept
 {
     /*
     * 8xyE - SHL Vx, Vy
@@ -549,13 +1909,15 @@ void CPU::shl() noexcept
     */
 
     // Make a copy of the data in case it's stored in VF
-    const std::uint8_t data = Modern ? V[IP.x()] : V[IP.y()];
+    const std::uint8_t data = State.V[quirks(P).shift_vy ? Op.y : Op.x];
+
+    State.VF() = (data & 0x80) >> 7;
+    State.V[Op.x] = data << 1;
 
-    VF = (data & 0x80) >> 7;
-    V[IP.x()] = data << 1;
+    return Successor();
 }
 
-void CPU::subn_y() noexcept
+std::uint16_t CPU::subn_y() noexcept
 {
     /*
     * 8xy7 - SUBN Vx, Vy
@@ -566,13 +1928,15 @@ void CPU::subn_y() noexcept
     */
 
     // In case one of the operands is VF
-    const std::uint_fast16_t result = V[IP.y()] - V[IP.x()];
+    const std::uint_fast16_t result = State.V[Op.y] - State.V[Op.x];
 
-    VF = result > 0xff ? 0 : 1;
-    V[IP.x()] = result;
+    State.VF() = result > 0xff ? 0 : 1;
+    State.V[Op.x] = result;
+
+    return Successor();
 }
 
-void CPU::sne_x_y()
+std::uint16_t CPU::sne_x_y() noexcept
 {
     /*
     * 9xy0 - SNE Vx, Vy
@@ -582,14 +1946,10 @@ void CPU::sne_x_y()
     * program counter is increased by 2.
     */
 
-    if (V[IP.x()] != V[IP.y()])
-    {
-        SkipInstructions(2);
-        UpdatePC = false;
-    }
+    return Successor(State.V[Op.x] != State.V[Op.y] ? 2 : 1);
 }
 
-void CPU::ld_addr() noexcept
+std::uint16_t CPU::ld_addr() noexcept
 {
     /*
     * Annn - LD I, addr
@@ -598,30 +1958,29 @@ void CPU::ld_addr() noexcept
     * The value of register I is set to nnn.
     */
 
-    VI = IP.nnn();
+    State.VI = Op.nnn;
+
+    return Successor();
 }
 
-bool CPU::jp_v0()
+template <Profile P>
+std::uint16_t CPU::jp_v0() noexcept
 {
     /*
     * Bnnn - JP V0, addr
-    * Jump to location nnn + V0.
+    * Original: Jump to location nnn + V0.
+    * CHIP-48:  Jump to location xnn + Vx.
     *
-    * The program counter is set to nnn plus the value of V0.
+    * The program counter is set to nnn plus the value of V0 (or Vx).
     */
 
-    UpdatePC = false;
+    const std::uint16_t address = Op.nnn + State.V[quirks(P).jump_vx ? Op.x : 0];
 
     // Check if we are stuck in a loop
-    if (PC == IP.nnn() + V[0])
-        return false;
-
-    SetPC(IP.nnn() + V[0]);
-
-    return true;
+    return State.PC == address ? Stop : address;
 }
 
-void CPU::rnd()
+std::uint16_t CPU::rnd()
 {
     /*
     * Cxkk - RND Vx, byte
@@ -633,14 +1992,17 @@ void CPU::rnd()
     */
 
     /*
-    * We are mapping the mt19937's [0, 2^32) output to [0, 2^8) so just masking
-    * out the higher order bytes should be safe, simple, and efficient (i.e. it
-    * preserves uniformity).
+    * We are mapping the generator's [0, 2^32) (or wider) output to [0, 2^8)
+    * so just masking out the higher order bytes should be safe, simple, and
+    * efficient (i.e. it preserves uniformity).
     */
-    V[IP.x()] = Generator() & IP.kk();
+    State.V[Op.x] = State.Generator() & Op.kk;
+
+    return Successor();
 }
 
-void CPU::drw()
+template <Profile P>
+std::uint16_t CPU::drw()
 {
     /*
     * Dxyn - DRW Vx, Vy, nibble
@@ -653,31 +2015,39 @@ void CPU::drw()
     * this causes any pixels to be erased, VF is set to 1, otherwise it is
     * set to 0. If the sprite is positioned so part of it is outside the
     * coordinates of the display, it wraps around to the opposite side of the
-    * screen.
+    * screen (or is clipped, depending on the profile).
     */
 
-    if (VI + IP.n() >= 4096)
-        throw std::out_of_range("todo");
+    if (State.VI + Op.n >= 4096)
+        return Raise(FaultKind::InvalidMemoryAccess);
+
+    ++Stats.draws;
 
     if (Display)
     {
-        const byte_view Sprite{Memory.cbegin() + VI, IP.n()};
-        VF = Display->drawSprite(Sprite, V[IP.x()], V[IP.y()]);
+        const byte_view Sprite{State.Memory.cbegin() + State.VI, Op.n};
+        State.VF() = Display->drawSprite<quirks(P).clip_sprites>(Sprite, State.V[Op.x], State.V[Op.y]);
     }
+
+    return Successor();
 }
 
-void CPU::cls()
+std::uint16_t CPU::cls()
 {
     /*
     * 00E0 - CLS
     * Clear the display.
     */
 
+    ++Stats.draws;
+
     if (Display)
         Display->clear();
+
+    return Successor();
 }
 
-void CPU::add_i() noexcept
+std::uint16_t CPU::add_i() noexcept
 {
     /*
     * Fx1E - ADD I, Vx
@@ -686,10 +2056,13 @@ void CPU::add_i() noexcept
     * The values of I and Vx are added, and the results are stored in I.
     */
 
-    VI += V[IP.x()];
+    State.VI += State.V[Op.x];
+
+    return Successor();
 }
 
-void CPU::str_vx()
+template <Profile P>
+std::uint16_t CPU::str_vx()
 {
     /*
     * Fx55 - LD [I], Vx
@@ -699,18 +2072,25 @@ void CPU::str_vx()
     * memory, starting at the address in I.
     */
 
-    if (VI + IP.x() >= Memory.size())
-        throw std::out_of_range(std::to_string(VI + IP.x()));
+    if (State.VI + Op.x >= State.Memory.size())
+        return Raise(FaultKind::InvalidMemoryAccess);
 
-    auto address = std::next(Memory.begin(), VI);
+    auto address = std::next(State.Memory.begin(), State.VI);
 
-    std::copy_n(V.cbegin(), IP.x() + 1, address);
+    std::copy_n(State.V.cbegin(), Op.x + 1, address);
+    InvalidateCache(State.VI, Op.x + 1);
 
-    // Undocumented
-    VI += IP.x() + 1;
+    // Undocumented, and changed by later interpreters
+    if constexpr (quirks(P).load_store == Quirks::Increment::XPlusOne)
+        State.VI += Op.x + 1;
+    else if constexpr (quirks(P).load_store == Quirks::Increment::X)
+        State.VI += Op.x;
+
+    return Successor();
 }
 
-void CPU::ld_vx()
+template <Profile P>
+std::uint16_t CPU::ld_vx()
 {
     /*
     * Fx65 - LD Vx, [I]
@@ -720,18 +2100,23 @@ void CPU::ld_vx()
     * registers V0 through Vx.
     */
 
-    if (VI + IP.x() >= Memory.size())
-        throw std::out_of_range(std::to_string(VI + IP.x()));
+    if (State.VI + Op.x >= State.Memory.size())
+        return Raise(FaultKind::InvalidMemoryAccess);
+
+    auto address = std::next(State.Memory.cbegin(), State.VI);
 
-    auto address = std::next(Memory.cbegin(), VI);
+    std::copy_n(address, Op.x + 1, State.V.begin());
 
-    std::copy_n(address, IP.x() + 1, V.begin());
+    // Undocumented, and changed by later interpreters
+    if constexpr (quirks(P).load_store == Quirks::Increment::XPlusOne)
+        State.VI += Op.x + 1;
+    else if constexpr (quirks(P).load_store == Quirks::Increment::X)
+        State.VI += Op.x;
 
-    // Undocumented
-    VI += IP.x() + 1;
+    return Successor();
 }
 
-void CPU::str_bcd()
+std::uint16_t CPU::str_bcd()
 {
     /*
     * Fx33 - LD B, Vx
@@ -742,14 +2127,20 @@ void CPU::str_bcd()
     * the ones digit at location I+2.
     */
 
-    const std::uint8_t value = V[IP.x()];
+    if (State.VI + 2u >= State.Memory.size())
+        return Raise(FaultKind::InvalidMemoryAccess);
 
-    Memory.at(VI + 0) = value / 100;
-    Memory.at(VI + 1) = (value / 10) % 10;
-    Memory.at(VI + 2) = value % 10;
+    const std::uint8_t value = State.V[Op.x];
+
+    State.Memory[State.VI + 0] = value / 100;
+    State.Memory[State.VI + 1] = (value / 10) % 10;
+    State.Memory[State.VI + 2] = value % 10;
+    InvalidateCache(State.VI, 3);
+
+    return Successor();
 }
 
-void CPU::ld_digit()
+std::uint16_t CPU::ld_digit()
 {
     /*
     * Fx29 - LD F, Vx
@@ -759,10 +2150,12 @@ void CPU::ld_digit()
     * corresponding to the value of Vx.
     */
 
-    VI = V[IP.x()] * 5;
+    State.VI = State.V[Op.x] * 5;
+
+    return Successor();
 }
 
-void CPU::ld_dt() noexcept
+std::uint16_t CPU::ld_dt(std::size_t Budget) noexcept
 {
     /*
     * Fx07 - LD Vx, DT
@@ -771,10 +2164,12 @@ void CPU::ld_dt() noexcept
     * The value of DT is placed into Vx.
     */
 
-    V[IP.x()] = DT.read();
+    State.V[Op.x] = State.DT.read(Now(Budget));
+
+    return Successor();
 }
 
-void CPU::set_dt() noexcept
+std::uint16_t CPU::set_dt(std::size_t Budget) noexcept
 {
     /*
     * Fx15 - LD DT, Vx
@@ -783,10 +2178,30 @@ void CPU::set_dt() noexcept
     * DT is set equal to the value of Vx.
     */
 
-    DT.set(V[IP.x()]);
+    State.DT.set(State.V[Op.x], Now(Budget));
+
+    return Successor();
+}
+
+std::uint16_t CPU::set_st(std::size_t Budget) noexcept
+{
+    /*
+    * Fx18 - LD ST, Vx
+    * Set sound timer = Vx.
+    *
+    * ST is set equal to the value of Vx.
+    */
+
+    // The audio up to now still follows the old value
+    const TimePoint now = Now(Budget);
+    PlaySound(now);
+
+    State.ST.set(State.V[Op.x], now);
+
+    return Successor();
 }
 
-void CPU::skp_key() noexcept
+std::uint16_t CPU::skp_key() noexcept
 {
     /*
     * Ex9E - SKP Vx
@@ -797,18 +2212,14 @@ void CPU::skp_key() noexcept
     */
 
     if (!Input)
-        return;
+        return Successor();
 
-    const auto key = V[IP.x()];
+    const auto key = State.V[Op.x];
 
-    if (Input->query_key(key))
-    {
-        SkipInstructions(2);
-        UpdatePC = false;
-    }
+    return Successor(Input->query_key(key) ? 2 : 1);
 }
 
-void CPU::sknp_key() noexcept
+std::uint16_t CPU::sknp_key() noexcept
 {
     /*
     * ExA1 - SKNP Vx
@@ -819,18 +2230,14 @@ void CPU::sknp_key() noexcept
     */
 
     if (!Input)
-        return;
+        return Successor();
 
-    const auto key = V[IP.x()];
+    const auto key = State.V[Op.x];
 
-    if (!Input->query_key(key))
-    {
-        SkipInstructions(2);
-        UpdatePC = false;
-    }
+    return Successor(!Input->query_key(key) ? 2 : 1);
 }
 
-void CPU::ld_key() noexcept
+std::uint16_t CPU::ld_key() noexcept
 {
     /*
     * Fx0A - LD Vx, K
@@ -841,13 +2248,109 @@ void CPU::ld_key() noexcept
     */
 
     if (!Input)
-        return;
+        return Successor();
 
     const std::optional<int> key = Input->query_any();
 
-    if (key.has_value())
-        V[IP.x()] = key.value();
-    else
-        // Execute this instruction again
-        UpdatePC = false;
+    // Execute this instruction again
+    if (!key.has_value())
+        return Stop;
+
+    State.V[Op.x] = key.value();
+    return Successor();
 }
+
+template <Profile P>
+std::uint16_t CPU::fused_drw()
+{
+    /*
+    * 6xkk, Annn, Dxyn
+    * Load a register, point I at a sprite and draw it.
+    *
+    * Exactly the same as executing the 3 instructions, fuse() made sure
+    * that the sprite is in range.
+    */
+
+    ++Stats.fused_drw;
+    Stats.fused += 3;
+
+    State.V[Op.z] = Op.kk;
+    State.VI = Op.nnn;
+    drw<P>();
+
+    Retired = 3;
+    return Successor(3);
+}
+
+std::uint16_t CPU::fused_loop()
+{
+    /*
+    * 7xkk, 3ykk, 1nnn
+    * Add to a counter, exit the loop if a register is equal to a constant,
+    * otherwise jump back to nnn.
+    */
+
+    ++Stats.fused_loop;
+
+    State.V[Op.x] += Op.kk;
+
+    if (State.V[Op.y] == Op.z)
+    {
+        // Leave the loop, skipping the jump
+        Stats.fused += 2;
+        Retired = 2;
+        return Successor(3);
+    }
+
+    Stats.fused += 3;
+    Retired = 3;
+    return Op.nnn;
+}
+
+std::uint16_t CPU::fused_wait_dt(std::size_t Budget)
+{
+    /*
+    * Fx07, 3ykk, 1nnn
+    * Read the delay timer, exit the loop if a register is equal to a
+    * constant, otherwise jump back to nnn.
+    */
+
+    ++Stats.fused_wait_dt;
+
+    State.V[Op.x] = State.DT.read(Now(Budget));
+
+    if (State.V[Op.y] == Op.z)
+    {
+        // Leave the loop, skipping the jump
+        Stats.fused += 2;
+        Retired = 2;
+        return Successor(3);
+    }
+
+    Stats.fused += 3;
+    Retired = 3;
+    return Op.nnn;
+}
+
+// Used by the threaded engine and by recompiled programs
+#define INSTANTIATE(P)                                \
+    template bool CPU::Interpret<P>(std::size_t);     \
+    template std::uint16_t CPU::jp_v0<P>() noexcept;  \
+    template std::uint16_t CPU::shr<P>() noexcept;    \
+    template std::uint16_t CPU::shl<P>() noexcept;    \
+    template std::uint16_t CPU::or_y<P>() noexcept;   \
+    template std::uint16_t CPU::and_y<P>() noexcept;  \
+    template std::uint16_t CPU::xor_y<P>() noexcept;  \
+    template std::uint16_t CPU::drw<P>();             \
+    template std::uint16_t CPU::str_vx<P>();          \
+    template std::uint16_t CPU::ld_vx<P>();           \
+    template std::uint16_t CPU::fused_drw<P>();
+
+INSTANTIATE(Profile::CosmacVIP)
+INSTANTIATE(Profile::Chip48)
+INSTANTIATE(Profile::SuperChip)
+INSTANTIATE(Profile::Modern)
+INSTANTIATE(Profile::Legacy)
+INSTANTIATE(Profile::LegacyModern)
+
+#undef INSTANTIATE
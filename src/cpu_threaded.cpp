@@ -0,0 +1,234 @@
+#include "cpu.hpp"
+
+#ifdef THREADED_ENGINE
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+
+// Labels as values are a GNU extension
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+
+template <Profile P>
+std::size_t CPU::Threaded(std::size_t Count)
+{
+    /*
+    * Threaded dispatch using computed gotos. Each handler ends with its own
+    * copy of the fetch and the indirect jump to the next handler, instead of
+    * returning to a single switch, so the branch predictor can learn which
+    * opcode tends to follow which. Instructions are fetched from the same
+    * predecoded cache as Engine::Predecoded.
+    */
+
+    static void* const Handlers[] = {
+        &&op_illegal, // Opcode::undecoded, never returned by Predecoded()
+        &&op_illegal,
+        &&op_cls,
+        &&op_ret,
+        &&op_jp,
+        &&op_call,
+        &&op_se_x_kk,
+        &&op_sne_x_kk,
+        &&op_se_x_y,
+        &&op_ld_kk,
+        &&op_add_kk,
+        &&op_ld_y,
+        &&op_or_y,
+        &&op_and_y,
+        &&op_xor_y,
+        &&op_add_y,
+        &&op_sub_y,
+        &&op_shr,
+        &&op_subn_y,
+        &&op_shl,
+        &&op_sne_x_y,
+        &&op_ld_addr,
+        &&op_jp_v0,
+        &&op_rnd,
+        &&op_drw,
+        &&op_skp_key,
+        &&op_sknp_key,
+        &&op_ld_dt,
+        &&op_ld_key,
+        &&op_set_dt,
+        &&op_set_st,
+        &&op_add_i,
+        &&op_ld_digit,
+        &&op_str_bcd,
+        &&op_str_vx,
+        &&op_ld_vx,
+        &&op_fused_drw,
+        &&op_fused_loop,
+        &&op_fused_wait_dt,
+    };
+
+    static_assert(std::size(Handlers) == static_cast<std::size_t>(Opcode::fused_wait_dt) + 1,
+                  "Handlers must contain an entry for every Opcode");
+
+    std::size_t executed = 0;
+
+#define DISPATCH()                                            \
+    do                                                        \
+    {                                                         \
+        if (executed == Count)                                \
+            return executed;                                  \
+                                                              \
+        Op = Predecoded(Count - executed);                    \
+        goto* Handlers[static_cast<std::size_t>(Op.opcode)]; \
+    } while (false)
+
+#define NEXT(Address)                    \
+    do                                   \
+    {                                    \
+        if (!Advance(Address))           \
+            return executed;             \
+                                         \
+        ++executed;                      \
+        DISPATCH();                      \
+    } while (false)
+
+    DISPATCH();
+
+op_illegal:
+    Raise(FaultKind::IllegalInstruction);
+    return executed;
+
+op_cls:
+    NEXT(cls());
+
+op_ret:
+    NEXT(ret());
+
+op_jp:
+    NEXT(jp());
+
+op_call:
+    NEXT(call());
+
+op_se_x_kk:
+    NEXT(se_x_kk());
+
+op_sne_x_kk:
+    NEXT(sne_x_kk());
+
+op_se_x_y:
+    NEXT(se_x_y());
+
+op_ld_kk:
+    NEXT(ld_kk());
+
+op_add_kk:
+    NEXT(add_kk());
+
+op_ld_y:
+    NEXT(ld_y());
+
+op_or_y:
+    NEXT(or_y<P>());
+
+op_and_y:
+    NEXT(and_y<P>());
+
+op_xor_y:
+    NEXT(xor_y<P>());
+
+op_add_y:
+    NEXT(add_y());
+
+op_sub_y:
+    NEXT(sub_y());
+
+op_shr:
+    NEXT(shr<P>());
+
+op_subn_y:
+    NEXT(subn_y());
+
+op_shl:
+    NEXT(shl<P>());
+
+op_sne_x_y:
+    NEXT(sne_x_y());
+
+op_ld_addr:
+    NEXT(ld_addr());
+
+op_jp_v0:
+    NEXT(jp_v0<P>());
+
+op_rnd:
+    NEXT(rnd());
+
+op_drw:
+    NEXT(drw<P>());
+
+op_skp_key:
+    NEXT(skp_key());
+
+op_sknp_key:
+    NEXT(sknp_key());
+
+op_ld_dt:
+    NEXT(ld_dt(Count - executed));
+
+op_ld_key:
+    NEXT(ld_key());
+
+op_set_dt:
+    NEXT(set_dt(Count - executed));
+
+op_set_st:
+    NEXT(set_st(Count - executed));
+
+op_add_i:
+    NEXT(add_i());
+
+op_ld_digit:
+    NEXT(ld_digit());
+
+op_str_bcd:
+    NEXT(str_bcd());
+
+op_str_vx:
+    NEXT(str_vx<P>());
+
+op_ld_vx:
+    NEXT(ld_vx<P>());
+
+    // NEXT() counts one of the instructions executed by a superinstruction
+op_fused_drw:
+{
+    const std::uint16_t next = fused_drw<P>();
+    executed += Retired - 1;
+    NEXT(next);
+}
+
+op_fused_loop:
+{
+    const std::uint16_t next = fused_loop();
+    executed += Retired - 1;
+    NEXT(next);
+}
+
+op_fused_wait_dt:
+{
+    const std::uint16_t next = fused_wait_dt(Count - executed);
+    executed += Retired - 1;
+    NEXT(next);
+}
+
+#undef NEXT
+#undef DISPATCH
+}
+
+#pragma GCC diagnostic pop
+
+template std::size_t CPU::Threaded<Profile::CosmacVIP>(std::size_t);
+template std::size_t CPU::Threaded<Profile::Chip48>(std::size_t);
+template std::size_t CPU::Threaded<Profile::SuperChip>(std::size_t);
+template std::size_t CPU::Threaded<Profile::Modern>(std::size_t);
+template std::size_t CPU::Threaded<Profile::Legacy>(std::size_t);
+template std::size_t CPU::Threaded<Profile::LegacyModern>(std::size_t);
+
+#endif
@@ -4,31 +4,16 @@
 
 #include <cstddef>
 #include <cstdint>
-#include <stdexcept>
 
 extern "C" int LLVMFuzzerTestOneInput(const std::uint8_t* data, std::size_t size)
 {
     const byte_view ROM{data, size};
     Frame frame;
-    CPU processor{ROM, false, &frame};
+    CPU processor{ROM, Profile::Legacy, &frame};
 
-    try
-    {
-        for (int i = 0; processor.step() && i < 10000; ++i)
-            continue;
-    }
-    catch (std::logic_error)
-    {
-        // Invalid opcodes
-    }
-    catch (std::runtime_error)
-    {
-        // Invalid key
-    }
-    catch (std::out_of_range)
-    {
-        // Invalid memory address, Stack over/underflow
-    }
+    // Invalid opcodes, memory addresses and stack over/underflows are all
+    // reported as StopReason::Fault
+    processor.run(10000);
 
     return 0; // Non-zero return values are reserved for future use.
 }
@@ -1,80 +1,166 @@
 #include "graphics.hpp"
+#include "blit.hpp"
 
 #include <SFML/Graphics.hpp>
 
+#include <algorithm>
+#include <array>
 #include <cstdint>
-#include <limits>
+#include <cstring>
 
-[[nodiscard]] static constexpr std::uint64_t rotr(std::uint64_t x, std::size_t s) noexcept
+// 8 RGBA pixels for each byte of a line, most significant bit first
+using Expansion = std::array<std::array<std::uint8_t, 8 * 4>, 256>;
+
+[[nodiscard]] static constexpr Expansion MakeExpansion() noexcept
 {
-    constexpr auto digits = std::numeric_limits<std::uint64_t>::digits;
+    Expansion table = {};
+
+    for (std::size_t byte = 0; byte < table.size(); ++byte)
+    {
+        for (std::size_t bit = 0; bit < 8; ++bit)
+        {
+            const std::uint8_t value = byte & (0x80 >> bit) ? 0xFF : 0x00;
+
+            table[byte][4 * bit + 0] = value;
+            table[byte][4 * bit + 1] = value;
+            table[byte][4 * bit + 2] = value;
+            table[byte][4 * bit + 3] = 0xFF;
+        }
+    }
 
-    const std::size_t n = s % digits;
-    return (x >> n) | (x << ((digits - n) % digits));
+    return table;
 }
 
-bool Frame::drawSprite(byte_view sprite, std::size_t x, std::size_t y)
+static constexpr Expansion ByteToPixels = MakeExpansion();
+
+struct Frame::Canvas
 {
-    bool collision = false;
+    std::array<std::uint8_t, Lines * Columns * 4> pixels;
+    sf::Texture texture;
+    sf::Sprite sprite;
+};
 
+Frame::Frame() = default;
+Frame::~Frame() = default;
+
+template <bool Clip>
+bool Frame::drawSprite(byte_view sprite, std::size_t x, std::size_t y)
+{
     // Sprites must wrap around if they are drawn completly off screen
     // TODO: Test this
     x %= Columns;
     y %= Lines;
 
-    for (std::size_t i = 0; i < sprite.size() && y + i < Lines; ++i)
-    {
-        std::uint64_t line = buffer[y + i].load(std::memory_order_relaxed);
-        const std::uint64_t mask = rotr(sprite[i], x + 8 - Columns);
+    const std::size_t rows = std::min(sprite.size(), Lines - y);
 
-        if (!collision && ((line ^ mask) != (line | mask)))
-            collision = true;
+    for (std::size_t i = 0; i < rows; ++i)
+        dirty |= RowMask{1} << (y + i);
 
-        buffer[y + i].store(line ^ mask, std::memory_order_relaxed);
-    }
+    return BlitVector<Clip>(&buffer[y], sprite.data(), rows, x);
+}
 
-    updated.store(true, std::memory_order_release);
+template bool Frame::drawSprite<true>(byte_view sprite, std::size_t x, std::size_t y);
+template bool Frame::drawSprite<false>(byte_view sprite, std::size_t x, std::size_t y);
+
+void Frame::clear()
+{
+    for (std::size_t i = 0; i < Lines; ++i)
+    {
+        if (buffer[i] != 0)
+            dirty |= RowMask{1} << i;
 
-    return collision;
+        buffer[i] = 0;
+    }
 }
 
-void Frame::clear()
+void Frame::present()
 {
-    for (auto& line : buffer)
-        line.store(0, std::memory_order_relaxed);
+    if (dirty == 0)
+        return;
+
+    frames[back] = buffer;
 
-    updated.store(true, std::memory_order_release);
+    std::uint64_t previous = latest.load(std::memory_order_relaxed);
+    std::uint64_t next;
+
+    do
+    {
+        // The lines of a frame render() never took still have to be uploaded
+        const std::uint64_t pending = previous & Fresh ? previous >> ChangedShift : 0;
+        next = (pending | dirty) << ChangedShift | Fresh | back;
+    } while (!latest.compare_exchange_weak(previous, next, std::memory_order_acq_rel, std::memory_order_relaxed));
+
+    back = previous & Index;
+    dirty = 0;
 }
 
 void Frame::render(sf::RenderTarget& target, bool force = false)
 {
-    if (!updated.load(std::memory_order_acquire) && !force)
-        return;
+    /*
+    * The screen lives in a 64x32 texture, stretched over the target by the
+    * view from prepareTarget(), so a frame is a single draw call however
+    * many pixels are lit. The texture is created on the first call, where
+    * the target's context is current. After that, only the lines that
+    * changed since the last frame are expanded and uploaded, one
+    * sub-rectangle per run of consecutive lines.
+    */
 
-    sf::RectangleShape pixel({1.f, 1.f});
-    pixel.setFillColor(sf::Color::White);
+    RowMask rows = take();
 
-    target.clear(sf::Color::Black);
+    if (rows == 0 && !force)
+        return;
 
-    for (std::size_t i = 0; i < Lines; ++i)
+    if (!canvas)
+    {
+        canvas = std::make_unique<Canvas>();
+        canvas->texture.create(Columns, Lines);
+        canvas->sprite.setTexture(canvas->texture, true);
+        rows = ~RowMask{0};
+    }
+
+    for (std::size_t first = 0; first < Lines;)
     {
-        const float y = i;
-        std::uint64_t line = buffer[i].load(std::memory_order_relaxed);
+        if (!(rows & (RowMask{1} << first)))
+        {
+            ++first;
+            continue;
+        }
+
+        std::size_t last = first;
 
-        for (std::size_t j = 0; j < Columns; ++j)
+        for (; last < Lines && rows & (RowMask{1} << last); ++last)
         {
-            // unsigned long long is guaranteed to be at least 64 bits
-            if (line & (1ull << j))
-            {
-                const float x = 63 - j;
-
-                pixel.setPosition({x, y});
-                target.draw(pixel);
-            }
+            const std::uint64_t line = frames[front][last];
+            std::uint8_t* row = &canvas->pixels[last * Columns * 4];
+
+            for (std::size_t j = 0; j < Columns / 8; ++j)
+                std::memcpy(row + j * 8 * 4, ByteToPixels[line >> (Columns - 8 - 8 * j) & 0xFF].data(), 8 * 4);
         }
+
+        canvas->texture.update(&canvas->pixels[first * Columns * 4], Columns, static_cast<unsigned>(last - first), 0, static_cast<unsigned>(first));
+        first = last;
     }
 
-    updated.store(false, std::memory_order_relaxed);
+    // The sprite is opaque and covers the whole view, there is nothing to clear
+    target.draw(canvas->sprite);
+}
+
+std::array<std::uint64_t, Frame::Lines> Frame::read_presented()
+{
+    take();
+    return frames[front];
+}
+
+Frame::RowMask Frame::take()
+{
+    // Returns the lines that changed since the front frame
+    if (!(latest.load(std::memory_order_relaxed) & Fresh))
+        return 0;
+
+    const std::uint64_t taken = latest.exchange(front, std::memory_order_acq_rel);
+
+    front = taken & Index;
+    return static_cast<RowMask>(taken >> ChangedShift);
 }
 
 void Frame::prepareTarget(sf::RenderTarget& target)
@@ -52,13 +52,22 @@ Keyboard::Keyboard(sf::Window& window)
     window.setKeyRepeatEnabled(false);
 }
 
-void Keyboard::register_keypress(sf::Event::KeyEvent event, bool state) noexcept
+void Keyboard::register_keypress(sf::Event::KeyEvent event, bool state)
 {
     const std::optional<int> key = Map(event.code);
 
     // Ignore keys we don't care about
-    if (key.has_value())
-        keys.at(key.value()).store(state, std::memory_order_relaxed);
+    if (!key.has_value())
+        return;
+
+    keys.at(key.value()).store(state, std::memory_order_relaxed);
+
+    {
+        const std::lock_guard<std::mutex> lock{mutex};
+        ++events;
+    }
+
+    changed.notify_all();
 }
 
 bool Keyboard::query_key(int key) const noexcept
@@ -76,3 +85,26 @@ std::optional<int> Keyboard::query_any() const noexcept
     else
         return std::nullopt;
 }
+
+std::uint64_t Keyboard::count_events() const
+{
+    const std::lock_guard<std::mutex> lock{mutex};
+    return events;
+}
+
+bool Keyboard::wait_for_event(std::uint64_t seen, std::chrono::steady_clock::time_point deadline) const
+{
+    std::unique_lock<std::mutex> lock{mutex};
+
+    ++waiters;
+    const bool changed_since = changed.wait_until(lock, deadline, [this, seen] { return events != seen; });
+    --waiters;
+
+    return changed_since;
+}
+
+std::size_t Keyboard::count_waiters() const
+{
+    const std::lock_guard<std::mutex> lock{mutex};
+    return waiters;
+}
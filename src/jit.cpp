@@ -0,0 +1,997 @@
+#include "jit.hpp"
+
+#ifdef JIT_ENGINE
+
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <numeric>
+#include <stdexcept>
+
+namespace
+{
+
+enum Register : std::uint8_t
+{
+    rax,
+    rcx,
+    rdx,
+    rbx,
+    rsp,
+    rbp,
+    rsi,
+    rdi,
+    r8,
+    r9,
+    r10,
+    r11,
+    r12,
+    r13,
+    r14,
+    r15
+};
+
+enum Condition : std::uint8_t
+{
+    below = 0x2,
+    above_equal = 0x3,
+    equal = 0x4,
+    not_equal = 0x5
+};
+
+// Opcodes of the r/m, reg form of the basic ALU instructions
+enum Operation : std::uint8_t
+{
+    op_add = 0x01,
+    op_or = 0x09,
+    op_and = 0x21,
+    op_sub = 0x29,
+    op_xor = 0x31,
+    op_cmp = 0x39
+};
+
+// Return addresses are stored as 64-bit values and indexed with a scale of 8
+static_assert(sizeof(std::uint_fast16_t) == sizeof(std::uint64_t));
+
+// Guest state is addressed relative to this register
+constexpr Register base = r15;
+constexpr Register budget = r14;
+constexpr Register vi = r13;
+
+// Host registers available for V0-VF, callee-saved ones first
+constexpr std::array<Register, 9> pool = {rbx, rbp, r12, rsi, rdi, r8, r9, r10, r11};
+
+constexpr std::array<Register, 6> callee_saved = {rbx, rbp, r12, r13, r14, r15};
+
+/*
+* Minimal x86-64 assembler. Only the handful of instruction forms the
+* translator needs are implemented, and every memory operand is of the
+* form [r15 + disp32] or [r15 + index * 8 + disp32].
+*/
+class Assembler
+{
+    std::uint8_t* const start;
+    std::uint8_t* cursor;
+    std::uint8_t* const end;
+
+    void byte(std::uint8_t value) noexcept
+    {
+        assert(cursor < end);
+        *cursor++ = value;
+    }
+
+    template <typename T>
+    void immediate(T value) noexcept
+    {
+        assert(cursor + sizeof(T) <= end);
+        std::memcpy(cursor, &value, sizeof(T));
+        cursor += sizeof(T);
+    }
+
+    void rex(bool w, int reg, int index, int rm, bool force = false) noexcept
+    {
+        const std::uint8_t prefix = 0x40 | (w << 3) | ((reg & 8) >> 1) | ((index & 8) >> 2) | ((rm & 8) >> 3);
+
+        if (prefix != 0x40 || force)
+            byte(prefix);
+    }
+
+    void modrm(int mod, int reg, int rm) noexcept
+    {
+        byte((mod << 6) | ((reg & 7) << 3) | (rm & 7));
+    }
+
+    void memory(int reg, std::int32_t displacement) noexcept
+    {
+        static_assert((base & 7) != (rsp & 7), "Base register would require a SIB byte");
+
+        modrm(0b10, reg, base);
+        immediate(displacement);
+    }
+
+    void indexed(int reg, Register index, std::int32_t displacement) noexcept
+    {
+        modrm(0b10, reg, rsp); // SIB follows
+        byte((0b11 << 6) | ((index & 7) << 3) | (base & 7));
+        immediate(displacement);
+    }
+
+public:
+    using Label = std::uint8_t*;
+    using Fixup = std::uint8_t*;
+
+    Assembler(std::uint8_t* buffer, std::size_t size) noexcept
+        : start(buffer), cursor(buffer), end(buffer + size) {}
+
+    [[nodiscard]] Label here() const noexcept
+    {
+        return cursor;
+    }
+
+    [[nodiscard]] std::size_t size() const noexcept
+    {
+        return cursor - start;
+    }
+
+    // movzx dst32, byte [base + displacement]
+    void load_byte(Register dst, std::int32_t displacement) noexcept
+    {
+        rex(false, dst, 0, base);
+        byte(0x0F);
+        byte(0xB6);
+        memory(dst, displacement);
+    }
+
+    // mov byte [base + displacement], src8
+    void store_byte(std::int32_t displacement, Register src) noexcept
+    {
+        // The REX prefix selects sil/dil/bpl instead of dh/bh/ch
+        rex(false, src, 0, base, true);
+        byte(0x88);
+        memory(src, displacement);
+    }
+
+    // mov byte [base + displacement], value
+    void store_byte_immediate(std::int32_t displacement, std::uint8_t value) noexcept
+    {
+        rex(false, 0, 0, base);
+        byte(0xC6);
+        memory(0, displacement);
+        byte(value);
+    }
+
+    // movzx dst32, word [base + displacement]
+    void load_word(Register dst, std::int32_t displacement) noexcept
+    {
+        rex(false, dst, 0, base);
+        byte(0x0F);
+        byte(0xB7);
+        memory(dst, displacement);
+    }
+
+    // mov word [base + displacement], src16
+    void store_word(std::int32_t displacement, Register src) noexcept
+    {
+        byte(0x66);
+        rex(false, src, 0, base);
+        byte(0x89);
+        memory(src, displacement);
+    }
+
+    // mov word [base + displacement], value
+    void store_word_immediate(std::int32_t displacement, std::uint16_t value) noexcept
+    {
+        byte(0x66);
+        rex(false, 0, 0, base);
+        byte(0xC7);
+        memory(0, displacement);
+        immediate(value);
+    }
+
+    // mov dst64, qword [base + displacement]
+    void load_qword(Register dst, std::int32_t displacement) noexcept
+    {
+        rex(true, dst, 0, base);
+        byte(0x8B);
+        memory(dst, displacement);
+    }
+
+    // mov qword [base + displacement], src64
+    void store_qword(std::int32_t displacement, Register src) noexcept
+    {
+        rex(true, src, 0, base);
+        byte(0x89);
+        memory(src, displacement);
+    }
+
+    // mov dst64, qword [base + index * 8 + displacement]
+    void load_qword_indexed(Register dst, Register index, std::int32_t displacement) noexcept
+    {
+        rex(true, dst, index, base);
+        byte(0x8B);
+        indexed(dst, index, displacement);
+    }
+
+    // mov qword [base + index * 8 + displacement], value
+    void store_qword_indexed_immediate(Register index, std::int32_t displacement, std::int32_t value) noexcept
+    {
+        rex(true, 0, index, base);
+        byte(0xC7);
+        indexed(0, index, displacement);
+        immediate(value);
+    }
+
+    // mov dst32, src32
+    void mov(Register dst, Register src) noexcept
+    {
+        rex(false, src, 0, dst);
+        byte(0x89);
+        modrm(0b11, src, dst);
+    }
+
+    // mov dst64, src64
+    void mov64(Register dst, Register src) noexcept
+    {
+        rex(true, src, 0, dst);
+        byte(0x89);
+        modrm(0b11, src, dst);
+    }
+
+    // mov dst32, value
+    void mov_immediate(Register dst, std::uint32_t value) noexcept
+    {
+        rex(false, 0, 0, dst);
+        byte(0xB8 + (dst & 7));
+        immediate(value);
+    }
+
+    // mov dst64, value
+    void mov_immediate64(Register dst, std::uint64_t value) noexcept
+    {
+        rex(true, 0, 0, dst);
+        byte(0xB8 + (dst & 7));
+        immediate(value);
+    }
+
+    // <op> dst32, src32
+    void alu(Operation op, Register dst, Register src) noexcept
+    {
+        rex(false, src, 0, dst);
+        byte(op);
+        modrm(0b11, src, dst);
+    }
+
+    // <op> dst, value (64-bit operand size if wide)
+    void alu_immediate(Operation op, Register dst, std::int32_t value, bool wide = false) noexcept
+    {
+        // The /digit extension is the opcode of the r/m, reg form divided by 8
+        rex(wide, 0, 0, dst);
+        byte(0x81);
+        modrm(0b11, op >> 3, dst);
+        immediate(value);
+    }
+
+    // shl dst32, 1
+    void shl1(Register dst) noexcept
+    {
+        rex(false, 0, 0, dst);
+        byte(0xD1);
+        modrm(0b11, 4, dst);
+    }
+
+    // shr dst32, count
+    void shr(Register dst, std::uint8_t count) noexcept
+    {
+        rex(false, 0, 0, dst);
+        byte(0xC1);
+        modrm(0b11, 5, dst);
+        byte(count);
+    }
+
+    // movzx dst32, dst8 (only for rax, rcx and rdx)
+    void zero_extend_byte(Register dst) noexcept
+    {
+        assert(dst <= rdx);
+
+        byte(0x0F);
+        byte(0xB6);
+        modrm(0b11, dst, dst);
+    }
+
+    // movzx dst32, dst16
+    void zero_extend_word(Register dst) noexcept
+    {
+        rex(false, dst, 0, dst);
+        byte(0x0F);
+        byte(0xB7);
+        modrm(0b11, dst, dst);
+    }
+
+    // imul dst32, src32, value
+    void imul(Register dst, Register src, std::int8_t value) noexcept
+    {
+        rex(false, dst, 0, src);
+        byte(0x6B);
+        modrm(0b11, dst, src);
+        immediate(value);
+    }
+
+    // set<cc> dst8 (only for rax, rcx and rdx)
+    void set(Condition condition, Register dst) noexcept
+    {
+        assert(dst <= rdx);
+
+        byte(0x0F);
+        byte(0x90 + condition);
+        modrm(0b11, 0, dst);
+    }
+
+    // test dst64, dst64
+    void test64(Register dst) noexcept
+    {
+        rex(true, dst, 0, dst);
+        byte(0x85);
+        modrm(0b11, dst, dst);
+    }
+
+    // test eax, value
+    void test_eax(std::uint32_t value) noexcept
+    {
+        byte(0xA9);
+        immediate(value);
+    }
+
+    // inc dst64
+    void inc64(Register dst) noexcept
+    {
+        rex(true, 0, 0, dst);
+        byte(0xFF);
+        modrm(0b11, 0, dst);
+    }
+
+    // dec dst64
+    void dec64(Register dst) noexcept
+    {
+        rex(true, 0, 0, dst);
+        byte(0xFF);
+        modrm(0b11, 1, dst);
+    }
+
+    void push(Register src) noexcept
+    {
+        rex(false, 0, 0, src);
+        byte(0x50 + (src & 7));
+    }
+
+    void pop(Register dst) noexcept
+    {
+        rex(false, 0, 0, dst);
+        byte(0x58 + (dst & 7));
+    }
+
+    // sub/add rsp, value
+    void adjust_stack(std::int8_t value) noexcept
+    {
+        byte(0x48);
+        byte(0x83);
+        modrm(0b11, value < 0 ? 5 : 0, rsp);
+        immediate(static_cast<std::int8_t>(value < 0 ? -value : value));
+    }
+
+    // call dst64
+    void call(Register dst) noexcept
+    {
+        rex(false, 0, 0, dst);
+        byte(0xFF);
+        modrm(0b11, 2, dst);
+    }
+
+    void ret() noexcept
+    {
+        byte(0xC3);
+    }
+
+    [[nodiscard]] Fixup jump() noexcept
+    {
+        byte(0xE9);
+        immediate<std::int32_t>(0);
+        return cursor - 4;
+    }
+
+    [[nodiscard]] Fixup jump(Condition condition) noexcept
+    {
+        byte(0x0F);
+        byte(0x80 + condition);
+        immediate<std::int32_t>(0);
+        return cursor - 4;
+    }
+
+    static void bind(Fixup fixup, Label target) noexcept
+    {
+        const std::int32_t offset = target - (fixup + 4);
+        std::memcpy(fixup, &offset, sizeof(offset));
+    }
+};
+
+[[nodiscard]] bool ends_block(Opcode opcode) noexcept
+{
+    switch (opcode)
+    {
+    case Opcode::jp:
+    case Opcode::call:
+    case Opcode::ret:
+    case Opcode::se_x_kk:
+    case Opcode::sne_x_kk:
+    case Opcode::se_x_y:
+    case Opcode::sne_x_y:
+    case Opcode::jp_v0:
+    case Opcode::skp_key:
+    case Opcode::sknp_key:
+    case Opcode::ld_key:
+        return true;
+    default:
+        return false;
+    }
+}
+
+[[nodiscard]] bool uses_helper(Opcode opcode) noexcept
+{
+    switch (opcode)
+    {
+    case Opcode::cls:
+    case Opcode::rnd:
+    case Opcode::drw:
+    case Opcode::skp_key:
+    case Opcode::sknp_key:
+    case Opcode::ld_dt:
+    case Opcode::set_dt:
+    case Opcode::set_st:
+    case Opcode::str_bcd:
+    case Opcode::str_vx:
+    case Opcode::ld_vx:
+        return true;
+    default:
+        return false;
+    }
+}
+
+[[nodiscard]] bool needs_interpreter(const DecodedInstruction& op, std::uint16_t pc) noexcept
+{
+    /*
+    * The interpreter is used for illegal opcodes and for any instruction
+    * whose statically known successor is out of range, so that it can
+    * record exactly the same faults. Jumping to the current instruction
+    * halts the CPU and Fx0A waits for a key, which the interpreter also
+    * deals with.
+    */
+
+    constexpr int limit = 0x1000 - 1;
+
+    switch (op.opcode)
+    {
+    case Opcode::undecoded:
+    case Opcode::illegal:
+    case Opcode::ld_key:
+        return true;
+    case Opcode::jp:
+        return op.nnn == pc || op.nnn >= limit;
+    case Opcode::call:
+        return op.nnn >= limit;
+    case Opcode::ret:
+    case Opcode::jp_v0:
+        return false; // Checked at runtime
+    case Opcode::se_x_kk:
+    case Opcode::sne_x_kk:
+    case Opcode::se_x_y:
+    case Opcode::sne_x_y:
+    case Opcode::skp_key:
+    case Opcode::sknp_key:
+        return pc + 2 * Instruction::width >= limit;
+    default:
+        return pc + Instruction::width >= limit;
+    }
+}
+
+} // namespace
+
+Jit::Jit(const Target& target) : target(target)
+{
+    void* memory = mmap(nullptr, BufferSize, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (memory == MAP_FAILED)
+        throw std::runtime_error("Unable to allocate memory for the JIT");
+
+    buffer = static_cast<std::uint8_t*>(memory);
+}
+
+Jit::~Jit()
+{
+    munmap(buffer, BufferSize);
+}
+
+Jit::Result Jit::run(std::uint16_t address, std::uint64_t budget)
+{
+    assert(budget > 0);
+
+    Block block = blocks[address];
+
+    if (block == nullptr)
+        block = compile(address);
+
+    invalidated = false;
+
+    return block(target.registers, budget);
+}
+
+void Jit::invalidate(std::size_t address, std::size_t size) noexcept
+{
+    assert(address + size <= translated.size());
+
+    bool hit = false;
+    for (std::size_t i = address; i < address + size && !hit; ++i)
+        hit = translated[i];
+
+    // Most writes are to data, not code
+    if (!hit)
+        return;
+
+    const auto overlaps = [address, size](const Range& range) {
+        return range.begin < address + size && address < range.end;
+    };
+
+    for (const Range& range : ranges)
+        if (overlaps(range))
+            blocks[range.begin] = nullptr;
+
+    ranges.erase(std::remove_if(ranges.begin(), ranges.end(), overlaps), ranges.end());
+
+    translated.reset();
+    for (const Range& range : ranges)
+        for (std::size_t i = range.begin; i < range.end; ++i)
+            translated[i] = true;
+
+    invalidated = true;
+}
+
+bool Jit::take_invalidated() noexcept
+{
+    const bool result = invalidated;
+    invalidated = false;
+    return result;
+}
+
+void Jit::flush() noexcept
+{
+    blocks.fill(nullptr);
+    ranges.clear();
+    translated.reset();
+    used = 0;
+}
+
+Jit::Block Jit::compile(std::uint16_t address)
+{
+    struct Entry
+    {
+        std::uint16_t pc;
+        Instruction raw;
+        DecodedInstruction op;
+        bool interpret;
+    };
+
+    struct Exit
+    {
+        Assembler::Fixup fixup;
+        int pc; // Negative if the PC has already been stored
+        Status status;
+    };
+
+    // Decode the block
+    std::vector<Entry> code;
+
+    for (std::uint16_t pc = address; code.size() < MaxBlockSize; pc += Instruction::width)
+    {
+        const Instruction raw{target.memory + pc};
+        const DecodedInstruction op = decode(raw);
+        const bool interpret = needs_interpreter(op, pc);
+
+        code.push_back({pc, raw, op, interpret});
+
+        if (interpret || ends_block(op.opcode))
+            break;
+    }
+
+    // Keep the most used V registers in host registers
+    std::array<int, 16> uses = {};
+
+    for (const Entry& entry : code)
+    {
+        if (entry.interpret || uses_helper(entry.op.opcode))
+            continue;
+
+        switch (entry.op.opcode)
+        {
+        case Opcode::add_y:
+        case Opcode::sub_y:
+        case Opcode::subn_y:
+        case Opcode::shr:
+        case Opcode::shl:
+            ++uses[0xF];
+            [[fallthrough]];
+        case Opcode::ld_y:
+        case Opcode::or_y:
+        case Opcode::and_y:
+        case Opcode::xor_y:
+        case Opcode::se_x_y:
+        case Opcode::sne_x_y:
+            ++uses[entry.op.y];
+            [[fallthrough]];
+        case Opcode::ld_kk:
+        case Opcode::add_kk:
+        case Opcode::se_x_kk:
+        case Opcode::sne_x_kk:
+        case Opcode::add_i:
+        case Opcode::ld_digit:
+            ++uses[entry.op.x];
+            break;
+        case Opcode::jp_v0:
+            ++uses[0x0];
+            break;
+        default:
+            break;
+        }
+    }
+
+    std::array<int, 16> order;
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&uses](int a, int b) { return uses[a] > uses[b]; });
+
+    std::array<int, 16> location;
+    location.fill(-1);
+
+    std::vector<std::pair<int, Register>> allocated;
+    for (std::size_t i = 0; i < pool.size() && uses[order[i]] > 0; ++i)
+    {
+        location[order[i]] = pool[i];
+        allocated.emplace_back(order[i], pool[i]);
+    }
+
+    // Make sure there's enough space left
+    if (BufferSize - used < MaxCodeSize)
+        flush();
+
+    if (mprotect(buffer, BufferSize, PROT_READ | PROT_WRITE) != 0)
+        throw std::runtime_error("Unable to make the JIT buffer writable");
+
+    Assembler a{buffer + used, MaxCodeSize};
+    std::vector<Exit> exits;
+
+    // V0-VF are at the start of the guest state
+    const auto offset = [](int reg) { return static_cast<std::int32_t>(reg); };
+
+    const auto load = [&](Register dst, int reg) {
+        if (location[reg] >= 0)
+            a.mov(dst, static_cast<Register>(location[reg]));
+        else
+            a.load_byte(dst, offset(reg));
+    };
+
+    const auto store = [&](int reg, Register src) {
+        if (location[reg] >= 0)
+            a.mov(static_cast<Register>(location[reg]), src);
+        else
+            a.store_byte(offset(reg), src);
+    };
+
+    const auto spill = [&]() {
+        for (const auto& [reg, host] : allocated)
+            a.store_byte(offset(reg), host);
+
+        a.store_word(target.vi, vi);
+    };
+
+    const auto reload = [&]() {
+        for (const auto& [reg, host] : allocated)
+            a.load_byte(host, offset(reg));
+
+        a.load_word(vi, target.vi);
+    };
+
+    const auto exit = [&](Assembler::Fixup fixup, int pc, Status status) {
+        exits.push_back({fixup, pc, status});
+    };
+
+    const auto call_helper = [&](Instruction raw) {
+        spill();
+        a.mov_immediate64(rdi, reinterpret_cast<std::uintptr_t>(target.context));
+        a.mov_immediate(rsi, raw.raw);
+        a.mov64(rdx, budget);
+        a.mov_immediate64(rax, reinterpret_cast<std::uintptr_t>(target.helper));
+        a.call(rax);
+        reload();
+    };
+
+    // Prologue; keep the stack 16-byte aligned for the helper calls
+    const Assembler::Label entry = a.here();
+
+    for (Register reg : callee_saved)
+        a.push(reg);
+    a.adjust_stack(-8);
+
+    a.mov64(base, rdi);
+    a.mov64(budget, rsi);
+    reload();
+
+    bool terminated = false;
+
+    for (const Entry& entry : code)
+    {
+        const int pc = entry.pc;
+        const int next = pc + Instruction::width;
+        const int skip = pc + 2 * Instruction::width;
+        const auto& op = entry.op;
+
+        // Stop when the budget is exhausted
+        a.test64(budget);
+        exit(a.jump(equal), pc, Status::Continue);
+
+        if (entry.interpret)
+        {
+            exit(a.jump(), pc, Status::Interpret);
+            terminated = true;
+            break;
+        }
+
+        switch (op.opcode)
+        {
+        case Opcode::jp:
+            a.dec64(budget);
+            exit(a.jump(), op.nnn, Status::Continue);
+            break;
+        case Opcode::call:
+            // Let the interpreter deal with stack overflows
+            a.load_qword(rax, target.sp);
+            a.alu_immediate(op_cmp, rax, target.stack_size, true);
+            exit(a.jump(above_equal), pc, Status::Interpret);
+
+            a.dec64(budget);
+            a.store_qword_indexed_immediate(rax, target.stack, pc);
+            a.inc64(rax);
+            a.store_qword(target.sp, rax);
+            exit(a.jump(), op.nnn, Status::Continue);
+            break;
+        case Opcode::ret:
+            // Let the interpreter deal with stack underflows and invalid addresses
+            a.load_qword(rax, target.sp);
+            a.test64(rax);
+            exit(a.jump(equal), pc, Status::Interpret);
+
+            a.load_qword_indexed(rcx, rax, target.stack - sizeof(std::uint64_t));
+            a.alu_immediate(op_add, rcx, Instruction::width);
+            a.alu_immediate(op_cmp, rcx, 0x1000 - 1);
+            exit(a.jump(above_equal), pc, Status::Interpret);
+
+            a.dec64(budget);
+            a.dec64(rax);
+            a.store_qword(target.sp, rax);
+            a.store_word(target.pc, rcx);
+            exit(a.jump(), -1, Status::Continue);
+            break;
+        case Opcode::jp_v0:
+            // Let the interpreter deal with loops and invalid addresses
+            load(rax, target.quirks.jump_vx ? op.x : 0x0);
+            a.alu_immediate(op_add, rax, op.nnn);
+            a.alu_immediate(op_cmp, rax, pc);
+            exit(a.jump(equal), pc, Status::Interpret);
+            a.alu_immediate(op_cmp, rax, 0x1000 - 1);
+            exit(a.jump(above_equal), pc, Status::Interpret);
+
+            a.dec64(budget);
+            a.store_word(target.pc, rax);
+            exit(a.jump(), -1, Status::Continue);
+            break;
+        case Opcode::se_x_kk:
+        case Opcode::sne_x_kk:
+            a.dec64(budget);
+            load(rax, op.x);
+            a.alu_immediate(op_cmp, rax, op.kk);
+            exit(a.jump(op.opcode == Opcode::se_x_kk ? equal : not_equal), skip, Status::Continue);
+            exit(a.jump(), next, Status::Continue);
+            break;
+        case Opcode::se_x_y:
+        case Opcode::sne_x_y:
+            a.dec64(budget);
+            load(rax, op.x);
+            load(rcx, op.y);
+            a.alu(op_cmp, rax, rcx);
+            exit(a.jump(op.opcode == Opcode::se_x_y ? equal : not_equal), skip, Status::Continue);
+            exit(a.jump(), next, Status::Continue);
+            break;
+        case Opcode::skp_key:
+        case Opcode::sknp_key:
+            a.dec64(budget);
+            call_helper(entry.raw);
+            a.test_eax(Taken);
+            exit(a.jump(not_equal), skip, Status::Continue);
+            exit(a.jump(), next, Status::Continue);
+            break;
+        case Opcode::cls:
+        case Opcode::rnd:
+        case Opcode::drw:
+        case Opcode::ld_dt:
+        case Opcode::set_dt:
+        case Opcode::set_st:
+        case Opcode::str_bcd:
+        case Opcode::str_vx:
+        case Opcode::ld_vx:
+            a.dec64(budget);
+            call_helper(entry.raw);
+            a.test_eax(Failed);
+            exit(a.jump(not_equal), pc, Status::Fault);
+            // The rest of this block may have been overwritten
+            a.test_eax(Invalidated);
+            exit(a.jump(not_equal), next, Status::Continue);
+            break;
+        case Opcode::ld_kk:
+            a.dec64(budget);
+            a.mov_immediate(rax, op.kk);
+            store(op.x, rax);
+            break;
+        case Opcode::add_kk:
+            a.dec64(budget);
+            load(rax, op.x);
+            a.alu_immediate(op_add, rax, op.kk);
+            a.zero_extend_byte(rax);
+            store(op.x, rax);
+            break;
+        case Opcode::ld_y:
+            a.dec64(budget);
+            load(rax, op.y);
+            store(op.x, rax);
+            break;
+        case Opcode::or_y:
+        case Opcode::and_y:
+        case Opcode::xor_y:
+            a.dec64(budget);
+            load(rax, op.x);
+            load(rcx, op.y);
+            a.alu(op.opcode == Opcode::or_y ? op_or : op.opcode == Opcode::and_y ? op_and : op_xor, rax, rcx);
+            store(op.x, rax);
+
+            if (target.quirks.reset_vf)
+            {
+                a.mov_immediate(rcx, 0);
+                store(0xF, rcx);
+            }
+            break;
+        case Opcode::add_y:
+            a.dec64(budget);
+            load(rax, op.x);
+            load(rcx, op.y);
+            a.alu(op_add, rax, rcx);
+            a.mov(rcx, rax);
+            a.shr(rcx, 8);
+            a.zero_extend_byte(rax);
+            store(0xF, rcx);
+            store(op.x, rax);
+            break;
+        case Opcode::sub_y:
+        case Opcode::subn_y:
+        {
+            // VF = NOT borrow
+            const bool swap = op.opcode == Opcode::subn_y;
+
+            a.dec64(budget);
+            load(swap ? rcx : rax, op.x);
+            load(swap ? rax : rcx, op.y);
+            a.mov_immediate(rdx, 0);
+            a.alu(op_cmp, rax, rcx);
+            a.set(above_equal, rdx);
+            a.alu(op_sub, rax, rcx);
+            a.zero_extend_byte(rax);
+            store(0xF, rdx);
+            store(op.x, rax);
+            break;
+        }
+        case Opcode::shr:
+            a.dec64(budget);
+            load(rax, target.quirks.shift_vy ? op.y : op.x);
+            a.mov(rcx, rax);
+            a.alu_immediate(op_and, rcx, 0x01);
+            a.shr(rax, 1);
+            store(0xF, rcx);
+            store(op.x, rax);
+            break;
+        case Opcode::shl:
+            a.dec64(budget);
+            load(rax, target.quirks.shift_vy ? op.y : op.x);
+            a.mov(rcx, rax);
+            a.shr(rcx, 7);
+            a.shl1(rax);
+            a.zero_extend_byte(rax);
+            store(0xF, rcx);
+            store(op.x, rax);
+            break;
+        case Opcode::ld_addr:
+            a.dec64(budget);
+            a.mov_immediate(vi, op.nnn);
+            break;
+        case Opcode::add_i:
+            a.dec64(budget);
+            load(rax, op.x);
+            a.alu(op_add, vi, rax);
+            a.zero_extend_word(vi);
+            break;
+        case Opcode::ld_digit:
+            a.dec64(budget);
+            load(rax, op.x);
+            a.imul(vi, rax, 5);
+            break;
+        case Opcode::undecoded:
+        case Opcode::illegal:
+        case Opcode::ld_key:
+        case Opcode::fused_drw:
+        case Opcode::fused_loop:
+        case Opcode::fused_wait_dt:
+            assert(false);
+            break;
+        }
+
+        if (ends_block(op.opcode))
+        {
+            terminated = true;
+            break;
+        }
+    }
+
+    // Block was cut short
+    if (!terminated)
+        exit(a.jump(), code.back().pc + Instruction::width, Status::Continue);
+
+    // Exits
+    std::vector<Assembler::Fixup> to_epilogue;
+
+    for (const Exit& e : exits)
+    {
+        Assembler::bind(e.fixup, a.here());
+
+        if (e.pc >= 0)
+            a.store_word_immediate(target.pc, e.pc);
+
+        a.mov_immediate(rdx, static_cast<std::uint32_t>(e.status));
+        to_epilogue.push_back(a.jump());
+    }
+
+    // Epilogue; the status is already in rdx
+    for (Assembler::Fixup fixup : to_epilogue)
+        Assembler::bind(fixup, a.here());
+
+    spill();
+    a.mov64(rax, budget);
+    a.adjust_stack(8);
+
+    for (auto reg = callee_saved.rbegin(); reg != callee_saved.rend(); ++reg)
+        a.pop(*reg);
+
+    a.ret();
+
+    used += a.size();
+
+    if (mprotect(buffer, BufferSize, PROT_READ | PROT_EXEC) != 0)
+        throw std::runtime_error("Unable to make the JIT buffer executable");
+
+    // Remember which bytes were translated
+    const Range range{address, static_cast<std::uint16_t>(code.back().pc + Instruction::width)};
+    ranges.push_back(range);
+
+    for (std::size_t i = range.begin; i < range.end; ++i)
+        translated[i] = true;
+
+    const Block block = reinterpret_cast<Block>(entry);
+    blocks[address] = block;
+
+    return block;
+}
+
+#endif
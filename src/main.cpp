@@ -1,38 +1,212 @@
+#include "audio.hpp"
+#include "control.hpp"
 #include "cpu.hpp"
 #include "graphics.hpp"
 #include "input.hpp"
 #include "rom.hpp"
+#include "scheduling.hpp"
+#include "timing.hpp"
+
+#ifdef RECOMPILED_ROM
+#include "recompiled.hpp"
+#endif
 
 #include "CLI11.hpp"
+#include <SFML/Audio.hpp>
 #include <SFML/Graphics.hpp>
 #include <SFML/System.hpp>
 #include <SFML/Window.hpp>
 
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
 #include <cstdlib>
 #include <exception>
+#include <functional>
 #include <future>
 #include <iostream>
+#include <map>
+#include <ratio>
+#include <optional>
 #include <string>
-#include <thread>
+#include <vector>
+
+#ifdef RECOMPILED_ROM
+// Generated by chip8_recompiler (see RecompileROM in CMakeLists.txt)
+extern const Recompiled recompiled_rom;
+#endif
+
+namespace
+{
+
+class SpeakerStream : public sf::SoundStream
+{
+    // Plays a Speaker on SFML's audio thread
+    Speaker& speaker;
+    std::array<std::int16_t, 1024> block = {};
+
+public:
+    explicit SpeakerStream(Speaker& speaker) : speaker(speaker)
+    {
+        initialize(1, Speaker::SampleRate);
+    }
+
+    ~SpeakerStream() override
+    {
+        // The audio thread must be stopped before the members it uses are destroyed
+        stop();
+    }
+
+private:
+    bool onGetData(Chunk& data) override
+    {
+        speaker.fill(block.data(), block.size());
+
+        data.samples = block.data();
+        data.sampleCount = block.size();
+        return true;
+    }
+
+    void onSeek(sf::Time) override
+    {
+    }
+};
+
+class StopOnExit
+{
+    // Stops the CPU thread when main() leaves, exceptions included, before the future's destructor waits for it
+    CommandQueue& commands;
+    std::future<std::optional<CPU::Fault>>& thread;
+    bool stopped = false;
+
+public:
+    StopOnExit(CommandQueue& commands, std::future<std::optional<CPU::Fault>>& thread) : commands(commands), thread(thread)
+    {
+    }
+
+    ~StopOnExit()
+    {
+        stop();
+    }
+
+    void stop()
+    {
+        // The CPU thread makes room between batches, unless it has returned already and never will
+        while (!stopped && thread.valid() && !commands.send(CommandQueue::Command::Stop))
+            stopped = thread.wait_for(std::chrono::milliseconds(1)) == std::future_status::ready;
+
+        stopped = true;
+    }
+};
+
+} // namespace
 
 int main(int argc, char* argv[])
 {
     CLI::App app{"CHIP-8 interpreter as implemented on the COSMAC VIP"};
 
+#ifndef RECOMPILED_ROM
     std::string rom_path;
     app.add_option("rom", rom_path, "ROM to execute")->required()->check(CLI::ExistingFile);
 
+    Profile profile = Profile::Legacy;
+    const std::map<std::string, Profile> profiles{
+        {"legacy", Profile::Legacy},
+        {"vip", Profile::CosmacVIP},
+        {"chip48", Profile::Chip48},
+        {"schip", Profile::SuperChip},
+        {"modern", Profile::Modern},
+    };
+    const auto quirks = app.add_option("-q,--quirks", profile, "Quirk profile the ROM was written for")->transform(CLI::CheckedTransformer(profiles, CLI::ignore_case));
+
+    // Kept so that old command lines still work, -q modern changes Fx55 & Fx65 as well
     bool modern_behaviour = false;
-    app.add_flag("-m,--modern", modern_behaviour, "Use modern shifting behaviour (8xy6 & 8xyE)");
+    app.add_flag("-m,--modern", modern_behaviour, "Deprecated, use modern shifting behaviour (8xy6 & 8xyE) with the legacy profile")->excludes(quirks);
+#endif
 
     std::size_t target_frequency = 600;
     app.add_option("-f,--frequency", target_frequency, "Target frequency", true)->check(CLI::Range(1, 10000));
 
+    bool frame_locked = false;
+    app.add_flag("-l,--frame-locked", frame_locked, "Run frequency / 60 instructions per 60 Hz tick, instead of in 50 ms batches");
+
+    bool turbo = false;
+    app.add_flag("--turbo", turbo, "Run as fast as possible, holding Tab does the same");
+
+    CPU::Timing timing = CPU::Timing::Uniform;
+    const std::map<std::string, CPU::Timing> timings{
+        {"uniform", CPU::Timing::Uniform},
+        {"vip", CPU::Timing::CosmacVIP},
+    };
+    app.add_option("-t,--timing", timing, "Instruction timing, vip ignores the frequency")->transform(CLI::CheckedTransformer(timings, CLI::ignore_case));
+
+#ifdef RECOMPILED_ROM
+    CPU::Engine engine = CPU::Engine::Recompiled;
+#else
+    CPU::Engine engine = CPU::Engine::Switch;
+#endif
+    const std::map<std::string, CPU::Engine> engines{
+        {"switch", CPU::Engine::Switch},
+        {"predecoded", CPU::Engine::Predecoded},
+#ifdef THREADED_ENGINE
+        {"threaded", CPU::Engine::Threaded},
+#endif
+#ifdef JIT_ENGINE
+        {"jit", CPU::Engine::Jit},
+#endif
+#ifdef RECOMPILED_ROM
+        {"recompiled", CPU::Engine::Recompiled},
+#endif
+    };
+    app.add_option("-e,--engine", engine, "Execution engine")->transform(CLI::CheckedTransformer(engines, CLI::ignore_case));
+
+    std::uint64_t seed = 0;
+    const auto seed_option = app.add_option("-s,--seed", seed, "Seed for Cxkk, random if not set");
+
+    std::string wav_path;
+    app.add_option("-w,--wav", wav_path, "Record the sound to a WAV file instead of playing it");
+
+    unsigned cpu_core = 0;
+    const auto cpu_core_option = app.add_option("--cpu-core", cpu_core, "Pin the CPU thread to this core");
+
+    unsigned render_core = 0;
+    const auto render_core_option = app.add_option("--render-core", render_core, "Pin the rendering thread to this core");
+
+    bool realtime = false;
+    app.add_flag("--realtime", realtime, "Run both threads with SCHED_FIFO, or a higher nice priority if that isn't permitted. "
+                                         "Not with both threads on the same core, where the CPU thread never yields it in turbo mode");
+
     CLI11_PARSE(app, argc, argv);
 
+    // In turbo mode the CPU thread doesn't sleep, and SCHED_FIFO would leave the rendering thread only what RT throttling spares
+    if (realtime && *cpu_core_option && *render_core_option && cpu_core == render_core)
+        return app.exit(CLI::ValidationError("--realtime", "the CPU and rendering threads must be on different cores"));
+
+#ifndef RECOMPILED_ROM
+    if (modern_behaviour)
+        profile = Profile::LegacyModern;
+#endif
+
+    ThreadPolicy cpu_policy;
+    cpu_policy.realtime = realtime;
+    if (*cpu_core_option)
+        cpu_policy.core = cpu_core;
+
+    ThreadPolicy render_policy;
+    render_policy.realtime = realtime;
+    if (*render_core_option)
+        render_policy.core = render_core;
+
     try
     {
+#ifdef RECOMPILED_ROM
+        const std::vector<std::uint8_t> ROM(recompiled_rom.rom.cbegin(), recompiled_rom.rom.cend());
+        const Profile profile = recompiled_rom.profile;
+#else
         auto ROM = LoadFile(rom_path);
+#endif
 
         if (!CheckROM(ROM))
         {
@@ -51,10 +225,48 @@ int main(int argc, char* argv[])
 
         Frame frame;
         Keyboard keyboard{window};
-        CPU cpu{ROM, modern_behaviour, &frame, &keyboard};
+        Speaker speaker;
+        CPU cpu{ROM, profile, &frame, &keyboard, &speaker};
+#ifdef RECOMPILED_ROM
+        cpu.use_program(recompiled_rom);
+#endif
+        cpu.use_engine(engine);
+        cpu.use_timing(timing);
+
+        if (*seed_option)
+            cpu.seed(seed);
+
+        std::optional<WavSink> wav;
+        std::optional<SpeakerStream> stream;
+
+        if (!wav_path.empty())
+            wav.emplace(wav_path);
+        else
+            stream.emplace(speaker).play();
+
+        cpu.set_turbo(turbo);
 
-        std::promise<void> stop_token;
-        std::thread cpu_thread{&CPU::run_at, &cpu, stop_token.get_future(), target_frequency};
+        // Faults (and any exception) come back through the future
+        CommandQueue commands;
+        std::promise<std::string> cpu_scheduling;
+        auto cpu_thread = std::async(std::launch::async, [&] {
+            cpu_scheduling.set_value(ApplyPolicy(cpu_policy));
+            return frame_locked ? cpu.run_frames(commands, target_frequency) : cpu.run_at(commands, target_frequency);
+        });
+        StopOnExit stop_cpu{commands, cpu_thread};
+        bool running = true;
+
+        // Only now, so that the audio and CPU threads don't inherit it
+        std::cout << "CPU thread: " << cpu_scheduling.get_future().get() << "\nRendering thread: "
+                  << ApplyPolicy(render_policy) << std::endl;
+
+        // setFramerateLimit(60) aims for a frame every period
+        using Period = std::chrono::duration<std::int64_t, std::ratio<1, 60>>;
+        PercentileHistogram render_deviation;
+        std::optional<std::chrono::steady_clock::time_point> displayed;
+
+        std::size_t frequency = target_frequency;
+        bool paused = false;
 
         sf::Clock clock;
         int frame_count = 0;
@@ -71,8 +283,45 @@ int main(int argc, char* argv[])
                 {
                     window.close();
 
-                    stop_token.set_value();
-                    cpu_thread.join();
+                    if (running)
+                    {
+                        stop_cpu.stop();
+
+                        if (const std::optional<CPU::Fault> fault = cpu_thread.get())
+                        {
+                            std::cout << fault->message() << std::endl;
+                            return EXIT_FAILURE;
+                        }
+                    }
+
+                    if (wav)
+                        wav->drain(speaker);
+
+                    const CPU::Statistics& statistics = cpu.read_statistics();
+                    std::cout << "Executed " << statistics.instructions << " instructions, "
+                              << statistics.fused << " as part of superinstructions" << std::endl;
+
+                    if (frame_locked)
+                    {
+                        std::cout << "Tick lateness:\n";
+                        cpu.read_jitter().print(std::cout);
+                        std::cout << "Tick-to-tick deviation from 1/60 s:\n";
+                    }
+                    else
+                    {
+                        const CPU::Pacing pacing = cpu.read_pacing();
+                        const std::size_t target = timing == CPU::Timing::CosmacVIP ? VipTiming::CyclesPerSecond : frequency;
+                        std::cout << "Ran at " << std::lround(pacing.frequency) << " Hz, targeting "
+                                  << target << " Hz" << std::endl;
+                        std::cout << "Deviation of the 50 ms sleeps between batches:\n";
+                    }
+
+                    cpu.read_deviation().print(std::cout);
+                    std::cout << "Frame-to-frame deviation from 1/60 s:\n";
+                    render_deviation.print(std::cout);
+
+                    if (stream)
+                        std::cout << speaker.underruns() << " audio underruns" << std::endl;
 
                     return EXIT_SUCCESS;
                 }
@@ -80,6 +329,30 @@ int main(int argc, char* argv[])
                 {
                     force_redraw = true;
                 }
+                else if (event.type == sf::Event::KeyPressed && event.key.code == sf::Keyboard::Tab)
+                {
+                    cpu.set_turbo(true);
+                }
+                else if (event.type == sf::Event::KeyReleased && event.key.code == sf::Keyboard::Tab)
+                {
+                    cpu.set_turbo(turbo);
+                }
+                else if (event.type == sf::Event::KeyPressed && event.key.code == sf::Keyboard::P)
+                {
+                    paused = !paused;
+                    commands.send(paused ? CommandQueue::Command::Pause : CommandQueue::Command::Resume);
+                    window.setTitle(paused ? "CHIP-8 Virtual Machine (paused, N steps)" : "CHIP-8 Virtual Machine");
+                }
+                else if (event.type == sf::Event::KeyPressed && event.key.code == sf::Keyboard::N)
+                {
+                    commands.send(CommandQueue::Command::Step);
+                }
+                else if (event.type == sf::Event::KeyPressed &&
+                         (event.key.code == sf::Keyboard::PageUp || event.key.code == sf::Keyboard::PageDown))
+                {
+                    frequency = std::clamp<std::size_t>(event.key.code == sf::Keyboard::PageUp ? frequency * 2 : frequency / 2, 1, 10000);
+                    commands.send(CommandQueue::Command::SetFrequency, frequency);
+                }
                 else if (event.type == sf::Event::KeyPressed)
                 {
                     keyboard.register_keypress(event.key, true);
@@ -92,18 +365,43 @@ int main(int argc, char* argv[])
                 // TODO: Process more event types
             }
 
+            // Halting leaves the last frame on the screen, a fault ends the program
+            if (running && cpu_thread.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+            {
+                running = false;
+
+                if (const std::optional<CPU::Fault> fault = cpu_thread.get())
+                {
+                    std::cout << fault->message() << std::endl;
+                    return EXIT_FAILURE;
+                }
+            }
+
+            if (wav)
+                wav->drain(speaker);
+
             frame.render(window, force_redraw);
             window.display();
 
+            const auto now = std::chrono::steady_clock::now();
+            if (displayed)
+                render_deviation.record(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::abs(now - *displayed - Period{1})));
+            displayed = now;
+
             if (++frame_count >= 120)
             {
                 sf::Time elapsed = clock.getElapsedTime();
                 int avg_fps = frame_count / elapsed.asSeconds();
 
                 // TODO: Use std::format when available
-                char title[64];
-                std::snprintf(title, 64, "CHIP-8 Virtual Machine (%d fps)", avg_fps);
-                window.setTitle(title);
+                const CPU::Pacing pacing = cpu.read_pacing();
+
+                char title[128];
+                std::snprintf(title, 128, "CHIP-8 Virtual Machine (%d fps, %.2f MIPS, %.1fx)", avg_fps,
+                              pacing.instructions / 1e6, pacing.speedup);
+
+                if (!paused)
+                    window.setTitle(title);
 
                 frame_count = 0;
                 clock.restart();
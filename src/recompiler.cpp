@@ -0,0 +1,719 @@
+#include "recompiler.hpp"
+#include "instruction.hpp"
+
+#include <bitset>
+#include <cassert>
+#include <cstdint>
+#include <iomanip>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace
+{
+
+constexpr std::size_t Origin = 0x200; // Programs are loaded at 0x200
+constexpr std::size_t Limit = 0xFFF;  // PC must stay below 0xFFF (see CPU::Limit)
+
+std::string Hex(std::size_t Value, int Digits)
+{
+    std::ostringstream stream;
+    stream << "0x" << std::uppercase << std::hex << std::setfill('0') << std::setw(Digits) << Value;
+    return stream.str();
+}
+
+std::string Address(std::size_t Value)
+{
+    return Hex(Value, 3);
+}
+
+std::string Register(std::size_t Index)
+{
+    std::ostringstream stream;
+    stream << 'v' << std::uppercase << std::hex << Index;
+    return stream.str();
+}
+
+std::string Label(std::size_t Address)
+{
+    std::ostringstream stream;
+    stream << "block_" << std::uppercase << std::hex << Address;
+    return stream.str();
+}
+
+const char* Name(Profile profile) noexcept
+{
+    switch (profile)
+    {
+    case Profile::CosmacVIP:
+        return "Profile::CosmacVIP";
+    case Profile::Chip48:
+        return "Profile::Chip48";
+    case Profile::SuperChip:
+        return "Profile::SuperChip";
+    case Profile::Legacy:
+        return "Profile::Legacy";
+    case Profile::LegacyModern:
+        return "Profile::LegacyModern";
+    case Profile::Modern:
+        break;
+    }
+
+    return "Profile::Modern";
+}
+
+const char* Mnemonic(Opcode opcode) noexcept
+{
+    switch (opcode)
+    {
+    case Opcode::cls:
+        return "cls";
+    case Opcode::ret:
+        return "ret";
+    case Opcode::jp:
+        return "jp";
+    case Opcode::call:
+        return "call";
+    case Opcode::se_x_kk:
+        return "se_x_kk";
+    case Opcode::sne_x_kk:
+        return "sne_x_kk";
+    case Opcode::se_x_y:
+        return "se_x_y";
+    case Opcode::ld_kk:
+        return "ld_kk";
+    case Opcode::add_kk:
+        return "add_kk";
+    case Opcode::ld_y:
+        return "ld_y";
+    case Opcode::or_y:
+        return "or_y";
+    case Opcode::and_y:
+        return "and_y";
+    case Opcode::xor_y:
+        return "xor_y";
+    case Opcode::add_y:
+        return "add_y";
+    case Opcode::sub_y:
+        return "sub_y";
+    case Opcode::shr:
+        return "shr";
+    case Opcode::subn_y:
+        return "subn_y";
+    case Opcode::shl:
+        return "shl";
+    case Opcode::sne_x_y:
+        return "sne_x_y";
+    case Opcode::ld_addr:
+        return "ld_addr";
+    case Opcode::jp_v0:
+        return "jp_v0";
+    case Opcode::rnd:
+        return "rnd";
+    case Opcode::drw:
+        return "drw";
+    case Opcode::skp_key:
+        return "skp_key";
+    case Opcode::sknp_key:
+        return "sknp_key";
+    case Opcode::ld_dt:
+        return "ld_dt";
+    case Opcode::ld_key:
+        return "ld_key";
+    case Opcode::set_dt:
+        return "set_dt";
+    case Opcode::set_st:
+        return "set_st";
+    case Opcode::add_i:
+        return "add_i";
+    case Opcode::ld_digit:
+        return "ld_digit";
+    case Opcode::str_bcd:
+        return "str_bcd";
+    case Opcode::str_vx:
+        return "str_vx";
+    case Opcode::ld_vx:
+        return "ld_vx";
+    case Opcode::undecoded:
+    case Opcode::illegal:
+    case Opcode::fused_drw:
+    case Opcode::fused_loop:
+    case Opcode::fused_wait_dt:
+        break;
+    }
+
+    return "illegal";
+}
+
+class Recompiler
+{
+    byte_view ROM;
+    Profile Behaviour;
+
+    std::bitset<0x1000> Leaders;    // Addresses that start a basic block
+    std::bitset<0x1000> Explored;   // Instructions whose successors are known
+    std::vector<std::size_t> Worklist;
+
+    std::vector<std::size_t> BlockEnds; // One per translated leader, in ascending order
+    std::size_t BlockSize = 0;          // Instructions in the block being emitted
+    std::size_t Position = 0;           // Instructions emitted so far, including the current one
+    bool UsesDispatch = false;
+    bool UsesReload = false;
+
+public:
+    Recompiler(byte_view ROM, Profile Behaviour) : ROM(ROM), Behaviour(Behaviour) {}
+
+    Translation Run(const std::string& Symbol);
+
+private:
+    bool Contains(std::size_t Address) const noexcept;
+    Instruction Fetch(std::size_t Address) const noexcept;
+    bool Translatable(std::size_t Address) const noexcept;
+
+    void AddLeader(std::size_t Address);
+    bool AddSuccessors(std::size_t Address, const DecodedInstruction& Op);
+    void Explore();
+
+    std::size_t EmitBlock(std::ostream& Out, std::size_t Leader);
+    std::size_t EmitBody(std::ostream& Out, std::size_t Leader, std::size_t& End);
+    bool EmitInstruction(std::ostream& Out, std::size_t Address, const DecodedInstruction& Op);
+    void EmitJump(std::ostream& Out, std::size_t Target, const char* Indent) const;
+    void EmitFallback(std::ostream& Out, std::size_t Address, const char* Indent) const;
+    void EmitExecute(std::ostream& Out, std::size_t Address, bool Reload, bool MayFault = false);
+};
+
+bool Recompiler::Contains(std::size_t Address) const noexcept
+{
+    // Only the ROM is translated, the rest of memory is left to the interpreter
+    return Address >= Origin && Address + Instruction::width <= Origin + ROM.size();
+}
+
+Instruction Recompiler::Fetch(std::size_t Address) const noexcept
+{
+    return Instruction{ROM.data() + (Address - Origin)};
+}
+
+bool Recompiler::Translatable(std::size_t Address) const noexcept
+{
+    /*
+    * Instructions that halt the CPU, wait for input or are guaranteed to
+    * fault end their block and are executed by the interpreter instead.
+    */
+
+    if (!Contains(Address))
+        return false;
+
+    const Instruction instruction = Fetch(Address);
+    const DecodedInstruction op = decode(instruction);
+    const std::size_t next = Address + Instruction::width;
+
+    switch (op.opcode)
+    {
+    case Opcode::undecoded:
+    case Opcode::illegal:
+    case Opcode::ld_key:
+        return false;
+    case Opcode::jp:
+    case Opcode::call:
+        return op.nnn != Address && op.nnn < Limit;
+    case Opcode::ret:
+    case Opcode::jp_v0:
+        return true;
+    case Opcode::se_x_kk:
+    case Opcode::sne_x_kk:
+    case Opcode::se_x_y:
+    case Opcode::sne_x_y:
+    case Opcode::skp_key:
+    case Opcode::sknp_key:
+        return next + Instruction::width < Limit;
+    default:
+        return next < Limit;
+    }
+}
+
+void Recompiler::AddLeader(std::size_t Address)
+{
+    if (Address >= Leaders.size() || Leaders[Address])
+        return;
+
+    Leaders.set(Address);
+    Worklist.push_back(Address);
+}
+
+bool Recompiler::AddSuccessors(std::size_t Address, const DecodedInstruction& Op)
+{
+    // Returns true if the instruction ends its basic block
+    const std::size_t next = Address + Instruction::width;
+
+    switch (Op.opcode)
+    {
+    case Opcode::jp:
+        AddLeader(Op.nnn);
+        return true;
+    case Opcode::call:
+        AddLeader(Op.nnn);
+        AddLeader(next);
+        return true;
+    case Opcode::ret:
+        return true;
+    case Opcode::se_x_kk:
+    case Opcode::sne_x_kk:
+    case Opcode::se_x_y:
+    case Opcode::sne_x_y:
+    case Opcode::skp_key:
+    case Opcode::sknp_key:
+        AddLeader(next);
+        AddLeader(next + Instruction::width);
+        return true;
+    case Opcode::jp_v0:
+        // Usually an index into a table of jumps, which is worth translating
+        for (std::size_t entry = Op.nnn; entry <= Op.nnn + 0xFFu && Contains(entry); entry += Instruction::width)
+        {
+            if (decode_opcode(Fetch(entry)) != Opcode::jp)
+                break;
+
+            AddLeader(entry);
+        }
+        return true;
+    case Opcode::str_vx:
+    case Opcode::str_bcd:
+        // Might overwrite the rest of the block
+        AddLeader(next);
+        return true;
+    default:
+        return false;
+    }
+}
+
+void Recompiler::Explore()
+{
+    AddLeader(Origin);
+
+    while (!Worklist.empty())
+    {
+        std::size_t address = Worklist.back();
+        Worklist.pop_back();
+
+        for (; address < Explored.size() && !Explored[address]; address += Instruction::width)
+        {
+            if (!Translatable(address))
+            {
+                // The interpreter resumes after an Fx0A, so it must be a leader
+                if (Contains(address) && decode_opcode(Fetch(address)) == Opcode::ld_key)
+                    AddLeader(address + Instruction::width);
+
+                break;
+            }
+
+            Explored.set(address);
+
+            if (AddSuccessors(address, decode(Fetch(address))))
+                break;
+        }
+    }
+}
+
+void Recompiler::EmitJump(std::ostream& Out, std::size_t Target, const char* Indent) const
+{
+    if (Target < Leaders.size() && Leaders[Target] && Translatable(Target))
+    {
+        Out << Indent << "goto " << Label(Target) << ";\n";
+    }
+    else
+    {
+        Out << Indent << "pc = " << Address(Target) << ";\n"
+            << Indent << "goto leave;\n";
+    }
+}
+
+void Recompiler::EmitFallback(std::ostream& Out, std::size_t Address, const char* Indent) const
+{
+    // Refund the instruction and let the interpreter execute (and report) it
+    Out << Indent << "++budget;\n"
+        << Indent << "pc = " << ::Address(Address) << ";\n"
+        << Indent << "goto leave;\n";
+}
+
+void Recompiler::EmitExecute(std::ostream& Out, std::size_t Address, bool Reload, bool MayFault)
+{
+    // This instruction and the rest of the block were charged up front
+    const std::size_t refund = BlockSize - Position + 1;
+
+    std::ostringstream call;
+    call << "Recompiled::execute<" << Name(Behaviour) << ">(cpu, " << ::Address(Address) << ", budget + " << std::dec << refund << ")";
+
+    Out << "    spill();\n";
+
+    if (MayFault)
+    {
+        Out << "    if (!" << call.str() << ")\n"
+            << "    {\n"
+            << "        budget += " << std::dec << refund << ";\n"
+            << "        pc = " << ::Address(Address) << ";\n"
+            << "        goto leave;\n"
+            << "    }\n";
+    }
+    else
+    {
+        Out << "    " << call.str() << ";\n";
+    }
+
+    if (Reload)
+    {
+        Out << "    reload();\n";
+        UsesReload = true;
+    }
+}
+
+bool Recompiler::EmitInstruction(std::ostream& Out, std::size_t Address, const DecodedInstruction& Op)
+{
+    // Returns true if the instruction ends its basic block
+    const std::size_t next = Address + Instruction::width;
+    const std::string x = Register(Op.x);
+    const std::string y = Register(Op.y);
+    const std::string kk = Hex(Op.kk, 2);
+    const Quirks quirks = ::quirks(Behaviour);
+
+    const auto skip_if = [&](const std::string& condition) {
+        Out << "    if (" << condition << ")\n"
+            << "    {\n";
+        EmitJump(Out, next + Instruction::width, "        ");
+        Out << "    }\n";
+        EmitJump(Out, next, "    ");
+        return true;
+    };
+
+    switch (Op.opcode)
+    {
+    case Opcode::cls:
+    case Opcode::set_dt:
+    case Opcode::set_st:
+        EmitExecute(Out, Address, false);
+        return false;
+    case Opcode::rnd:
+    case Opcode::ld_dt:
+        EmitExecute(Out, Address, true);
+        return false;
+    case Opcode::drw:
+    case Opcode::ld_vx:
+        EmitExecute(Out, Address, true, true);
+        return false;
+    case Opcode::str_vx:
+    case Opcode::str_bcd:
+        EmitExecute(Out, Address, true, true);
+        EmitJump(Out, next, "    ");
+        return true;
+    case Opcode::skp_key:
+    case Opcode::sknp_key:
+        EmitExecute(Out, Address, false);
+        Out << "    pc = Recompiled::pc(cpu);\n"
+            << "    goto dispatch;\n";
+        UsesDispatch = true;
+        return true;
+    case Opcode::ret:
+        Out << "    if (!Recompiled::ret(cpu, pc))\n"
+            << "    {\n";
+        EmitFallback(Out, Address, "        ");
+        Out << "    }\n"
+            << "    goto dispatch;\n";
+        UsesDispatch = true;
+        return true;
+    case Opcode::jp:
+        EmitJump(Out, Op.nnn, "    ");
+        return true;
+    case Opcode::call:
+        Out << "    if (!Recompiled::call(cpu, " << ::Address(Address) << "))\n"
+            << "    {\n";
+        EmitFallback(Out, Address, "        ");
+        Out << "    }\n";
+        EmitJump(Out, Op.nnn, "    ");
+        return true;
+    case Opcode::jp_v0:
+        Out << "    pc = " << ::Address(Op.nnn) << " + " << (quirks.jump_vx ? x : "v0") << ";\n"
+            << "    if (pc == " << ::Address(Address) << " || pc >= " << ::Address(Limit) << ")\n"
+            << "    {\n";
+        EmitFallback(Out, Address, "        ");
+        Out << "    }\n"
+            << "    goto dispatch;\n";
+        UsesDispatch = true;
+        return true;
+    case Opcode::se_x_kk:
+        return skip_if(x + " == " + kk);
+    case Opcode::sne_x_kk:
+        return skip_if(x + " != " + kk);
+    case Opcode::se_x_y:
+        return skip_if(x + " == " + y);
+    case Opcode::sne_x_y:
+        return skip_if(x + " != " + y);
+    case Opcode::ld_kk:
+        Out << "    " << x << " = " << kk << ";\n";
+        return false;
+    case Opcode::add_kk:
+        Out << "    " << x << " += " << kk << ";\n";
+        return false;
+    case Opcode::ld_y:
+        Out << "    " << x << " = " << y << ";\n";
+        return false;
+    case Opcode::or_y:
+        Out << "    " << x << " |= " << y << ";\n";
+
+        if (quirks.reset_vf)
+            Out << "    vF = 0;\n";
+        return false;
+    case Opcode::and_y:
+        Out << "    " << x << " &= " << y << ";\n";
+
+        if (quirks.reset_vf)
+            Out << "    vF = 0;\n";
+        return false;
+    case Opcode::xor_y:
+        Out << "    " << x << " ^= " << y << ";\n";
+
+        if (quirks.reset_vf)
+            Out << "    vF = 0;\n";
+        return false;
+    case Opcode::add_y:
+        Out << "    {\n"
+            << "        const unsigned result = " << x << " + " << y << ";\n"
+            << "        vF = result > 0xFF;\n"
+            << "        " << x << " = result;\n"
+            << "    }\n";
+        return false;
+    case Opcode::sub_y:
+        Out << "    {\n"
+            << "        const std::uint8_t result = " << x << " - " << y << ";\n"
+            << "        vF = " << x << " >= " << y << ";\n"
+            << "        " << x << " = result;\n"
+            << "    }\n";
+        return false;
+    case Opcode::subn_y:
+        Out << "    {\n"
+            << "        const std::uint8_t result = " << y << " - " << x << ";\n"
+            << "        vF = " << y << " >= " << x << ";\n"
+            << "        " << x << " = result;\n"
+            << "    }\n";
+        return false;
+    case Opcode::shr:
+        Out << "    {\n"
+            << "        const std::uint8_t data = " << (quirks.shift_vy ? y : x) << ";\n"
+            << "        vF = data & 0x01;\n"
+            << "        " << x << " = data >> 1;\n"
+            << "    }\n";
+        return false;
+    case Opcode::shl:
+        Out << "    {\n"
+            << "        const std::uint8_t data = " << (quirks.shift_vy ? y : x) << ";\n"
+            << "        vF = data >> 7;\n"
+            << "        " << x << " = data << 1;\n"
+            << "    }\n";
+        return false;
+    case Opcode::ld_addr:
+        Out << "    vi = " << ::Address(Op.nnn) << ";\n";
+        return false;
+    case Opcode::add_i:
+        Out << "    vi += " << x << ";\n";
+        return false;
+    case Opcode::ld_digit:
+        Out << "    vi = " << x << " * 5;\n";
+        return false;
+    case Opcode::ld_key:
+    case Opcode::undecoded:
+    case Opcode::illegal:
+    case Opcode::fused_drw:
+    case Opcode::fused_loop:
+    case Opcode::fused_wait_dt:
+        break;
+    }
+
+    // Filtered out by Translatable()
+    assert(false);
+    return true;
+}
+
+std::size_t Recompiler::EmitBlock(std::ostream& Out, std::size_t Leader)
+{
+    // Returns the number of instructions in the block
+    std::size_t end = Leader;
+
+    // Faulting instructions refund the rest of the block, so its size has
+    // to be known before emitting them
+    std::ostringstream discard;
+    BlockSize = EmitBody(discard, Leader, end);
+
+    std::ostringstream body;
+    const std::size_t count = EmitBody(body, Leader, end);
+
+    Out << Label(Leader) << ": // " << Address(Leader) << " - " << Address(end) << '\n'
+        << "    if (budget < " << std::dec << count << " || Recompiled::stale(cpu, " << Address(Leader) << "))\n"
+        << "    {\n"
+        << "        pc = " << Address(Leader) << ";\n"
+        << "        goto leave;\n"
+        << "    }\n"
+        << "    budget -= " << std::dec << count << ";\n"
+        << body.str() << '\n';
+
+    BlockEnds.push_back(end);
+    return count;
+}
+
+std::size_t Recompiler::EmitBody(std::ostream& Out, std::size_t Leader, std::size_t& End)
+{
+    // Returns the number of instructions emitted, End is set to the address past the last one
+    std::size_t address = Leader;
+    Position = 0;
+
+    while (true)
+    {
+        if (address != Leader && Leaders[address])
+        {
+            // Fall through to the next block
+            EmitJump(Out, address, "    ");
+            break;
+        }
+
+        if (!Translatable(address))
+        {
+            EmitJump(Out, address, "    ");
+            break;
+        }
+
+        const Instruction instruction = Fetch(address);
+        const DecodedInstruction op = decode(instruction);
+
+        Out << "    // " << Address(address) << ": "
+            << std::uppercase << std::hex << std::setfill('0') << std::setw(4) << instruction.raw
+            << ' ' << Mnemonic(op.opcode) << '\n';
+
+        ++Position;
+        const bool ends_block = EmitInstruction(Out, address, op);
+        address += Instruction::width;
+
+        if (ends_block)
+            break;
+    }
+
+    End = address;
+    return Position;
+}
+
+Translation Recompiler::Run(const std::string& Symbol)
+{
+    Explore();
+
+    Translation translation;
+    std::vector<std::size_t> blocks;
+    std::ostringstream code;
+
+    for (std::size_t address = 0; address < Leaders.size(); ++address)
+    {
+        if (!Leaders[address] || !Translatable(address))
+            continue;
+
+        translation.instructions += EmitBlock(code, address);
+        blocks.push_back(address);
+    }
+
+    translation.blocks = blocks.size();
+
+    std::ostringstream out;
+
+    out << "// Generated by chip8_recompiler, do not edit\n"
+        << "\n"
+        << "#include \"cpu.hpp\"\n"
+        << "#include \"recompiled.hpp\"\n"
+        << "\n"
+        << "#include <array>\n"
+        << "#include <cstddef>\n"
+        << "#include <cstdint>\n"
+        << "\n"
+        << "namespace\n"
+        << "{\n"
+        << "\n"
+        << "constexpr std::array<std::uint8_t, " << std::dec << ROM.size() << "> rom = {";
+
+    for (std::size_t i = 0; i < ROM.size(); ++i)
+        out << (i % 16 == 0 ? "\n    " : " ") << Hex(ROM[i], 2) << ',';
+
+    out << "\n};\n"
+        << "\n"
+        << "constexpr std::array<Recompiled::Block, " << std::dec << blocks.size() << "> blocks = {{";
+
+    for (std::size_t i = 0; i < blocks.size(); ++i)
+        out << "\n    {" << Address(blocks[i]) << ", " << Address(BlockEnds[i]) << "},";
+
+    out << "\n}};\n"
+        << "\n"
+        << "std::size_t run(CPU& cpu, std::size_t budget)\n"
+        << "{\n"
+        << "    std::uint8_t* const registers = Recompiled::registers(cpu);\n";
+
+    for (std::size_t i = 0; i < 16; ++i)
+        out << "    std::uint8_t " << Register(i) << " = registers[" << Hex(i, 1) << "];\n";
+
+    out << "    std::uint16_t vi = Recompiled::vi(cpu);\n"
+        << "    std::uint16_t pc = Recompiled::pc(cpu);\n"
+        << "\n"
+        << "    const auto spill = [&] {\n";
+
+    for (std::size_t i = 0; i < 16; ++i)
+        out << "        registers[" << Hex(i, 1) << "] = " << Register(i) << ";\n";
+
+    out << "        Recompiled::vi(cpu) = vi;\n"
+        << "    };\n"
+        << "\n";
+
+    if (UsesReload)
+    {
+        out << "    const auto reload = [&] {\n";
+
+        for (std::size_t i = 0; i < 16; ++i)
+            out << "        " << Register(i) << " = registers[" << Hex(i, 1) << "];\n";
+
+        out << "        vi = Recompiled::vi(cpu);\n"
+            << "    };\n"
+            << "\n";
+    }
+
+    if (UsesDispatch)
+        out << "dispatch:\n";
+
+    out << "    switch (pc)\n"
+        << "    {\n";
+
+    for (const std::size_t address : blocks)
+        out << "    case " << Address(address) << ":\n"
+            << "        goto " << Label(address) << ";\n";
+
+    out << "    default:\n"
+        << "        goto leave;\n"
+        << "    }\n"
+        << "\n"
+        << code.str()
+        << "leave:\n"
+        << "    spill();\n"
+        << "    Recompiled::leave(cpu, pc);\n"
+        << "    return budget;\n"
+        << "}\n"
+        << "\n"
+        << "} // namespace\n"
+        << "\n"
+        << "extern const Recompiled " << Symbol << ";\n"
+        << "const Recompiled " << Symbol << "{{rom.data(), rom.size()}, "
+        << Name(Behaviour) << ", &run, {blocks.data(), blocks.size()}};\n";
+
+    translation.source = out.str();
+    return translation;
+}
+
+} // namespace
+
+Translation RecompileROM(byte_view ROM, const std::string& Symbol, Profile Behaviour)
+{
+    if (ROM.size() > 0x1000 - Origin)
+        throw std::length_error("ROM doesn't fit in memory");
+
+    Recompiler recompiler{ROM, Behaviour};
+    return recompiler.Run(Symbol);
+}
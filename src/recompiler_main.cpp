@@ -0,0 +1,69 @@
+#include "recompiler.hpp"
+#include "rom.hpp"
+
+#include "CLI11.hpp"
+
+#include <cstdlib>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+
+int main(int argc, char* argv[])
+{
+    CLI::App app{"Translates a CHIP-8 ROM into C++ to be compiled with the CPU"};
+
+    std::string rom_path;
+    app.add_option("rom", rom_path, "ROM to translate")->required()->check(CLI::ExistingFile);
+
+    std::string output_path;
+    app.add_option("-o,--output", output_path, "C++ source file to write")->required();
+
+    std::string symbol = "recompiled_rom";
+    app.add_option("-s,--symbol", symbol, "Name of the generated Recompiled object", true);
+
+    Profile profile = Profile::Legacy;
+    const std::map<std::string, Profile> profiles{
+        {"legacy", Profile::Legacy},
+        {"vip", Profile::CosmacVIP},
+        {"chip48", Profile::Chip48},
+        {"schip", Profile::SuperChip},
+        {"modern", Profile::Modern},
+    };
+    app.add_option("-q,--quirks", profile, "Quirk profile the ROM was written for")->transform(CLI::CheckedTransformer(profiles, CLI::ignore_case));
+
+    CLI11_PARSE(app, argc, argv);
+
+    try
+    {
+        const auto ROM = LoadFile(rom_path);
+
+        if (!CheckROM(ROM))
+        {
+            std::cout << "Invalid ROM\n";
+            return EXIT_FAILURE;
+        }
+
+        const Translation translation = RecompileROM(ROM, symbol, profile);
+
+        std::ofstream output(output_path, std::ios::out | std::ios::trunc);
+        output << translation.source;
+
+        if (!output)
+        {
+            std::cout << "Unable to write " << output_path << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        std::cout << rom_path << ": translated " << translation.blocks << " blocks ("
+                  << translation.instructions << " instructions)" << std::endl;
+    }
+    catch (const std::exception& e)
+    {
+        std::cout << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
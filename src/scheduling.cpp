@@ -0,0 +1,78 @@
+#include "scheduling.hpp"
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include <cerrno>
+#include <cstring>
+#include <string>
+
+#ifdef __linux__
+
+static std::string PinTo(unsigned Core)
+{
+    const std::string name = "core " + std::to_string(Core);
+
+    if (Core >= CPU_SETSIZE)
+        return "not pinned, no " + name;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(Core, &set);
+
+    if (const int error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set); error != 0)
+        return "not pinned to " + name + " (" + std::strerror(error) + ")";
+
+    return "pinned to " + name;
+}
+
+static std::string RaisePriority()
+{
+    // Above every SCHED_OTHER thread, but below anything else real-time
+    sched_param parameters{};
+    parameters.sched_priority = sched_get_priority_min(SCHED_FIFO);
+
+    const int error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &parameters);
+
+    if (error == 0)
+        return "SCHED_FIFO";
+
+    // The nice value is per thread on Linux
+    constexpr int nice = -10;
+    const auto thread = static_cast<id_t>(syscall(SYS_gettid));
+
+    if (setpriority(PRIO_PROCESS, thread, nice) == 0)
+        return "no SCHED_FIFO (" + std::string(std::strerror(error)) + "), nice " + std::to_string(nice);
+
+    return "no SCHED_FIFO (" + std::string(std::strerror(error)) + "), nor a higher nice priority (" +
+           std::strerror(errno) + ")";
+}
+
+#endif
+
+std::string ApplyPolicy(const ThreadPolicy& Policy)
+{
+    std::string applied;
+
+    const auto append = [&applied](const std::string& what) {
+        applied += (applied.empty() ? "" : ", ") + what;
+    };
+
+#ifdef __linux__
+    if (Policy.core)
+        append(PinTo(*Policy.core));
+
+    if (Policy.realtime)
+        append(RaisePriority());
+#else
+    if (Policy.core || Policy.realtime)
+        append("thread policies are only supported on Linux");
+#endif
+
+    return applied.empty() ? "default scheduling" : applied;
+}
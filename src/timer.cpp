@@ -1,17 +1,27 @@
 #include "timer.hpp"
 
-Timer::Timer() : epoch(clock_t::now()) {}
-
-void Timer::set(std::uint8_t x) noexcept
+template <typename Clock>
+void BasicTimer<Clock>::set(std::uint8_t x, time_point now) noexcept
 {
     value = x;
-    epoch = clock_t::now();
+    epoch = now;
 }
 
-std::uint8_t Timer::read() const noexcept
+template <typename Clock>
+std::uint8_t BasicTimer<Clock>::read(time_point now) const noexcept
 {
-    auto delta = clock_t::now() - epoch;
-    auto ticks = delta / std::chrono::microseconds(16667);
+    const auto ticks = (now - epoch) / Tick{1};
 
     return ticks < value ? value - ticks : 0;
 }
+
+template <typename Clock>
+typename Clock::duration BasicTimer<Clock>::remaining(time_point now) const noexcept
+{
+    const auto left = epoch + Tick{value} - now;
+
+    return left > left.zero() ? std::chrono::duration_cast<typename Clock::duration>(left) : Clock::duration::zero();
+}
+
+template class BasicTimer<WallClock>;
+template class BasicTimer<CycleClock>;
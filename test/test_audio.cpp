@@ -0,0 +1,193 @@
+#include "audio.hpp"
+#include "catch.hpp"
+#include "ring.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <thread>
+#include <vector>
+
+namespace
+{
+
+std::uint32_t read_le(const std::vector<std::uint8_t>& bytes, std::size_t offset, std::size_t size)
+{
+    std::uint32_t value = 0;
+
+    for (std::size_t i = 0; i < size; ++i)
+        value |= std::uint32_t{bytes[offset + i]} << (8 * i);
+
+    return value;
+}
+
+} // namespace
+
+TEST_CASE("SPSC ring keeps elements in order", "[audio]")
+{
+    SpscRing<int, 8> ring;
+    std::array<int, 8> data;
+
+    // Uneven chunks wrap around the end of the storage
+    const std::size_t chunk = GENERATE(1, 3, 5, 8);
+
+    int pushed = 0;
+    int popped = 0;
+
+    for (int round = 0; round < 20; ++round)
+    {
+        for (std::size_t i = 0; i < chunk; ++i)
+            data[i] = pushed + static_cast<int>(i);
+
+        REQUIRE(ring.push(data.data(), chunk) == chunk);
+        pushed += static_cast<int>(chunk);
+        REQUIRE(ring.size() == chunk);
+
+        REQUIRE(ring.pop(data.data(), data.size()) == chunk);
+        for (std::size_t i = 0; i < chunk; ++i)
+            REQUIRE(data[i] == popped++);
+
+        REQUIRE(ring.size() == 0);
+    }
+}
+
+TEST_CASE("SPSC ring never blocks", "[audio]")
+{
+    SpscRing<int, 4> ring;
+    std::array<int, 6> data{1, 2, 3, 4, 5, 6};
+
+    // Only as much as fits, or as much as there is
+    REQUIRE(ring.push(data.data(), data.size()) == 4);
+    REQUIRE(ring.push(data.data(), data.size()) == 0);
+
+    REQUIRE(ring.pop(data.data(), data.size()) == 4);
+    REQUIRE(ring.pop(data.data(), data.size()) == 0);
+
+    REQUIRE(data == std::array<int, 6>{1, 2, 3, 4, 5, 6});
+}
+
+TEST_CASE("SPSC ring between two threads", "[audio]")
+{
+    constexpr int count = 1000000;
+
+    SpscRing<int, 64> ring;
+
+    std::thread producer{[&ring] {
+        std::array<int, 7> data;
+
+        for (int next = 0; next < count;)
+        {
+            const int size = std::min<int>(data.size(), count - next);
+            for (int i = 0; i < size; ++i)
+                data[i] = next + i;
+
+            next += static_cast<int>(ring.push(data.data(), size));
+        }
+    }};
+
+    std::array<int, 13> data;
+    bool ordered = true;
+
+    for (int expected = 0; expected < count;)
+    {
+        const std::size_t size = ring.pop(data.data(), data.size());
+
+        for (std::size_t i = 0; i < size; ++i)
+            ordered &= data[i] == expected++;
+    }
+
+    producer.join();
+
+    REQUIRE(ordered);
+    REQUIRE(ring.size() == 0);
+}
+
+TEST_CASE("Speaker generates a square wave while the tone is on", "[audio]")
+{
+    Speaker speaker;
+
+    // 10 ms, the first 5 of them with the tone on
+    speaker.advance(0.01, 0.005);
+
+    std::vector<std::int16_t> samples(Speaker::SampleRate);
+    REQUIRE(speaker.read(samples.data(), samples.size()) == 441);
+
+    constexpr std::size_t period = Speaker::SampleRate / Speaker::Pitch;
+
+    for (std::size_t i = 0; i < 220; ++i)
+        REQUIRE(samples[i] == (i % period < period / 2 ? Speaker::Amplitude : -Speaker::Amplitude));
+
+    for (std::size_t i = 220; i < 441; ++i)
+        REQUIRE(samples[i] == 0);
+
+    REQUIRE(speaker.underruns() == 0);
+    REQUIRE(speaker.dropped() == 0);
+}
+
+TEST_CASE("Speaker carries fractions of a sample over", "[audio]")
+{
+    Speaker speaker;
+
+    // 344.53125 samples at a time
+    for (int i = 0; i < 128; ++i)
+        speaker.advance(1.0 / 128, 0);
+
+    REQUIRE(speaker.buffered() + speaker.dropped() == Speaker::SampleRate);
+}
+
+TEST_CASE("Speaker counts underruns and dropped samples", "[audio]")
+{
+    Speaker speaker;
+    std::array<std::int16_t, 512> samples;
+
+    // Nothing generated yet, the sink gets silence
+    samples.fill(1);
+    speaker.fill(samples.data(), samples.size());
+
+    REQUIRE(speaker.underruns() == 1);
+    REQUIRE(std::all_of(samples.cbegin(), samples.cend(), [](auto sample) { return sample == 0; }));
+
+    speaker.advance(1.0, 1.0);
+    speaker.fill(samples.data(), samples.size());
+
+    REQUIRE(speaker.underruns() == 1);
+    REQUIRE(speaker.dropped() == Speaker::SampleRate - 8192);
+}
+
+TEST_CASE("WAV sink", "[audio]")
+{
+    const auto path = std::filesystem::temp_directory_path() / "chip8_test_audio.wav";
+
+    Speaker speaker;
+    speaker.advance(0.1, 0.05);
+
+    {
+        WavSink sink{path.string()};
+        sink.drain(speaker);
+    }
+
+    std::ifstream file(path, std::ios::in | std::ios::binary);
+    const std::vector<std::uint8_t> bytes{std::istreambuf_iterator<char>(file), {}};
+    file.close();
+    std::filesystem::remove(path);
+
+    constexpr std::size_t samples = Speaker::SampleRate / 10;
+
+    REQUIRE(bytes.size() == 44 + 2 * samples);
+    REQUIRE(std::equal(bytes.cbegin(), bytes.cbegin() + 4, "RIFF"));
+    REQUIRE(read_le(bytes, 4, 4) == 36 + 2 * samples);
+    REQUIRE(std::equal(bytes.cbegin() + 8, bytes.cbegin() + 16, "WAVEfmt "));
+    REQUIRE(read_le(bytes, 22, 2) == 1);
+    REQUIRE(read_le(bytes, 24, 4) == Speaker::SampleRate);
+    REQUIRE(read_le(bytes, 34, 2) == 16);
+    REQUIRE(std::equal(bytes.cbegin() + 36, bytes.cbegin() + 40, "data"));
+    REQUIRE(read_le(bytes, 40, 4) == 2 * samples);
+
+    // The first sample of the tone, and one after it ended
+    REQUIRE(static_cast<std::int16_t>(read_le(bytes, 44, 2)) == Speaker::Amplitude);
+    REQUIRE(read_le(bytes, 44 + 2 * (samples - 1), 2) == 0);
+}
@@ -1,12 +1,22 @@
+#include "audio.hpp"
 #include "catch.hpp"
+#include "control.hpp"
 #include "cpu.hpp"
+#include "graphics.hpp"
+#include "input.hpp"
+#include "timing.hpp"
 #include "utility.hpp"
 
 #include <algorithm>
 #include <array>
+#include <atomic>
+#include <chrono>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
+#include <optional>
 #include <stdexcept>
+#include <thread>
 #include <vector>
 
 namespace
@@ -26,6 +36,17 @@ std::vector<std::uint8_t> make_rom(const int* begin, std::size_t size)
     return rom;
 }
 
+const std::vector<CPU::Engine> engines{
+    CPU::Engine::Switch,
+    CPU::Engine::Predecoded,
+#ifdef THREADED_ENGINE
+    CPU::Engine::Threaded,
+#endif
+#ifdef JIT_ENGINE
+    CPU::Engine::Jit,
+#endif
+};
+
 template <typename T>
 auto range_i(T start, T end)
 {
@@ -33,6 +54,23 @@ auto range_i(T start, T end)
     return Catch::Generators::range(start, end + 1);
 }
 
+template <typename Predicate>
+bool eventually(Predicate predicate)
+{
+    // Polls another thread's progress, for long enough that only a hang fails it
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+
+    while (!predicate())
+    {
+        if (std::chrono::steady_clock::now() > deadline)
+            return false;
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    return true;
+}
+
 } // namespace
 
 TEST_CASE("Illegal opcodes", "[cpu]")
@@ -454,7 +492,7 @@ TEST_CASE("shr (8xy6)", "[cpu]")
             0x8006 | vx << 8 | vy << 4 // shr (shifts vy and stores the result in vx)
         };
 
-        CPU cpu{make_rom(instructions.cbegin(), instructions.size()), false};
+        CPU cpu{make_rom(instructions.cbegin(), instructions.size()), Profile::Legacy};
 
         REQUIRE_NOTHROW(cpu.step());
         REQUIRE(cpu.read_registers()[vy] == kk);
@@ -474,7 +512,7 @@ TEST_CASE("shr (8xy6)", "[cpu]")
             0x8006 | vx << 8       // shr (shifts vx in place)
         };
 
-        CPU cpu{make_rom(instructions.cbegin(), instructions.size()), true};
+        CPU cpu{make_rom(instructions.cbegin(), instructions.size()), Profile::Modern};
 
         REQUIRE_NOTHROW(cpu.step());
         REQUIRE(cpu.read_registers()[vx] == kk);
@@ -502,7 +540,7 @@ TEST_CASE("shl (8xyE)", "[cpu]")
             0x800E | vx << 8 | vy << 4 // shl (shifts vy and stores the result in vx)
         };
 
-        CPU cpu{make_rom(instructions.cbegin(), instructions.size()), false};
+        CPU cpu{make_rom(instructions.cbegin(), instructions.size()), Profile::Legacy};
 
         REQUIRE_NOTHROW(cpu.step());
         REQUIRE(cpu.read_registers()[vy] == kk);
@@ -522,7 +560,7 @@ TEST_CASE("shl (8xyE)", "[cpu]")
             0x800E | vx << 8 | vy << 4 // shl (shifts vx in place)
         };
 
-        CPU cpu{make_rom(instructions.cbegin(), instructions.size()), true};
+        CPU cpu{make_rom(instructions.cbegin(), instructions.size()), Profile::Modern};
 
         REQUIRE_NOTHROW(cpu.step());
         REQUIRE(cpu.read_registers()[vx] == kk);
@@ -781,3 +819,1048 @@ TEST_CASE("rnd (Cxkk)", "[cpu]")
         REQUIRE_FALSE(std::equal(registers1.cbegin(), registers1.cend(), registers2.cbegin()));
     }
 }
+
+TEST_CASE("Seeding rnd (Cxkk)", "[cpu]")
+{
+    std::array<int, 16> instructions;
+    for (int i = 0; i < 16; ++i)
+        instructions[i] = 0xC0FF | (i << 8); // rnd (store a random byte to register i)
+
+    const std::vector<std::uint8_t> rom = make_rom(instructions.cbegin(), instructions.size());
+    const auto seed = GENERATE(take(10, random(0, 1000000)));
+
+    const auto run = [&](std::size_t stream) {
+        CPU cpu{rom};
+        cpu.seed(seed, stream);
+        cpu.step(instructions.size());
+
+        const auto& registers = cpu.read_registers();
+        return std::vector<std::uint8_t>(registers.cbegin(), registers.cend());
+    };
+
+    REQUIRE(run(0) == run(0));
+    REQUIRE(run(3) == run(3));
+    REQUIRE(run(0) != run(1));
+    REQUIRE(run(1) != run(2));
+}
+
+TEST_CASE("Self-modifying code", "[cpu]")
+{
+    const auto engine = GENERATE(from_range(engines));
+
+    SECTION("Self-modifying code is executed after str_vx")
+    {
+        constexpr std::array<int, 8> instructions{
+            0x6A01, // ld_kk (load 0x01 to VA)
+            0x606A, // ld_kk (load 0x6A to V0)
+            0x6142, // ld_kk (load 0x42 to V1)
+            0xA20C, // ld_addr (load 0x20C to VI)
+            0x220C, // call (execute 0x20C once, caching it)
+            0xF155, // str_vx (overwrite 0x20C with 0x6A42)
+            0x6A07, // ld_kk (load 0x07 to VA, later load 0x42 to VA)
+            0x00EE  // ret
+        };
+
+        CPU cpu{make_rom(instructions.cbegin(), instructions.size())};
+        cpu.use_engine(engine);
+
+        for (int i = 0; i < 6; ++i)
+            REQUIRE_NOTHROW(cpu.step());
+
+        REQUIRE(cpu.read_registers()[0xA] == 0x07);
+
+        for (int i = 0; i < 3; ++i)
+            REQUIRE_NOTHROW(cpu.step());
+
+        REQUIRE(cpu.read_pc() == 0x20E);
+        REQUIRE(cpu.read_registers()[0xA] == 0x42);
+    }
+
+    SECTION("Self-modifying code is executed after str_bcd")
+    {
+        constexpr std::array<int, 6> instructions{
+            0x60FF, // ld_kk (load 255 to V0)
+            0xA20B, // ld_addr (load 0x20B to VI)
+            0x120A, // jp (execute 0x20A once, caching it)
+            0xF033, // str_bcd (write 0x02, 0x05, 0x05 to 0x20B)
+            0x120A, // jp (jump to 0x20A, which is now 0x1202)
+            0x1206  // jp (jump to 0x206, later jump to 0x202)
+        };
+
+        CPU cpu{make_rom(instructions.cbegin(), instructions.size())};
+        cpu.use_engine(engine);
+
+        for (int i = 0; i < 4; ++i)
+            REQUIRE_NOTHROW(cpu.step());
+
+        REQUIRE(cpu.read_pc() == 0x206);
+
+        REQUIRE_NOTHROW(cpu.step());
+        REQUIRE(cpu.read_memory()[0x20B] == 0x02);
+
+        REQUIRE_NOTHROW(cpu.step());
+        REQUIRE(cpu.read_pc() == 0x20A);
+
+        REQUIRE_NOTHROW(cpu.step());
+        REQUIRE(cpu.read_pc() == 0x202);
+    }
+
+    SECTION("Overwriting the next instruction")
+    {
+        constexpr std::array<int, 6> instructions{
+            0x606A, // ld_kk (load 0x6A to V0)
+            0x6142, // ld_kk (load 0x42 to V1)
+            0xA208, // ld_addr (load 0x208 to VI)
+            0xF155, // str_vx (overwrite 0x208 with 0x6A42)
+            0x6A07, // ld_kk (load 0x07 to VA, replaced by 0x6A42)
+            0x120A  // jp (jump to self)
+        };
+
+        CPU cpu{make_rom(instructions.cbegin(), instructions.size())};
+        cpu.use_engine(engine);
+
+        REQUIRE(cpu.step(100) == 5);
+        REQUIRE(cpu.read_pc() == 0x20A);
+        REQUIRE(cpu.read_registers()[0xA] == 0x42);
+    }
+
+    SECTION("Unaligned instructions")
+    {
+        constexpr std::array<int, 3> instructions{
+            0x1203, // jp (jump to 0x203)
+            0x0060, // 0x203: ld_kk (load 0x12 to V0)
+            0x1200  // 0x205: jp (jump to 0x200)
+        };
+
+        CPU cpu{make_rom(instructions.cbegin(), instructions.size())};
+        cpu.use_engine(engine);
+
+        REQUIRE_NOTHROW(cpu.step());
+        REQUIRE(cpu.read_pc() == 0x203);
+
+        REQUIRE_NOTHROW(cpu.step());
+        REQUIRE(cpu.read_registers()[0] == 0x12);
+        REQUIRE(cpu.read_pc() == 0x205);
+    }
+}
+
+TEST_CASE("Snapshots", "[cpu]")
+{
+    const auto engine = GENERATE(from_range(engines));
+
+    constexpr std::array<int, 9> instructions{
+        0x6063, // ld_kk (load 0x63 to V0)
+        0x7101, // add_kk (increment V1)
+        0xC2FF, // rnd (load a random byte to V2)
+        0xA20E, // ld_addr (load 0x20E to VI)
+        0xF155, // str_vx (overwrite 0x20E with 0x63, V1)
+        0x6400, // ld_kk (load 0x00 to V4)
+        0x6400, // ld_kk (load 0x00 to V4)
+        0x0000, // ld_kk (load V1 to V3, once overwritten)
+        0x1202  // jp (jump to 0x202)
+    };
+
+    const auto rom = make_rom(instructions.cbegin(), instructions.size());
+
+    const auto require_equal = [](const MachineState& a, const MachineState& b) {
+        REQUIRE(a.V == b.V);
+        REQUIRE(a.PC == b.PC);
+        REQUIRE(a.VI == b.VI);
+        REQUIRE(a.SP == b.SP);
+        REQUIRE(a.Memory == b.Memory);
+    };
+
+    CPU cpu{rom};
+    cpu.use_engine(engine);
+    cpu.seed(1234);
+
+    // Stop right after 0x20E has been overwritten
+    REQUIRE_NOTHROW(cpu.step(29));
+    REQUIRE(cpu.read_pc() == 0x20A);
+
+    // Trivially copyable, so memcpy is a valid way of taking a snapshot
+    MachineState snapshot;
+    std::memcpy(&snapshot, &cpu.read_state(), sizeof(MachineState));
+
+    REQUIRE_NOTHROW(cpu.step(44));
+    const MachineState expected = cpu.read_state();
+
+    SECTION("Restoring a snapshot")
+    {
+        // The code at 0x20E has changed since, and may be cached
+        cpu.load_state(snapshot);
+        require_equal(cpu.read_state(), snapshot);
+
+        REQUIRE_NOTHROW(cpu.step(3));
+        REQUIRE(cpu.read_registers()[0x3] == snapshot.V[0x1]);
+
+        REQUIRE_NOTHROW(cpu.step(41));
+        require_equal(cpu.read_state(), expected);
+    }
+
+    SECTION("Cloning a CPU")
+    {
+        CPU clone{rom};
+        clone.use_engine(engine);
+        clone.load_state(snapshot);
+
+        REQUIRE_NOTHROW(clone.step(44));
+        require_equal(clone.read_state(), expected);
+    }
+}
+
+TEST_CASE("Executing multiple instructions", "[cpu]")
+{
+    const auto engine = GENERATE(from_range(engines));
+
+    constexpr std::array<int, 5> instructions{
+        0x6001, // ld_kk (load 0x01 to V0)
+        0x3001, // se_x_kk (skip next instruction)
+        0x0000, // illegal (should be skipped)
+        0x7001, // add_kk (add 0x01 to V0)
+        0x1208  // jp (jump to self)
+    };
+
+    CPU cpu{make_rom(instructions.cbegin(), instructions.size())};
+    cpu.use_engine(engine);
+
+    SECTION("Stops after count instructions")
+    {
+        REQUIRE(cpu.step(2) == 2);
+        REQUIRE(cpu.read_pc() == 0x206);
+        REQUIRE(cpu.read_registers()[0] == 0x01);
+
+        REQUIRE(cpu.step(1) == 1);
+        REQUIRE(cpu.read_pc() == 0x208);
+        REQUIRE(cpu.read_registers()[0] == 0x02);
+    }
+
+    SECTION("Stops when stuck in a loop")
+    {
+        REQUIRE(cpu.step(100) == 3);
+        REQUIRE(cpu.read_pc() == 0x208);
+
+        REQUIRE(cpu.step(100) == 0);
+        REQUIRE(cpu.read_pc() == 0x208);
+    }
+
+    SECTION("Illegal opcodes")
+    {
+        constexpr std::array<int, 2> illegal{
+            0x6001, // ld_kk (load 0x01 to V0)
+            0x0000  // illegal
+        };
+
+        CPU cpu2{make_rom(illegal.cbegin(), illegal.size())};
+        cpu2.use_engine(engine);
+
+        REQUIRE_THROWS_AS(cpu2.step(10), std::logic_error);
+        REQUIRE(cpu2.read_registers()[0] == 0x01);
+    }
+}
+
+TEST_CASE("Running until the CPU stops", "[cpu]")
+{
+    const auto engine = GENERATE(from_range(engines));
+
+    constexpr std::array<int, 6> instructions{
+        0x6001, // ld_kk (load 0x01 to V0)
+        0x7001, // add_kk (add 0x01 to V0)
+        0x00E0, // cls (clear the display)
+        0x7001, // add_kk (add 0x01 to V0)
+        0x120A, // jp (jump to the illegal instruction)
+        0x0000  // illegal
+    };
+
+    CPU cpu{make_rom(instructions.cbegin(), instructions.size())};
+    cpu.use_engine(engine);
+
+    SECTION("Budget exhausted")
+    {
+        const CPU::RunResult result = cpu.run(2);
+
+        REQUIRE(result.reason == CPU::StopReason::BudgetExhausted);
+        REQUIRE(result.executed == 2);
+        REQUIRE(result.address == 0x204);
+        REQUIRE(cpu.read_registers()[0] == 0x02);
+    }
+
+    SECTION("Fault")
+    {
+        const CPU::RunResult result = cpu.run(100);
+
+        REQUIRE(result.reason == CPU::StopReason::Fault);
+        REQUIRE(result.executed == 5);
+        REQUIRE(result.address == 0x20A);
+        REQUIRE(result.fault->kind == CPU::FaultKind::IllegalInstruction);
+        REQUIRE(cpu.read_registers()[0] == 0x03);
+    }
+
+    SECTION("Halted")
+    {
+        constexpr std::array<int, 2> halt{
+            0x6001, // ld_kk (load 0x01 to V0)
+            0x1202  // jp (jump to self)
+        };
+
+        CPU cpu2{make_rom(halt.cbegin(), halt.size())};
+        cpu2.use_engine(engine);
+
+        const CPU::RunResult result = cpu2.run(100);
+
+        REQUIRE(result.reason == CPU::StopReason::Halted);
+        REQUIRE(result.executed == 1);
+        REQUIRE(result.address == 0x202);
+        REQUIRE(cpu2.run(100).executed == 0);
+    }
+
+    SECTION("Predicate")
+    {
+        const auto predicate = [](const CPU& cpu) { return cpu.read_registers()[0] == 0x02; };
+        const CPU::RunResult result = cpu.run_until(predicate, 100);
+
+        REQUIRE(result.reason == CPU::StopReason::Reached);
+        REQUIRE(result.executed == 2);
+        REQUIRE(result.address == 0x204);
+    }
+
+    SECTION("Frame boundary")
+    {
+        const CPU::RunResult result = cpu.run_until_frame(100);
+
+        REQUIRE(result.reason == CPU::StopReason::Reached);
+        REQUIRE(result.executed == 3);
+        REQUIRE(result.address == 0x206);
+        REQUIRE(cpu.read_statistics().draws == 1);
+
+        REQUIRE(cpu.run_until_frame(100).reason == CPU::StopReason::Fault);
+    }
+}
+
+TEST_CASE("Faults", "[cpu]")
+{
+    const auto engine = GENERATE(from_range(engines));
+
+    const auto [instruction, kind] = GENERATE(table<int, CPU::FaultKind>({
+        {0x0000, CPU::FaultKind::IllegalInstruction},
+        {0x2206, CPU::FaultKind::StackOverflow},   // call (call itself until the stack is full)
+        {0x00EE, CPU::FaultKind::StackUnderflow},  // ret (empty stack)
+        {0x1FFF, CPU::FaultKind::InvalidAddress},  // jp (jump to the last byte)
+        {0xF265, CPU::FaultKind::InvalidMemoryAccess}, // ld_vx (read past the end of memory)
+        {0xF233, CPU::FaultKind::InvalidMemoryAccess}, // str_bcd (write past the end of memory)
+        {0xD015, CPU::FaultKind::InvalidMemoryAccess}, // drw (read past the end of memory)
+    }));
+
+    const std::array<int, 4> instructions{
+        0x6001,     // ld_kk (load 0x01 to V0)
+        0xAFFE,     // ld_addr (load 0xFFE to VI)
+        0x7101,     // add_kk (add 0x01 to V1)
+        instruction // faults
+    };
+
+    CPU cpu{make_rom(instructions.cbegin(), instructions.size())};
+    cpu.use_engine(engine);
+
+    const std::size_t calls = kind == CPU::FaultKind::StackOverflow ? 12 : 0;
+
+    SECTION("run() returns the fault")
+    {
+        const CPU::RunResult result = cpu.run(100);
+
+        REQUIRE(result.reason == CPU::StopReason::Fault);
+        REQUIRE(result.executed == 3 + calls);
+        REQUIRE(result.address == 0x206);
+        REQUIRE(result.fault->kind == kind);
+        REQUIRE(result.fault->pc == 0x206);
+        REQUIRE(result.fault->opcode == instruction);
+        REQUIRE(cpu.read_pc() == 0x206);
+        REQUIRE(cpu.read_stack().size() == calls);
+        REQUIRE(cpu.read_statistics().instructions == 3 + calls);
+
+        // Running again faults on the same instruction
+        REQUIRE(cpu.run(100).fault->pc == 0x206);
+    }
+
+    SECTION("step() throws")
+    {
+        if (kind == CPU::FaultKind::IllegalInstruction)
+            REQUIRE_THROWS_AS(cpu.step(100), std::logic_error);
+        else
+            REQUIRE_THROWS_AS(cpu.step(100), std::out_of_range);
+
+        REQUIRE(cpu.read_pc() == 0x206);
+    }
+}
+
+TEST_CASE("Fault messages", "[cpu]")
+{
+    const CPU::Fault fault{CPU::FaultKind::IllegalInstruction, 0x206, 0x800F};
+    REQUIRE(fault.message() == "Encountered illegal opcode 0x800f at address 0x206");
+
+    constexpr std::array<int, 1> instructions{
+        0x00EE // ret (empty stack)
+    };
+
+    CPU cpu{make_rom(instructions.cbegin(), instructions.size())};
+    REQUIRE_THROWS_WITH(cpu.step(), "Stack underflow caused by opcode 0x00ee at address 0x200");
+}
+
+TEST_CASE("Quirk profiles", "[cpu]")
+{
+    const auto engine = GENERATE(from_range(engines));
+
+    const auto [profile, vf, vi, v3, pc, collision] = GENERATE(table<Profile, int, int, int, int, bool>({
+        {Profile::CosmacVIP, 0x00, 0x302, 0x78, 0x224, false},
+        {Profile::Chip48, 0x07, 0x301, 0x01, 0x310, false},
+        {Profile::SuperChip, 0x07, 0x300, 0x01, 0x310, false},
+        {Profile::Modern, 0x07, 0x300, 0x01, 0x224, true},
+        {Profile::Legacy, 0x07, 0x302, 0x78, 0x224, true},
+        {Profile::LegacyModern, 0x07, 0x302, 0x01, 0x224, true},
+    }));
+
+    SECTION("Instructions")
+    {
+        const std::array<int, 10> instructions{
+            0x6303, // ld_kk (load 0x03 to V3)
+            0x6105, // ld_kk (load 0x05 to V1)
+            0x62F0, // ld_kk (load 0xF0 to V2)
+            0x6F07, // ld_kk (load 0x07 to VF)
+            0x8121, // or_y (V1 |= V2, VF may be reset)
+            0xA300, // ld_addr (load 0x300 to VI)
+            0xF155, // str_vx (store V0-V1, VI may be incremented)
+            0x8326, // shr (shift V2 or V3 into V3)
+            0x6004, // ld_kk (load 0x04 to V0)
+            0xB220  // jp_v0 (jump to 0x220 + V0 or 0x220 + V2)
+        };
+
+        CPU cpu{make_rom(instructions.cbegin(), instructions.size()), profile};
+        cpu.use_engine(engine);
+        REQUIRE(cpu.read_profile() == profile);
+
+        REQUIRE_NOTHROW(cpu.step(5));
+        REQUIRE(cpu.read_registers()[0x1] == 0xF5);
+        REQUIRE(cpu.read_registers()[0xf] == vf);
+
+        REQUIRE_NOTHROW(cpu.step(2));
+        REQUIRE(cpu.read_vi() == vi);
+
+        REQUIRE_NOTHROW(cpu.step());
+        REQUIRE(cpu.read_registers()[0x3] == v3);
+
+        REQUIRE_NOTHROW(cpu.step(2));
+        REQUIRE(cpu.read_pc() == pc);
+    }
+
+    SECTION("Sprites")
+    {
+        const std::array<int, 7> instructions{
+            0x603E, // ld_kk (load 62 to V0)
+            0x6100, // ld_kk (load 0 to V1)
+            0x6200, // ld_kk (load 0 to V2)
+            0xF229, // ld_digit (point VI to the sprite for 0)
+            0xD015, // drw (draw at (62, 0), the sprite is 4 pixels wide)
+            0x6000, // ld_kk (load 0 to V0)
+            0xD015  // drw (draw at (0, 0), collides if the first sprite wrapped around)
+        };
+
+        Frame frame;
+        CPU cpu{make_rom(instructions.cbegin(), instructions.size()), profile, &frame};
+        cpu.use_engine(engine);
+
+        REQUIRE_NOTHROW(cpu.step(instructions.size()));
+        REQUIRE(cpu.read_registers()[0xf] == collision);
+    }
+}
+
+TEST_CASE("Superinstructions", "[cpu]")
+{
+    const auto engine = GENERATE(from_range(engines));
+
+    constexpr std::array<int, 11> instructions{
+        0x6005, // ld_kk (load 0x05 to V0)
+        0x7001, // add_kk (add 0x01 to V0)
+        0x300A, // se_x_kk (exit the loop when V0 is 0x0A)
+        0x1202, // jp (jump back to add_kk)
+        0x610F, // ld_kk (load 0x0F to V1)
+        0xA050, // ld_addr (load 0x50 to VI)
+        0xD015, // drw (draw the sprite at 0x50)
+        0xF207, // ld_dt (load DT to V2)
+        0x3200, // se_x_kk (exit the loop when V2 is 0x00)
+        0x120E, // jp (jump back to ld_dt)
+        0x1214  // jp (jump to self)
+    };
+
+    // Executing them one at a time must give the same result
+    const std::size_t budget = GENERATE(1, 2, 3, 100);
+
+    CPU cpu{make_rom(instructions.cbegin(), instructions.size())};
+    cpu.use_engine(engine);
+
+    std::size_t executed = 0;
+    for (std::size_t n; (n = cpu.step(budget)) != 0;)
+        executed += n;
+
+    REQUIRE(executed == 20);
+    REQUIRE(cpu.read_pc() == 0x214);
+    REQUIRE(cpu.read_registers()[0] == 0x0A);
+    REQUIRE(cpu.read_registers()[1] == 0x0F);
+    REQUIRE(cpu.read_registers()[2] == 0x00);
+    REQUIRE(cpu.read_vi() == 0x50);
+
+    const CPU::Statistics& statistics = cpu.read_statistics();
+    REQUIRE(statistics.instructions == executed);
+
+    bool fuses = engine == CPU::Engine::Predecoded;
+#ifdef THREADED_ENGINE
+    fuses = fuses || engine == CPU::Engine::Threaded;
+#endif
+
+    if (fuses && budget == 100)
+    {
+        REQUIRE(statistics.fused_loop == 5);
+        REQUIRE(statistics.fused_drw == 1);
+        REQUIRE(statistics.fused_wait_dt == 1);
+        REQUIRE(statistics.fused == 19);
+    }
+    else if (!fuses || budget < 3)
+    {
+        REQUIRE(statistics.fused == 0);
+    }
+}
+
+TEST_CASE("Delay timer counts emulated time", "[cpu]")
+{
+    // run_tests is built with CycleClock, so this doesn't depend on the host
+    const auto engine = GENERATE(from_range(engines));
+
+    constexpr std::array<int, 6> instructions{
+        0x6005, // ld_kk (load 0x05 to V0)
+        0xF015, // set_dt (load V0 to DT)
+        0xF107, // ld_dt (load DT to V1)
+        0x3100, // se_x_kk (exit the loop when V1 is 0x00)
+        0x1204, // jp (jump back to ld_dt)
+        0x120A  // jp (jump to self)
+    };
+
+    // The loop reads DT right on the 5th tick at 600 Hz, and right before it at 720 Hz
+    const auto [frequency, expected] = GENERATE(table<std::size_t, std::size_t>({{600, 52}, {720, 64}, {60, 10}}));
+    const std::size_t budget = GENERATE(1, 2, 3, 7, 100);
+
+    CPU cpu{make_rom(instructions.cbegin(), instructions.size())};
+    cpu.use_engine(engine);
+    cpu.set_frequency(frequency);
+
+    std::size_t executed = 0;
+    for (std::size_t n; (n = cpu.step(budget)) != 0;)
+        executed += n;
+
+    REQUIRE(executed == expected);
+    REQUIRE(cpu.read_pc() == 0x20A);
+    REQUIRE(cpu.read_registers()[1] == 0x00);
+    REQUIRE(cpu.read_state().Cycles == expected);
+
+    REQUIRE_THROWS_AS(cpu.set_frequency(0), std::invalid_argument);
+}
+
+TEST_CASE("COSMAC VIP timing", "[cpu]")
+{
+    // Instructions cost the same whatever the engine
+    const auto engine = GENERATE(from_range(engines));
+    const std::size_t budget = GENERATE(1, 3, 100);
+
+    SECTION("Instructions are charged their cost, drw waits for the next frame")
+    {
+        constexpr std::array<int, 5> instructions{
+            0x6006, // ld_kk (load 0x06 to V0)
+            0x7001, // add_kk (add 0x01 to V0)
+            0xA050, // ld_addr (load 0x050 to I)
+            0xD015, // drw (draw 5 bytes at V0, V1)
+            0x1208  // jp (jump to self)
+        };
+
+        CPU cpu{make_rom(instructions.cbegin(), instructions.size())};
+        cpu.use_engine(engine);
+        cpu.use_timing(CPU::Timing::CosmacVIP);
+
+        REQUIRE(cpu.step(3) == 3);
+        REQUIRE(cpu.read_state().Cycles == VipTiming::StolenCycles + 3 * VipTiming::FetchCycles + 6 + 10 + 12);
+
+        while (cpu.step(budget) != 0)
+            ;
+
+        REQUIRE(cpu.read_state().Cycles ==
+                VipTiming::CyclesPerFrame + VipTiming::StolenCycles + VipTiming::FetchCycles + VipTiming::sprite(5, 7));
+    }
+
+    SECTION("The delay timer counts machine cycles")
+    {
+        constexpr std::array<int, 6> instructions{
+            0x6002, // ld_kk (load 0x02 to V0)
+            0xF015, // set_dt (load V0 to DT)
+            0xF107, // ld_dt (load DT to V1)
+            0x3100, // se_x_kk (exit the loop when V1 is 0x00)
+            0x1204, // jp (jump back to ld_dt)
+            0x120A  // jp (jump to self)
+        };
+
+        CPU cpu{make_rom(instructions.cbegin(), instructions.size())};
+        cpu.use_engine(engine);
+        cpu.use_timing(CPU::Timing::CosmacVIP);
+
+        // Ignored, the VIP runs at its own speed
+        cpu.set_frequency(1);
+
+        std::size_t executed = 0;
+        for (std::size_t n; (n = cpu.step(budget)) != 0;)
+            executed += n;
+
+        // DT is set during the first frame and reaches 0 at the start of the third
+        const std::uint64_t expired = 2 * VipTiming::CyclesPerFrame + VipTiming::StolenCycles;
+        const std::uint64_t iteration = 3 * VipTiming::FetchCycles + 10 + 10 + 12;
+
+        REQUIRE(cpu.read_registers()[1] == 0x00);
+        REQUIRE(cpu.read_state().Cycles > expired);
+        REQUIRE(cpu.read_state().Cycles <= expired + iteration + 4);
+        REQUIRE(executed > 2 * VipTiming::CyclesPerFrame / iteration);
+    }
+}
+
+TEST_CASE("Turbo mode", "[cpu]")
+{
+    constexpr std::array<int, 6> instructions{
+        0x60FF, // ld_kk (load 0xFF to V0)
+        0xF015, // set_dt (load V0 to DT)
+        0xF107, // ld_dt (load DT to V1)
+        0x3100, // se_x_kk (exit the loop when V1 is 0x00)
+        0x1204, // jp (jump back to ld_dt)
+        0x120A  // jp (jump to self)
+    };
+
+    const bool frame_locked = GENERATE(false, true);
+
+    CPU cpu{make_rom(instructions.cbegin(), instructions.size())};
+    cpu.set_turbo(true);
+
+    CommandQueue commands;
+
+    // Waits for 255 ticks of emulated time, i.e. more than 4 seconds at 600 Hz
+    const auto start = std::chrono::steady_clock::now();
+    if (frame_locked)
+        cpu.run_frames(commands, 600);
+    else
+        cpu.run_at(commands, 600);
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+
+    REQUIRE(cpu.read_pc() == 0x20A);
+    REQUIRE(cpu.read_state().Cycles >= 255 * 10);
+    REQUIRE(elapsed < std::chrono::seconds(1));
+
+    const CPU::Pacing pacing = cpu.read_pacing();
+    REQUIRE(pacing.speedup > 4);
+    REQUIRE(pacing.instructions == Approx(pacing.frequency));
+}
+
+TEST_CASE("Sound timer", "[cpu]")
+{
+    const auto engine = GENERATE(from_range(engines));
+
+    constexpr std::array<int, 9> instructions{
+        0x6006, // ld_kk (load 0x06 to V0)
+        0xF018, // set_st (load V0 to ST)
+        0x6008, // ld_kk (load 0x08 to V0)
+        0xF015, // set_dt (load V0 to DT)
+        0xF107, // ld_dt (load DT to V1)
+        0x3100, // se_x_kk (exit the loop when V1 is 0x00)
+        0x1208, // jp (jump back to ld_dt)
+        0xF118, // set_st (load V1 to ST)
+        0x1210  // jp (jump to self)
+    };
+
+    Speaker speaker;
+    CPU cpu{make_rom(instructions.cbegin(), instructions.size()), Profile::Legacy, nullptr, nullptr, &speaker};
+    cpu.use_engine(engine);
+
+    while (cpu.step(7) != 0)
+        ;
+
+    // Setting ST again generates everything up to that point: 6 ticks of tone, then 2 of silence
+    constexpr std::size_t tick = Speaker::SampleRate / 60;
+
+    std::vector<std::int16_t> samples(Speaker::SampleRate);
+    samples.resize(speaker.read(samples.data(), samples.size()));
+
+    REQUIRE(samples.size() == 8 * tick);
+    REQUIRE(std::none_of(samples.cbegin(), samples.cbegin() + 6 * tick, [](auto sample) { return sample == 0; }));
+    REQUIRE(std::all_of(samples.cbegin() + 6 * tick, samples.cend(), [](auto sample) { return sample == 0; }));
+}
+
+TEST_CASE("Frame-locked scheduling", "[cpu]")
+{
+    constexpr std::array<int, 5> instructions{
+        0x6000, // ld_kk (load 0x00 to V0)
+        0x7001, // add_kk (add 0x01 to V0)
+        0x3019, // se_x_kk (exit the loop when V0 is 0x19)
+        0x1202, // jp (jump back to add_kk)
+        0x1208  // jp (jump to self)
+    };
+
+    CPU cpu{make_rom(instructions.cbegin(), instructions.size())};
+
+    CommandQueue commands;
+
+    // 75 instructions at 10 per tick halt during the 8th tick
+    const auto start = std::chrono::steady_clock::now();
+    cpu.run_frames(commands, 600);
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+
+    REQUIRE(cpu.read_registers()[0] == 0x19);
+    REQUIRE(cpu.read_pc() == 0x208);
+    REQUIRE(cpu.read_statistics().instructions == 75);
+    REQUIRE(cpu.read_jitter().samples() == 7);
+    REQUIRE(cpu.read_deviation().samples() == 7);
+    REQUIRE(elapsed >= std::chrono::microseconds(7 * 16666));
+}
+
+TEST_CASE("Halting presents the last frame", "[cpu]")
+{
+    constexpr std::array<int, 4> instructions{
+        0x6000, // ld_kk (load 0x00 to V0)
+        0xF029, // ld_digit (point VI to the sprite for 0)
+        0xD005, // drw (draw it at (0, 0))
+        0x1206  // jp (jump to self)
+    };
+
+    const bool frame_locked = GENERATE(false, true);
+
+    Frame frame;
+    CPU cpu{make_rom(instructions.cbegin(), instructions.size()), Profile::Legacy, &frame};
+
+    CommandQueue commands;
+
+    // It halts within the first batch (or tick), before it is ever presented otherwise
+    if (frame_locked)
+        cpu.run_frames(commands, 600);
+    else
+        cpu.run_at(commands, 600);
+
+    REQUIRE(cpu.read_pc() == 0x206);
+
+    // The sprite for 0, where render() would draw it
+    const std::array<std::uint64_t, Frame::Lines> presented = frame.read_presented();
+
+    REQUIRE(presented[0] == 0xF000'0000'0000'0000);
+    REQUIRE(presented[1] == 0x9000'0000'0000'0000);
+    REQUIRE(presented[2] == 0x9000'0000'0000'0000);
+    REQUIRE(presented[3] == 0x9000'0000'0000'0000);
+    REQUIRE(presented[4] == 0xF000'0000'0000'0000);
+    REQUIRE(std::all_of(presented.cbegin() + 5, presented.cend(), [](auto line) { return line == 0; }));
+}
+
+TEST_CASE("Idle loops", "[cpu]")
+{
+    SECTION("Waiting for DT")
+    {
+        constexpr std::array<int, 6> instructions{
+            0x600F, // ld_kk (load 0x0F to V0)
+            0xF015, // set_dt (load V0 to DT)
+            0xF107, // ld_dt (load DT to V1)
+            0x3100, // se_x_kk (exit the loop when V1 is 0x00)
+            0x1204, // jp (jump back to ld_dt)
+            0x120A  // jp (jump to self)
+        };
+
+        const bool frame_locked = GENERATE(false, true);
+        const bool parking = GENERATE(false, true);
+
+        CPU cpu{make_rom(instructions.cbegin(), instructions.size())};
+        cpu.set_parking(parking);
+
+        CommandQueue commands;
+
+        // Parked or not, the loop takes 15 ticks and ends the same way
+        const auto start = std::chrono::steady_clock::now();
+        if (frame_locked)
+            cpu.run_frames(commands, 600);
+        else
+            cpu.run_at(commands, 600);
+        const auto elapsed = std::chrono::steady_clock::now() - start;
+
+        REQUIRE(cpu.read_pc() == 0x20A);
+        REQUIRE(cpu.read_registers()[1] == 0x00);
+        REQUIRE(cpu.read_state().Cycles >= 15 * 10);
+        REQUIRE(elapsed >= std::chrono::microseconds(14 * 16666));
+        REQUIRE(cpu.read_statistics().skipped == 0);
+    }
+
+    SECTION("Waiting for a key")
+    {
+        constexpr std::array<int, 2> instructions{
+            0xE09E, // skp (skip the next instruction if key V0 is pressed)
+            0x1200  // jp (jump back to skp)
+        };
+
+        const bool frame_locked = GENERATE(false, true);
+
+        Keyboard keyboard;
+        CPU cpu{make_rom(instructions.cbegin(), instructions.size()), Profile::Legacy, nullptr, &keyboard};
+
+        CommandQueue commands;
+        std::thread thread{[&cpu, &commands, frame_locked] {
+            if (frame_locked)
+                cpu.run_frames(commands, 600);
+            else
+                cpu.run_at(commands, 600);
+        }};
+
+        // Pressing another key wakes the thread up, and it parks again
+        sf::Event::KeyEvent event{};
+        event.code = sf::Keyboard::Numpad5;
+
+        // Parked for at least 100 ms, however late the thread got going
+        REQUIRE(eventually([&keyboard] { return keyboard.count_waiters() != 0; }));
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        keyboard.register_keypress(event, true);
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        REQUIRE(commands.send(CommandQueue::Command::Stop));
+        thread.join();
+
+        // Still in the loop, but most of it was skipped over
+        const CPU::Statistics statistics = cpu.read_statistics();
+
+        REQUIRE(cpu.read_pc() == 0x200 + 2 * (cpu.read_state().Cycles % 2));
+        REQUIRE(statistics.skipped > 0);
+        REQUIRE(statistics.skipped > statistics.instructions);
+    }
+
+    SECTION("Waiting in Fx0A")
+    {
+        constexpr std::array<int, 2> instructions{
+            0xF30A, // ld_key (wait for a key, load it to V3)
+            0x1202  // jp (jump to self)
+        };
+
+        const bool frame_locked = GENERATE(false, true);
+
+        Keyboard keyboard;
+        CPU cpu{make_rom(instructions.cbegin(), instructions.size()), Profile::Legacy, nullptr, &keyboard};
+
+        CommandQueue commands;
+        std::thread thread{[&cpu, &commands, frame_locked] {
+            if (frame_locked)
+                cpu.run_frames(commands, 600);
+            else
+                cpu.run_at(commands, 600);
+        }};
+
+        sf::Event::KeyEvent event{};
+        event.code = sf::Keyboard::Numpad5;
+
+        // Waits for at least 100 ms, however late the thread got going
+        REQUIRE(eventually([&keyboard] { return keyboard.count_waiters() != 0; }));
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        keyboard.register_keypress(event, true);
+        thread.join();
+
+        // It halts on its own, the time it waited was still counted
+        REQUIRE(cpu.read_registers()[3] == 0x5);
+        REQUIRE(cpu.read_pc() == 0x202);
+        REQUIRE(cpu.read_statistics().skipped > 0);
+        REQUIRE(cpu.read_state().Cycles >= 50);
+    }
+
+    SECTION("Halting")
+    {
+        constexpr std::array<int, 11> instructions{
+            0x6000, // ld_kk (load 0x00 to V0)
+            0x6101, // ld_kk (load 0x01 to V1)
+            0x6202, // ld_kk (load 0x02 to V2)
+            0x6303, // ld_kk (load 0x03 to V3)
+            0x6404, // ld_kk (load 0x04 to V4)
+            0x6505, // ld_kk (load 0x05 to V5)
+            0x6606, // ld_kk (load 0x06 to V6)
+            0x6707, // ld_kk (load 0x07 to V7)
+            0x6808, // ld_kk (load 0x08 to V8)
+            0x6909, // ld_kk (load 0x09 to V9)
+            0x1214  // jp (jump to self)
+        };
+
+        const bool frame_locked = GENERATE(false, true);
+
+        Keyboard keyboard;
+        CPU cpu{make_rom(instructions.cbegin(), instructions.size()), Profile::Legacy, nullptr, &keyboard};
+
+        CommandQueue commands;
+        std::atomic_bool returned = false;
+        std::thread thread{[&cpu, &commands, &returned, frame_locked] {
+            if (frame_locked)
+                cpu.run_frames(commands, 600);
+            else
+                cpu.run_at(commands, 600);
+
+            returned = true;
+        }};
+
+        // The first tick (10 instructions) ends right on the jump, which mustn't be parked in as if it waited for a key
+        const bool halted = eventually([&returned] { return returned.load(); });
+
+        REQUIRE(commands.send(CommandQueue::Command::Stop));
+        thread.join();
+
+        REQUIRE(halted);
+        REQUIRE(cpu.read_pc() == 0x214);
+        REQUIRE(cpu.read_statistics().skipped == 0);
+    }
+}
+
+TEST_CASE("Commands", "[cpu]")
+{
+    const bool frame_locked = GENERATE(false, true);
+
+    const auto run = [frame_locked](CPU& cpu, CommandQueue& commands) {
+        return frame_locked ? cpu.run_frames(commands, 600) : cpu.run_at(commands, 600);
+    };
+
+    // Waits for the CPU thread to receive everything sent
+    const auto wait = [](const CommandQueue& commands) {
+        while (commands.pending() != 0)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    };
+
+    SECTION("Faults are returned")
+    {
+        constexpr std::array<int, 2> instructions{
+            0x6001, // ld_kk (load 0x01 to V0)
+            0x00EE  // ret (empty stack)
+        };
+
+        CPU cpu{make_rom(instructions.cbegin(), instructions.size())};
+        CommandQueue commands;
+
+        const std::optional<CPU::Fault> fault = run(cpu, commands);
+
+        REQUIRE(fault.has_value());
+        REQUIRE(fault->kind == CPU::FaultKind::StackUnderflow);
+        REQUIRE(fault->pc == 0x202);
+    }
+
+    SECTION("Pausing and stepping")
+    {
+        constexpr std::array<int, 2> instructions{
+            0x7001, // add_kk (add 0x01 to V0)
+            0x1200  // jp (jump back to add_kk)
+        };
+
+        CPU cpu{make_rom(instructions.cbegin(), instructions.size())};
+        CommandQueue commands;
+
+        std::optional<CPU::Fault> fault;
+        std::thread thread{[&] { fault = run(cpu, commands); }};
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        REQUIRE(commands.send(CommandQueue::Command::Pause));
+        wait(commands);
+
+        // Nothing runs while paused, but steps
+        const std::size_t paused = cpu.read_statistics().instructions;
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        REQUIRE(cpu.read_statistics().instructions == paused);
+
+        for (int i = 0; i < 3; ++i)
+            REQUIRE(commands.send(CommandQueue::Command::Step));
+
+        REQUIRE(commands.send(CommandQueue::Command::Stop));
+        thread.join();
+
+        REQUIRE_FALSE(fault.has_value());
+        REQUIRE(cpu.read_statistics().instructions == paused + 3);
+    }
+
+    SECTION("Time stands still while paused")
+    {
+        constexpr std::array<int, 2> instructions{
+            0x7001, // add_kk (add 0x01 to V0)
+            0x1200  // jp (jump back to add_kk)
+        };
+
+        CPU cpu{make_rom(instructions.cbegin(), instructions.size())};
+        CommandQueue commands;
+
+        std::thread thread{[&] { run(cpu, commands); }};
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        REQUIRE(commands.send(CommandQueue::Command::Pause));
+        wait(commands);
+
+        // Nothing runs while paused, however long it lasts
+        const std::uint64_t paused = cpu.read_state().Cycles;
+        std::this_thread::sleep_for(std::chrono::milliseconds(300));
+        REQUIRE(cpu.read_state().Cycles == paused);
+
+        const auto resumed = std::chrono::steady_clock::now();
+        REQUIRE(commands.send(CommandQueue::Command::Resume));
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        REQUIRE(commands.send(CommandQueue::Command::Pause));
+        wait(commands);
+        const std::chrono::duration<double> running = std::chrono::steady_clock::now() - resumed;
+
+        REQUIRE(commands.send(CommandQueue::Command::Stop));
+        thread.join();
+
+        // The 180 cycles of the pause aren't made up for afterwards: it runs at most twice as fast as
+        // the target (see PiController), plus a tick or the borrowed time of a batch
+        REQUIRE(cpu.read_state().Cycles >= paused);
+        REQUIRE(cpu.read_state().Cycles <= paused + 2 * 600 * running.count() + 20);
+    }
+
+    SECTION("Changing the frequency")
+    {
+        constexpr std::array<int, 4> instructions{
+            0x603C, // ld_kk (load 0x3C to V0)
+            0xF015, // set_dt (load V0 to DT)
+            0xF107, // ld_dt (load DT to V1)
+            0x1204  // jp (jump back to ld_dt)
+        };
+
+        CPU cpu{make_rom(instructions.cbegin(), instructions.size())};
+        CommandQueue commands;
+
+        std::thread thread{[&] { run(cpu, commands); }};
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        REQUIRE(commands.send(CommandQueue::Command::Pause));
+        wait(commands);
+
+        const int before = cpu.read_registers()[1];
+        const std::uint64_t cycles = cpu.read_state().Cycles;
+
+        REQUIRE(commands.send(CommandQueue::Command::SetFrequency, 6000));
+        REQUIRE(commands.send(CommandQueue::Command::Resume));
+
+        // Runs until DT has gone down by a few ticks, looking at it while paused
+        int after = before;
+        REQUIRE(eventually([&] {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            REQUIRE(commands.send(CommandQueue::Command::Pause));
+            wait(commands);
+
+            after = cpu.read_registers()[1];
+            if (before - after >= 5)
+                return true;
+
+            REQUIRE(commands.send(CommandQueue::Command::Resume));
+            return false;
+        }));
+
+        REQUIRE(commands.send(CommandQueue::Command::Stop));
+        thread.join();
+
+        // DT goes on from where it was, and every tick now takes 100 cycles instead of 10. The cycles
+        // so far are scaled to the new frequency, and V1 may be an iteration behind DT
+        const std::uint64_t ran = cpu.read_state().Cycles - 10 * cycles;
+
+        REQUIRE(before - after >= 5);
+        REQUIRE(ran >= 100 * static_cast<std::uint64_t>(before - after - 2));
+        REQUIRE(ran <= 100 * static_cast<std::uint64_t>(before - after + 2));
+    }
+}
@@ -0,0 +1,96 @@
+#include "blit.hpp"
+#include "catch.hpp"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+namespace
+{
+
+template <bool Clip>
+void require_same_blit(const std::array<std::uint64_t, 16>& lines, const std::array<std::uint8_t, 16>& sprite)
+{
+    for (std::size_t x = 0; x < 64; ++x)
+    {
+        for (std::size_t rows = 0; rows <= sprite.size(); ++rows)
+        {
+            auto scalar = lines;
+            auto vector = lines;
+
+            const bool scalar_collision = BlitScalar<Clip>(scalar.data(), sprite.data(), rows, x);
+            const bool vector_collision = BlitVector<Clip>(vector.data(), sprite.data(), rows, x);
+
+            INFO("x = " << x << ", rows = " << rows);
+            REQUIRE(vector == scalar);
+            REQUIRE(vector_collision == scalar_collision);
+        }
+    }
+}
+
+} // namespace
+
+TEST_CASE("Vectorized blitter matches the scalar one", "[graphics]")
+{
+    const std::array<std::uint8_t, 16> sprite{0xF0, 0x90, 0x90, 0x90, 0xF0, 0x81, 0xFF, 0x00,
+                                              0x01, 0x80, 0x3C, 0x42, 0xA5, 0x5A, 0xC3, 0x18};
+
+    // What the sprite is drawn over
+    std::array<std::uint64_t, 16> lines = {};
+
+    SECTION("Blank lines")
+    {
+    }
+
+    SECTION("Lines with a single lit pixel")
+    {
+        for (std::size_t i = 0; i < lines.size(); ++i)
+            lines[i] = i == 13 ? 0x0000'0001'0000'0000 : 0;
+    }
+
+    SECTION("Busy lines")
+    {
+        std::uint64_t pattern = 0x9E37'79B9'7F4A'7C15;
+
+        for (auto& line : lines)
+        {
+            line = pattern;
+            pattern = rotr(pattern, 7) * 0xBF58'476D'1CE4'E5B9;
+        }
+    }
+
+    require_same_blit<true>(lines, sprite);
+    require_same_blit<false>(lines, sprite);
+}
+
+TEST_CASE("Blitting a sprite", "[graphics]")
+{
+    const std::array<std::uint8_t, 2> sprite{0xC3, 0x81};
+
+    SECTION("Clipped at the right edge")
+    {
+        std::array<std::uint64_t, 2> lines = {};
+
+        REQUIRE_FALSE(BlitVector<true>(lines.data(), sprite.data(), sprite.size(), 60));
+        REQUIRE(lines == std::array<std::uint64_t, 2>{0xC, 0x8});
+    }
+
+    SECTION("Wrapped around to the left edge")
+    {
+        std::array<std::uint64_t, 2> lines = {};
+
+        REQUIRE_FALSE(BlitVector<false>(lines.data(), sprite.data(), sprite.size(), 60));
+        REQUIRE(lines == std::array<std::uint64_t, 2>{0x3000'0000'0000'000C, 0x1000'0000'0000'0008});
+    }
+
+    SECTION("Erasing itself")
+    {
+        std::array<std::uint64_t, 2> lines = {};
+
+        REQUIRE_FALSE(BlitVector<true>(lines.data(), sprite.data(), sprite.size(), 0));
+        REQUIRE(lines == std::array<std::uint64_t, 2>{0xC300'0000'0000'0000, 0x8100'0000'0000'0000});
+
+        REQUIRE(BlitVector<true>(lines.data(), sprite.data(), sprite.size(), 0));
+        REQUIRE(lines == std::array<std::uint64_t, 2>{0, 0});
+    }
+}
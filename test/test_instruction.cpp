@@ -72,3 +72,67 @@ TEST_CASE("Instruction struct can decode instructions", "[instruction]")
         REQUIRE(instruction.nnn() == (instruction.raw & 0x0FFF));
     }
 }
+
+TEST_CASE("Instruction sequences can be fused", "[instruction]")
+{
+    const auto fuse_raw = [](std::uint16_t a, std::uint16_t b, std::uint16_t c, std::uint16_t address = 0x200) {
+        return fuse(decode(Instruction{a}), decode(Instruction{b}), decode(Instruction{c}), address);
+    };
+
+    SECTION("Sprite setup")
+    {
+        const DecodedInstruction op = fuse_raw(0x6312, 0xA345, 0xD675);
+
+        REQUIRE(op.opcode == Opcode::fused_drw);
+        REQUIRE(op.z == 0x3);
+        REQUIRE(op.kk == 0x12);
+        REQUIRE(op.nnn == 0x345);
+        REQUIRE(op.x == 0x6);
+        REQUIRE(op.y == 0x7);
+        REQUIRE(op.n == 0x5);
+        REQUIRE(length(op.opcode) == 3);
+    }
+
+    SECTION("Counted loop")
+    {
+        const DecodedInstruction op = fuse_raw(0x7201, 0x3340, 0x1234);
+
+        REQUIRE(op.opcode == Opcode::fused_loop);
+        REQUIRE(op.x == 0x2);
+        REQUIRE(op.kk == 0x01);
+        REQUIRE(op.y == 0x3);
+        REQUIRE(op.z == 0x40);
+        REQUIRE(op.nnn == 0x234);
+    }
+
+    SECTION("Delay timer wait")
+    {
+        const DecodedInstruction op = fuse_raw(0xF507, 0x3500, 0x1200);
+
+        REQUIRE(op.opcode == Opcode::fused_wait_dt);
+        REQUIRE(op.x == 0x5);
+        REQUIRE(op.y == 0x5);
+        REQUIRE(op.z == 0x00);
+        REQUIRE(op.nnn == 0x200);
+    }
+
+    SECTION("Other sequences are left alone")
+    {
+        REQUIRE(fuse_raw(0x6312, 0xA345, 0x6000).opcode == Opcode::ld_kk);
+        REQUIRE(fuse_raw(0x7201, 0x4340, 0x1234).opcode == Opcode::add_kk);
+        REQUIRE(fuse_raw(0xF507, 0x3500, 0x2200).opcode == Opcode::ld_dt);
+        REQUIRE(length(Opcode::ld_kk) == 1);
+    }
+
+    SECTION("Sequences that halt or fault are left alone")
+    {
+        // Jump to self
+        REQUIRE(fuse_raw(0xF507, 0x3500, 0x1204).opcode == Opcode::ld_dt);
+        // Jump out of range
+        REQUIRE(fuse_raw(0x7201, 0x3340, 0x1FFF).opcode == Opcode::add_kk);
+        // Sprite out of range
+        REQUIRE(fuse_raw(0x6312, 0xAFFC, 0xD675).opcode == Opcode::ld_kk);
+        // Next instruction out of range
+        REQUIRE(fuse_raw(0x6312, 0xA345, 0xD675, 0xFFA).opcode == Opcode::ld_kk);
+    }
+}
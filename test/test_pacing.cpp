@@ -0,0 +1,153 @@
+#include "catch.hpp"
+#include "pacing.hpp"
+
+#include <chrono>
+#include <cmath>
+#include <sstream>
+
+TEST_CASE("RateEstimator converges to a constant rate", "[pacing]")
+{
+    RateEstimator estimator{1.0};
+
+    REQUIRE(estimator.value() == 0);
+
+    // The first sample is taken as is
+    estimator.update(30, 0.05);
+    REQUIRE(estimator.value() == Approx(600));
+
+    for (int i = 0; i < 100; ++i)
+        estimator.update(50, 0.05);
+
+    REQUIRE(estimator.value() == Approx(1000).epsilon(0.01));
+}
+
+TEST_CASE("RateEstimator doesn't depend on the batch length", "[pacing]")
+{
+    RateEstimator short_batches{1.0};
+    RateEstimator long_batches{1.0};
+
+    short_batches.update(600, 1);
+    long_batches.update(600, 1);
+
+    // Two seconds at 1200 Hz, split differently
+    for (int i = 0; i < 40; ++i)
+        short_batches.update(60, 0.05);
+    for (int i = 0; i < 4; ++i)
+        long_batches.update(600, 0.5);
+
+    REQUIRE(short_batches.value() == Approx(long_batches.value()));
+
+    // Empty batches are ignored
+    long_batches.update(100, 0);
+    REQUIRE(short_batches.value() == Approx(long_batches.value()));
+}
+
+TEST_CASE("PiController removes a steady-state error", "[pacing]")
+{
+    // The plant only manages 80% of the requested rate
+    constexpr double target = 600;
+    constexpr double efficiency = 0.8;
+
+    PiController controller{0.2, 0.5, -0.5, 1.0};
+    RateEstimator estimator{1.0};
+    double speedup = 0;
+
+    for (int i = 0; i < 1000; ++i)
+    {
+        estimator.update(target * (1 + speedup) * efficiency * 0.05, 0.05);
+        speedup = controller.update(1 - estimator.value() / target, 0.05);
+    }
+
+    REQUIRE(estimator.value() == Approx(target).epsilon(0.001));
+    REQUIRE(speedup == Approx(1 / efficiency - 1).epsilon(0.001));
+}
+
+TEST_CASE("PiController output is bounded", "[pacing]")
+{
+    PiController controller{0.2, 0.5, -0.5, 1.0};
+
+    // Saturated for a long time, e.g. while the CPU couldn't keep up
+    double speedup = 0;
+    for (int i = 0; i < 1000; ++i)
+        speedup = controller.update(1, 0.05);
+
+    REQUIRE(speedup == 1.0);
+
+    // The integral didn't wind up, so the output drops as soon as the error does
+    REQUIRE(controller.update(-1, 0.05) < 1.0);
+    REQUIRE(controller.update(-10, 0.05) == -0.5);
+}
+
+TEST_CASE("JitterHistogram buckets are powers of two", "[pacing]")
+{
+    using namespace std::chrono_literals;
+
+    JitterHistogram histogram;
+
+    histogram.record(-5us); // Early wake-ups count as on time
+    histogram.record(999ns);
+    histogram.record(1us);
+    histogram.record(3us);
+    histogram.record(4us);
+    histogram.record(1s);
+
+    REQUIRE(histogram.count(0) == 2);
+    REQUIRE(histogram.count(1) == 1);
+    REQUIRE(histogram.count(2) == 1);
+    REQUIRE(histogram.count(3) == 1);
+    REQUIRE(histogram.count(15) == 1);
+    REQUIRE(histogram.samples() == 6);
+    REQUIRE(histogram.maximum() == 1s);
+
+    std::ostringstream out;
+    histogram.print(out);
+    REQUIRE(out.str().find("over 6 wake-ups") != std::string::npos);
+}
+
+TEST_CASE("wait_until doesn't return early", "[pacing]")
+{
+    using clock = std::chrono::steady_clock;
+    using namespace std::chrono_literals;
+
+    const auto spin = GENERATE(as<clock::duration>{}, 0ms, 1ms, 10ms);
+    const auto deadline = clock::now() + 5ms;
+
+    REQUIRE(wait_until<clock>(deadline, spin) >= deadline);
+}
+
+TEST_CASE("PercentileHistogram", "[pacing]")
+{
+    PercentileHistogram histogram;
+
+    REQUIRE(histogram.percentile(0.5) == std::chrono::nanoseconds{0});
+
+    // 1 to 1000 us
+    for (int i = 1; i <= 1000; ++i)
+        histogram.record(std::chrono::microseconds(i));
+
+    REQUIRE(histogram.samples() == 1000);
+    REQUIRE(histogram.maximum() == std::chrono::microseconds(1000));
+
+    // Never below the true value, and at most 12.5% above it
+    for (const double fraction : {0.5, 0.9, 0.99})
+    {
+        const double expected = fraction * 1000;
+        const double actual = std::chrono::duration<double, std::micro>(histogram.percentile(fraction)).count();
+
+        REQUIRE(actual >= expected);
+        REQUIRE(actual <= expected * 1.125 + 1);
+    }
+
+    REQUIRE(histogram.percentile(1.0) == std::chrono::microseconds(1000));
+
+    // Short durations are exact to the microsecond
+    PercentileHistogram short_histogram;
+    for (int i = 0; i < 4; ++i)
+        short_histogram.record(std::chrono::microseconds(i));
+
+    REQUIRE(short_histogram.percentile(0.5) == std::chrono::microseconds(2));
+
+    std::ostringstream out;
+    histogram.print(out);
+    REQUIRE(out.str().find("over 1000 samples") != std::string::npos);
+}
@@ -0,0 +1,103 @@
+#include "catch.hpp"
+#include "random.hpp"
+
+#include <array>
+#include <cstdint>
+
+namespace
+{
+
+template <typename Generator>
+bool same_sequence(Generator a, Generator b)
+{
+    for (int i = 0; i < 100; ++i)
+        if (a() != b())
+            return false;
+
+    return true;
+}
+
+} // namespace
+
+TEST_CASE("splitmix64 matches the reference implementation", "[random]")
+{
+    constexpr std::array<std::uint64_t, 5> expected{
+        6457827717110365317u, 3203168211198807973u, 9817491932198370423u,
+        4593380528125082431u, 16408922859458223821u};
+
+    std::uint64_t state = 1234567;
+
+    for (const auto value : expected)
+        REQUIRE(splitmix64(state) == value);
+}
+
+TEST_CASE("xoshiro256** matches the reference implementation", "[random]")
+{
+    constexpr std::array<std::uint64_t, 10> expected{
+        11520u, 0u, 1509978240u, 1215971899390074240u, 1216172134540287360u,
+        607988272756665600u, 16172922978634559625u, 8476171486693032832u,
+        10595114339597558777u, 2904607092377533576u};
+
+    Xoshiro256 generator{1, 2, 3, 4};
+
+    for (const auto value : expected)
+        REQUIRE(generator() == value);
+}
+
+TEST_CASE("PCG32 matches the reference implementation", "[random]")
+{
+    // pcg32-demo, seeded with 42u and 54u
+    constexpr std::array<std::uint32_t, 6> expected{
+        0xa15c02b7, 0x7b47f409, 0xba1d3330, 0x83d2f293, 0xbfa4784b, 0xcbed606e};
+
+    Pcg32 generator{42, 54};
+
+    for (const auto value : expected)
+        REQUIRE(generator() == value);
+}
+
+TEST_CASE("PCG32 can advance by any number of steps", "[random]")
+{
+    const auto steps = GENERATE(0, 1, 2, 63, 64, 1000);
+
+    Pcg32 stepped{42, 54};
+    Pcg32 advanced{42, 54};
+
+    for (int i = 0; i < steps; ++i)
+        stepped();
+    advanced.advance(steps);
+
+    REQUIRE(same_sequence(stepped, advanced));
+}
+
+TEMPLATE_TEST_CASE("Generators are deterministic", "[random]", Xoshiro256, Pcg32, MersenneTwister)
+{
+    const auto seed = GENERATE(take(10, random(0, 1000000)));
+
+    REQUIRE(same_sequence(TestType{static_cast<std::uint64_t>(seed)}, TestType{static_cast<std::uint64_t>(seed)}));
+    REQUIRE_FALSE(same_sequence(TestType{static_cast<std::uint64_t>(seed)}, TestType{static_cast<std::uint64_t>(seed) + 1}));
+
+    TestType reseeded{0};
+    reseeded();
+    reseeded.seed(seed);
+
+    REQUIRE(same_sequence(TestType{static_cast<std::uint64_t>(seed)}, reseeded));
+}
+
+TEMPLATE_TEST_CASE("Jumping gives independent streams", "[random]", Xoshiro256, Pcg32, MersenneTwister)
+{
+    TestType first{1234};
+    TestType second{1234};
+    TestType third{1234};
+
+    second.jump();
+    third.jump();
+    third.jump();
+
+    REQUIRE_FALSE(same_sequence(first, second));
+    REQUIRE_FALSE(same_sequence(second, third));
+
+    // Jumping is as deterministic as seeding
+    first.jump();
+    REQUIRE(same_sequence(first, second));
+}
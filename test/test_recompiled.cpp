@@ -0,0 +1,125 @@
+#include "catch.hpp"
+#include "cpu.hpp"
+#include "recompiled.hpp"
+#include "utility.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+// Generated by chip8_recompiler at build time
+extern const Recompiled recompiled_test_opcode;
+extern const Recompiled recompiled_test_opcode_modern;
+extern const Recompiled recompiled_bc_test;
+extern const Recompiled recompiled_division_test;
+extern const Recompiled recompiled_sqrt_test;
+extern const Recompiled recompiled_advanced_warfare;
+extern const Recompiled recompiled_self_modifying;
+extern const Recompiled recompiled_fault;
+
+namespace
+{
+
+template <typename T>
+bool equal(const data_view<T>& a, const data_view<T>& b)
+{
+    return a.size() == b.size() && std::equal(a.cbegin(), a.cend(), b.cbegin());
+}
+
+} // namespace
+
+TEST_CASE("Recompiled ROMs", "[recompiled]")
+{
+    const Recompiled* program = GENERATE(&recompiled_test_opcode,
+                                         &recompiled_test_opcode_modern,
+                                         &recompiled_bc_test,
+                                         &recompiled_division_test,
+                                         &recompiled_sqrt_test,
+                                         &recompiled_advanced_warfare);
+
+    CPU interpreter{program->rom, program->profile};
+    CPU recompiled{program->rom, program->profile};
+    recompiled.use_program(*program);
+
+    // Vary the budget, so that blocks are also entered without enough of it
+    for (std::size_t i = 0; i < 5000; ++i)
+    {
+        const std::size_t budget = i % 10 == 9 ? 1000 : i % 7 + 1;
+        const std::size_t executed = interpreter.step(budget);
+
+        REQUIRE(recompiled.step(budget) == executed);
+        REQUIRE(recompiled.read_pc() == interpreter.read_pc());
+        REQUIRE(recompiled.read_vi() == interpreter.read_vi());
+        REQUIRE(equal(recompiled.read_registers(), interpreter.read_registers()));
+        REQUIRE(equal(recompiled.read_stack(), interpreter.read_stack()));
+        REQUIRE(equal(recompiled.read_memory(), interpreter.read_memory()));
+
+        if (executed != budget)
+            break;
+    }
+}
+
+TEST_CASE("Recompiled self-modifying code", "[recompiled]")
+{
+    CPU cpu{recompiled_self_modifying.rom};
+    cpu.use_program(recompiled_self_modifying);
+
+    // 0xF155 overwrites the following instruction, which must not run as translated
+    REQUIRE(cpu.step(100) == 5);
+    REQUIRE(cpu.read_pc() == 0x20A);
+    REQUIRE(cpu.read_registers()[0xA] == 0x42);
+}
+
+TEST_CASE("Recompiled faults", "[recompiled]")
+{
+    CPU cpu{recompiled_fault.rom};
+    cpu.use_program(recompiled_fault);
+
+    // 0xD015 draws past the end of memory, after the rest of its block was charged
+    const CPU::RunResult result = cpu.run(100);
+
+    REQUIRE(result.reason == CPU::StopReason::Fault);
+    REQUIRE(result.executed == 2);
+    REQUIRE(result.address == 0x204);
+    REQUIRE(result.fault->kind == CPU::FaultKind::InvalidMemoryAccess);
+    REQUIRE(cpu.read_vi() == 0xFFF);
+    REQUIRE(cpu.read_statistics().instructions == 2);
+
+    REQUIRE_THROWS_AS(cpu.step(100), std::out_of_range);
+}
+
+TEST_CASE("Loading recompiled programs", "[recompiled]")
+{
+    constexpr std::array<std::uint8_t, 2> other_rom{0x12, 0x00};
+
+    SECTION("No program loaded")
+    {
+        CPU cpu{recompiled_test_opcode.rom};
+        REQUIRE_THROWS_AS(cpu.use_engine(CPU::Engine::Recompiled), std::logic_error);
+    }
+
+    SECTION("Different ROM")
+    {
+        CPU cpu{byte_view{other_rom.data(), other_rom.size()}};
+        REQUIRE_THROWS_AS(cpu.use_program(recompiled_test_opcode), std::invalid_argument);
+    }
+
+    SECTION("Different shifting behaviour")
+    {
+        CPU cpu{recompiled_test_opcode.rom, Profile::Modern};
+        REQUIRE_THROWS_AS(cpu.use_program(recompiled_test_opcode), std::invalid_argument);
+    }
+
+    SECTION("Switching engines")
+    {
+        CPU cpu{recompiled_test_opcode.rom};
+        cpu.use_program(recompiled_test_opcode);
+        cpu.use_engine(CPU::Engine::Switch);
+        cpu.use_engine(CPU::Engine::Recompiled);
+
+        REQUIRE(cpu.step(10) == 10);
+    }
+}
@@ -39,3 +39,21 @@ TEST_CASE("Timer doesn't underflow")
 
     REQUIRE(timer.read() == 0);
 }
+
+TEST_CASE("Timer can count down emulated time", "[timer]")
+{
+    BasicTimer<CycleClock> timer;
+
+    const auto at = [](int ticks) {
+        return CycleClock::time_point{CycleClock::duration{ticks}};
+    };
+
+    auto n = GENERATE(take(10, random(0x00, 0xff)));
+    auto t = GENERATE(take(10, random(0, 300)));
+
+    timer.set(n, at(100));
+
+    REQUIRE(timer.read(at(100)) == n);
+    REQUIRE(timer.read(at(100 + t)) == std::max(n - t, 0));
+    REQUIRE(timer.remaining(at(100 + t)) == CycleClock::duration{std::max(n - t, 0)});
+}
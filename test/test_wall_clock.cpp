@@ -0,0 +1,42 @@
+#include "catch.hpp"
+#include "cpu.hpp"
+#include "timing.hpp"
+#include "utility.hpp"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+// Built into run_tests_wall_clock, where the timers count down with a WallClock like chip8_vm's
+static_assert(std::is_same_v<decltype(MachineState::DT)::clock, WallClock>);
+
+TEST_CASE("COSMAC VIP timing with a wall clock", "[cpu]")
+{
+    constexpr std::array<std::uint8_t, 12> rom{
+        0x60, 0x02, // ld_kk (load 0x02 to V0)
+        0xF0, 0x15, // set_dt (load V0 to DT)
+        0xF1, 0x07, // ld_dt (load DT to V1)
+        0x31, 0x00, // se_x_kk (exit the loop when V1 is 0x00)
+        0x12, 0x04, // jp (jump back to ld_dt)
+        0x12, 0x0A  // jp (jump to self)
+    };
+
+    const std::size_t budget = GENERATE(1, 3, 100);
+
+    CPU cpu{byte_view{rom.data(), rom.size()}};
+    cpu.use_timing(CPU::Timing::CosmacVIP);
+
+    std::size_t executed = 0;
+    for (std::size_t n; (n = cpu.step(budget)) != 0;)
+        executed += n;
+
+    // DT follows the machine cycles, not the host, so it expires on the same cycle as with a CycleClock
+    const std::uint64_t expired = 2 * VipTiming::CyclesPerFrame + VipTiming::StolenCycles;
+    const std::uint64_t iteration = 3 * VipTiming::FetchCycles + 10 + 10 + 12;
+
+    REQUIRE(cpu.read_registers()[1] == 0x00);
+    REQUIRE(cpu.read_state().Cycles > expired);
+    REQUIRE(cpu.read_state().Cycles <= expired + iteration + 4);
+    REQUIRE(executed > 2 * VipTiming::CyclesPerFrame / iteration);
+}